@@ -31,6 +31,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <time.h>
 
 /* Include the compile parameters and version headers */
 #include <params.h>
@@ -136,6 +137,14 @@ struct interval
 	unsigned int end_bit;
 };
 
+/* Table of pi(x) values for x < 30 */
+extern const unsigned int pi_under_30[30];
+
+/* Counts the primes that sieving skips over, which must be added to a
+   sieved count by hand */
+uint64_t skipped_primes_upto(uint64_t x);
+uint64_t skipped_primes(uint64_t min, uint64_t max);
+
 /* These calculate the bit/byte intervals needed for sieving */
 void calculate_seed_interval(
 		uint64_t max,
@@ -155,14 +164,73 @@ struct prime
 	uint32_t wheel_idx; /* Current index in the wheel table */
 };
 
+/* Runs the seed sieve, and adds the primes it finds to a prime set.
+   sieve_seed() does both at once. */
+uint8_t * seed_find(uint64_t end_byte);
+void seed_fill(
+		const uint8_t * seed_sieve,
+		uint64_t end_byte,
+		unsigned int end_bit,
+		struct prime_set * set);
+
+/* A seed sieve from seed_get(), which may be mapped from the on-disk
+   cache rather than computed */
+struct seed
+{
+	const uint8_t * bits; /* Seed sieve bits                       */
+	uint64_t bytes;       /* Number of bytes covered               */
+	uint8_t * owned;      /* Allocated bits, if computed           */
+	void * map;           /* Mapping of the cache file, if mapped  */
+	size_t map_len;       /* Length of the mapping                 */
+};
+
+/* Gets a seed sieve covering end_byte bytes, using the cache if asked,
+   and releases it again */
+void seed_get(struct seed * seed, uint64_t end_byte, int use_cache);
+void seed_put(struct seed * seed);
+
 /* Finds the sieving primes */
 void sieve_seed(
 		uint64_t end_byte,
 		unsigned int end_bit,
 		struct prime_set * set);
 
-/* Sieves a segment */
+/* The same, for narrow windows (see below), on up to threads threads,
+   returning how many were used */
+struct window;
+unsigned int seed_fill_window(
+		const uint8_t * seed_sieve,
+		uint64_t end_byte,
+		unsigned int end_bit,
+		struct window * win,
+		unsigned int threads);
+unsigned int sieve_seed_window(
+		uint64_t end_byte,
+		unsigned int end_bit,
+		struct window * win,
+		unsigned int threads);
+
+/* Describes a segment that has just been sieved, as handed to a
+   segment callback.  The bits of the segment are in sieve, with
+   sieve[0] corresponding to byte start.  start_bit and end_bit work the
+   same as in struct interval. */
+struct segment
+{
+	const uint8_t * sieve;  /* Sieved bits of the segment  */
+	uint64_t start;         /* First byte of the segment   */
+	uint64_t end;           /* First byte not in segment   */
+	unsigned int start_bit; /* First bit of start checked  */
+	unsigned int end_bit;   /* First bit of end - 1 not checked, or 0 */
+	uint64_t count;         /* Primes found on the segment */
+};
+
+/* Routine called by sieve_interval() after each segment is sieved */
+typedef void (*segment_callback)(const struct segment * seg, void * data);
+
+/* Sieves a segment into the sieve buffer provided, which must be at
+   least LARGE_SEGMENT_BYTES long */
 void sieve_segment(
+		uint8_t * sieve,
 		uint64_t start,
 		unsigned int start_bit,
 		uint64_t end,
@@ -170,11 +238,63 @@ void sieve_segment(
 		struct prime_set * set,
 		uint64_t * count);
 
-/* Sieves an interval */
+/* The marking loops of sieve_segment(), on their own */
+struct bucket;
+void mark_small_primes(uint8_t * sieve, struct prime * primes, size_t n);
+void mark_large_bucket(
+		uint8_t * sieve,
+		struct prime_set * set,
+		struct bucket * bucket);
+
+/* Sieves an interval.  If callback is not NULL, it is called with data
+   after each segment is sieved. */
 void sieve_interval(
 		const struct interval * inter,
 		struct prime_set * set,
-		uint64_t * count);
+		uint64_t * count,
+		segment_callback callback,
+		void * data);
+
+/* Intervals of at most this many segments may be sieved as a narrow
+   window, without a prime set */
+#define WINDOW_SEGMENTS (4U)
+
+/* Checks whether an interval is better sieved as a narrow window, given
+   the end of the seed sieve it needs */
+int window_preferred(const struct interval * inter, uint64_t seed_end_byte);
+
+/* Sieves an interval as a narrow window, like sieve_interval() */
+void sieve_window(
+		const struct interval * inter,
+		struct window * win,
+		uint64_t * count,
+		segment_callback callback,
+		void * data);
+
+/* Sieves [min, max] from scratch, using a seed sieve covering max */
+uint64_t sieve_range(
+		uint64_t min,
+		uint64_t max,
+		const uint8_t * seed_sieve,
+		segment_callback callback,
+		void * data);
+
+/* Counts the primes on a sieved segment that are no more than x */
+uint64_t segment_count_upto(const struct segment * seg, uint64_t x);
+
+/* Checks whether a segment reaches far enough to count up to x */
+int segment_reaches(const struct segment * seg, uint64_t x);
+
+/* Progress display, for use as a segment callback */
+struct progress
+{
+	uint64_t start;       /* Start byte of the interval  */
+	uint64_t end;         /* End byte of the interval    */
+	unsigned int percent; /* Last percentage displayed   */
+};
+void progress_start(struct progress * prog, const struct interval * inter);
+void progress_update(const struct segment * seg, void * data);
+void progress_finish(void);
 
 /**********************************************************************\
  * Pre-sieve mechanism                                                *
@@ -182,11 +302,432 @@ void sieve_interval(
 
 void presieve_init(void);
 void presieve_cleanup(void);
+void presieve_localize(void);
 void presieve_copy(
 		uint8_t * sieve,
 		uint64_t start,
 		uint64_t end);
 
+/**********************************************************************\
+ * Prime bitmap files                                                 *
+\**********************************************************************/
+
+/*
+ * A bitmap file holds the sieved bits for [0, max], in exactly the
+ * layout that sieve_segment() produces: byte k covers 30k to 30k + 29,
+ * with one bit for each of the eight residues in wheel30_offs.  It is
+ * preceded by a header of BITMAP_HEADER_BYTES bytes.  As in the sieve,
+ * the bits for numbers under 30 are not meaningful; lookups handle those
+ * numbers with a table instead.
+ */
+#define BITMAP_HEADER_BYTES (64U)
+
+/* An opened (memory-mapped) bitmap file */
+struct bitmap
+{
+	const uint8_t * bits; /* Sieved bits, starting with byte 0 */
+	uint64_t max;         /* Largest number covered            */
+	void * map;           /* Start of the mapping              */
+	size_t map_len;       /* Length of the mapping             */
+};
+
+/* Writing bitmap files.  bitmap_write_segment() is a segment
+   callback, and expects the FILE * returned by bitmap_create(). */
+FILE * bitmap_create(const char * path, uint64_t max);
+void bitmap_write_segment(const struct segment * seg, void * data);
+int bitmap_finish(FILE * file, const char * path);
+
+/* Opening and closing bitmap files for lookups */
+int bitmap_open(struct bitmap * bm, const char * path);
+void bitmap_close(struct bitmap * bm);
+
+/* Looks up many numbers at once, writing 1 (prime) or 0 (not prime) to
+   each entry of result.  Every number must be no more than bm->max. */
+void bitmap_isprime_batch(
+		const struct bitmap * bm,
+		const uint64_t * n,
+		size_t count,
+		uint8_t * result);
+
+/**********************************************************************\
+ * Primality testing of single numbers                                *
+\**********************************************************************/
+
+/* Sets up the trial division table (requires the wheel tables and the
+   pre-sieve), and frees it again */
+void primality_init(void);
+void primality_cleanup(void);
+
+/* Deterministically tests a number for primality.  The batch version
+   writes 1 (prime) or 0 (not prime) to each entry of result. */
+int yase_is_prime_u64(uint64_t n);
+void yase_is_prime_u64_batch(
+		const uint64_t * n,
+		size_t count,
+		uint8_t * result);
+
+/**********************************************************************\
+ * NUMA placement                                                     *
+\**********************************************************************/
+
+/* Most NUMA nodes looked for */
+#define MAX_NUMA_NODES (64U)
+
+/* Pinning worker threads to CPUs spread over the nodes */
+unsigned int numa_pin(unsigned int worker);
+void numa_unpin(void);
+int numa_node(void);
+
+/* Read-only data with a copy on each node that uses it */
+struct numa_replica
+{
+	const void * src;               /* Original                      */
+	size_t len;                     /* Length in bytes               */
+	void * copies[MAX_NUMA_NODES];  /* Copy on each node, or NULL    */
+};
+
+void numa_replica_init(struct numa_replica * rep, const void * src,
+                       size_t len);
+const void * numa_replica_get(struct numa_replica * rep);
+const void * numa_replica_local(const struct numa_replica * rep);
+void numa_replica_cleanup(struct numa_replica * rep);
+
+/**********************************************************************\
+ * Batches of range queries                                           *
+\**********************************************************************/
+
+/* A range of numbers on which to count primes */
+struct range
+{
+	uint64_t min;   /* First number in the range */
+	uint64_t max;   /* Last number in the range  */
+	uint64_t count; /* Primes found on the range */
+};
+
+/* Counts the primes on many ranges at once, using a seed sieve (from
+   seed_find()) that covers the largest range */
+void count_ranges(
+		struct range * ranges,
+		size_t n,
+		const uint8_t * seed_sieve,
+		unsigned int threads);
+
+/* Counts the primes on every range listed in a file, using the given
+   number of threads (0 for one per online CPU) and optionally the seed
+   cache.  Returns the exit status. */
+int batch_run(const char * path, unsigned int threads, int use_cache);
+
+/* Finds how many threads to use when none are requested */
+unsigned int default_threads(void);
+
+/**********************************************************************\
+ * Combinatorial prime counting                                       *
+\**********************************************************************/
+
+/* Counts the primes no more than x without sieving all of [0, x], using
+   the given number of threads (0 for one per online CPU) and optionally
+   the seed cache */
+uint64_t pi_count(uint64_t x, unsigned int threads, int use_cache);
+
+/* Checks whether a range is better counted as pi(max) - pi(min - 1) with
+   pi_count() than by sieving */
+int pi_count_preferred(uint64_t min, uint64_t max);
+
+/**********************************************************************\
+ * Checkpoint tables of pi(x)                                         *
+\**********************************************************************/
+
+/* An opened (memory-mapped) pi table, holding pi(k * step) for
+   k = 0 to n - 1 */
+struct pi_table
+{
+	const uint64_t * counts; /* pi(k * step) for each k      */
+	uint64_t step;           /* Distance between checkpoints */
+	uint64_t n;              /* Number of checkpoints        */
+	void * map;              /* Start of the mapping         */
+	size_t map_len;          /* Length of the mapping        */
+};
+
+/* Sieves [0, max] and writes a pi table with checkpoints every step to
+   path, using the given number of threads (0 for one per online CPU)
+   and optionally the seed cache.  Returns the exit status. */
+int pi_table_make(const char * path, uint64_t step, uint64_t max,
+                  unsigned int threads, int use_cache);
+
+/* Opening and closing pi tables */
+int pi_table_open(struct pi_table * table, const char * path);
+void pi_table_close(struct pi_table * table);
+
+/* Counts the primes on [min, max], sieving only from the nearest
+   checkpoints */
+uint64_t pi_table_count(const struct pi_table * table, uint64_t min,
+                        uint64_t max, unsigned int threads, int use_cache);
+
+/**********************************************************************\
+ * Resumable runs                                                     *
+\**********************************************************************/
+
+/* State of a run that is saved as it goes, so that it can be resumed */
+struct resume
+{
+	const char * path;       /* State file                            */
+	uint64_t min;            /* Start of the whole run                */
+	uint64_t max;            /* End of the whole run                  */
+	uint64_t from;           /* First number sieved by this process   */
+	uint64_t count;          /* Primes found before from              */
+	uint64_t sieved;         /* Primes sieved by this process so far  */
+	int done;                /* Nonzero if nothing is left to sieve   */
+	time_t saved;            /* When the state was last saved         */
+	struct progress * prog;  /* Progress display to update, or NULL   */
+};
+
+/* Starts or resumes a run using the state file path.  resume_segment()
+   is the segment callback for the run, and resume_finish() saves the
+   final count. */
+int resume_start(struct resume * res, const char * path, uint64_t min,
+                 uint64_t max);
+void resume_segment(const struct segment * seg, void * data);
+int resume_finish(struct resume * res, uint64_t count);
+
+/**********************************************************************\
+ * Live telemetry                                                     *
+\**********************************************************************/
+
+/* Snapshots of a running sieve, taken on a timer or on SIGUSR1 */
+struct telemetry
+{
+	segment_callback inner;  /* Callback wrapped, or NULL             */
+	void * inner_data;       /* Data for inner                        */
+	const uint64_t * count;  /* Primes found so far, or NULL          */
+	uint64_t start;          /* First byte of the run                 */
+	uint64_t end;            /* End byte of the run                   */
+	FILE * file;             /* Where snapshots go                    */
+	double started;          /* When the run started                  */
+	double last_time;        /* When the last snapshot was taken      */
+	uint64_t last_byte;      /* End byte of the run at that snapshot  */
+	double rate;             /* Moving average of numbers per second  */
+};
+
+/* Takes over SIGUSR1 as soon as a run starts.  Then telemetry_start()
+   starts telemetry for the sieve, with a snapshot every seconds seconds
+   (0 for only on SIGUSR1) to the file path (NULL for stderr).
+   telemetry_segment() is the segment callback, wrapping inner. */
+void telemetry_init(void);
+int telemetry_start(struct telemetry * tel, const struct interval * inter,
+                    unsigned int seconds, const char * path);
+void telemetry_segment(const struct segment * seg, void * data);
+void telemetry_finish(struct telemetry * tel);
+
+/**********************************************************************\
+ * Memoized segment counts                                            *
+\**********************************************************************/
+
+/* An opened memo file of whole-segment counts */
+struct memo
+{
+	const char * path; /* Memo file                              */
+	int fd;            /* Open file descriptor                   */
+	uint64_t reused;   /* Segments counted from the memo so far  */
+	uint64_t sieved;   /* Segments sieved so far                 */
+	int failed;        /* Nonzero once recording a count failed  */
+};
+
+/* Opening (or creating) and closing memo files */
+int memo_open(struct memo * memo, const char * path);
+void memo_close(struct memo * memo);
+
+/* Counts the primes on [min, max] that sieving finds, taking the counts
+   of whole segments from the memo where it has them and recording the
+   rest, using a seed sieve that covers max */
+uint64_t memo_count(struct memo * memo, uint64_t min, uint64_t max,
+                    const uint8_t * seed_sieve);
+
+/**********************************************************************\
+ * Run statistics                                                     *
+\**********************************************************************/
+
+/* Phases of a run timed for --stats */
+enum stats_phase
+{
+	PHASE_WHEEL_INIT,
+	PHASE_PRESIEVE_INIT,
+	PHASE_SEED,
+	PHASE_PRESIEVE_COPY,
+	PHASE_SMALL_PRIMES,
+	PHASE_LARGE_PRIMES,
+	PHASE_ADVANCE,
+	PHASE_POPCNT,
+	PHASE_COUNT
+};
+
+/* Hardware events counted for --perf */
+enum stats_counter
+{
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_L1D_MISSES,
+	COUNTER_LLC_MISSES,
+	COUNTER_DTLB_MISSES,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_COUNT
+};
+
+/* A moment in wall clock and CPU time, in nanoseconds, and the hardware
+   event counts at that moment if they are being read */
+struct stats_stamp
+{
+	uint64_t wall;
+	uint64_t cpu;
+	uint64_t counters[COUNTER_COUNT];
+};
+
+/* Number of bins in the histogram of buckets per segment: 0, 1, 2-3,
+   4-7, and so on, with the last bin holding everything larger */
+#define STATS_HISTOGRAM_BINS 20
+
+/* Statistics gathered while enabled.  They are not synchronized, so
+   they must only be enabled while a single thread sieves. */
+struct stats
+{
+	int enabled;                   /* Nonzero to gather statistics */
+	struct stats_stamp start;      /* When gathering began         */
+	uint64_t wall[PHASE_COUNT];    /* Wall time spent in each phase */
+	uint64_t cpu[PHASE_COUNT];     /* CPU time spent in each phase  */
+	uint64_t segments;             /* Segments sieved               */
+	uint64_t buckets;              /* Buckets of large primes used  */
+	uint64_t windows;              /* Narrow windows (no buckets)   */
+	int perf;                      /* Nonzero if counters are read  */
+	uint64_t counters[PHASE_COUNT][COUNTER_COUNT]; /* Event counts   */
+
+	/* Prime set memory and bucket traffic */
+	uint64_t lists;                /* List heads allocated now      */
+	uint64_t lists_peak;           /* Most ever allocated           */
+	uint64_t live;                 /* Buckets allocated now         */
+	uint64_t live_peak;            /* Most ever allocated           */
+	uint64_t pool;                 /* Buckets in the pool now       */
+	uint64_t pool_peak;            /* Most ever in the pool         */
+	uint64_t inactive;             /* Buckets of inactive primes    */
+	uint64_t inactive_peak;        /* Most ever inactive            */
+	uint64_t inactive_sum;         /* Sum over each advance         */
+	uint64_t advances;             /* Calls to prime_set_advance()  */
+	uint64_t activated;            /* Primes activated              */
+	uint64_t activated_last;       /* ... as of the last advance    */
+	uint64_t activated_peak;       /* Most activated by one advance */
+	uint64_t repasses;             /* Extra passes over large primes */
+	uint64_t segment_buckets;      /* Buckets used in this segment  */
+	uint64_t histogram[STATS_HISTOGRAM_BINS]; /* Segments by buckets */
+};
+extern struct stats yase_stats;
+
+/* Starting, timing phases and reporting */
+void stats_start(void);
+int stats_perf_open(void);
+void stats_now(struct stats_stamp * stamp);
+void stats_phase_end(enum stats_phase phase, struct stats_stamp * stamp);
+void stats_segment(void);
+void stats_advance(void);
+void stats_report(FILE * file, uint64_t numbers);
+void stats_json(FILE * file);
+
+/*
+ * Hooks for the sieve.  STATS_BEGIN() stamps the start of a phase, and
+ * STATS_END() adds the time since the stamp to a phase and restamps, so
+ * that back-to-back phases need one stamp each.  STATS_PEAK() counts
+ * like STATS_COUNT() and keeps track of the highest count.
+ * STATS_SEGMENT() and STATS_ADVANCE() mark the end of each segment and
+ * each advance of a prime set.  With PHASE_STATS set to 0 in
+ * config.cmake, they all compile to nothing.
+ */
+#if PHASE_STATS
+#define STATS_STAMP(name) struct stats_stamp name
+#define STATS_BEGIN(stamp) \
+	do { if(yase_stats.enabled) stats_now(&(stamp)); } while(0)
+#define STATS_END(phase, stamp) \
+	do { if(yase_stats.enabled) stats_phase_end((phase), &(stamp)); } \
+	while(0)
+#define STATS_COUNT(counter, n) \
+	do { if(yase_stats.enabled) yase_stats.counter += (n); } while(0)
+#define STATS_PEAK(counter, peak, n) \
+	do { if(yase_stats.enabled) { \
+		yase_stats.counter += (n); \
+		if(yase_stats.counter > yase_stats.peak) \
+			yase_stats.peak = yase_stats.counter; } } while(0)
+#define STATS_SEGMENT() \
+	do { if(yase_stats.enabled) stats_segment(); } while(0)
+#define STATS_ADVANCE() \
+	do { if(yase_stats.enabled) stats_advance(); } while(0)
+#else
+#define STATS_STAMP(name)
+#define STATS_BEGIN(stamp) do { } while(0)
+#define STATS_END(phase, stamp) do { } while(0)
+#define STATS_COUNT(counter, n) do { } while(0)
+#define STATS_PEAK(counter, peak, n) do { } while(0)
+#define STATS_SEGMENT() do { } while(0)
+#define STATS_ADVANCE() do { } while(0)
+#endif
+
+/**********************************************************************\
+ * Tracing                                                            *
+\**********************************************************************/
+
+/*
+ * USDT probes, for tracing a running yase with bpftrace, perf probe or
+ * SystemTap without rebuilding it.  Each probe is a single nop in the
+ * code until a tracer attaches, plus a note in the binary telling the
+ * tracer where the nop is and where to find its arguments.  They are
+ * compiled in whenever sys/sdt.h is found.  The provider is "yase":
+ *
+ *  segment_start(start_byte, end_byte)     before sieving a segment
+ *  segment_end(start_byte, end_byte, count) after counting it
+ *  bucket_alloc(set, from_pool)            taking a bucket for a set
+ *  bucket_return(set)                      returning one to the pool
+ *  activate(set, segment, primes)          after a set's advance
+ *  seed_start(end_byte)                    starting the seed sieve
+ *  seed_sieved(end_byte)                   seed sieve done
+ *  seed_filled(end_byte, end_bit)          sieving primes all added
+ *
+ * Segment bounds are byte indices: byte k holds 30k through 30k + 29.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define YASE_PROBE1(name, a) DTRACE_PROBE1(yase, name, a)
+#define YASE_PROBE2(name, a, b) DTRACE_PROBE2(yase, name, a, b)
+#define YASE_PROBE3(name, a, b, c) DTRACE_PROBE3(yase, name, a, b, c)
+#else
+#define YASE_PROBE1(name, a) do { } while(0)
+#define YASE_PROBE2(name, a, b) do { } while(0)
+#define YASE_PROBE3(name, a, b, c) do { } while(0)
+#endif
+
+/**********************************************************************\
+ * Benchmarks (yase-bench only)                                       *
+\**********************************************************************/
+
+/* Runs the microbenchmarks of the sieve's inner loops */
+void bench_kernels(unsigned int trials, int (*selected)(const char * name),
+                   FILE * json);
+
+/* Runs the strong and weak thread scaling benchmarks.  Returns nonzero
+   if the counts agreed. */
+int bench_scaling(unsigned int max_threads, unsigned int warmup,
+                  unsigned int repeats, int (*selected)(const char * name),
+                  FILE * json);
+
+/* Checks the sieve's counts against known values and a reference sieve,
+   and compares two sets of results.  Both return nonzero on success. */
+int bench_check(uint64_t seed);
+int bench_compare(const char * current, const char * baseline,
+                  double threshold);
+
+/**********************************************************************\
+ * Query server                                                       *
+\**********************************************************************/
+
+/* Serves queries on a Unix domain socket, with a pool of threads (0 for
+   one per online CPU) and optionally the seed cache.  Only returns
+   (with the exit status) if setting up fails. */
+int server_run(const char * path, unsigned int threads, int use_cache);
+
 /**********************************************************************\
  * Argument processing                                                *
 \**********************************************************************/
@@ -197,16 +738,58 @@ enum args_action
 	ACTION_FAIL,
 	ACTION_HELP,
 	ACTION_VERSION,
-	ACTION_SIEVE
+	ACTION_SIEVE,
+	ACTION_DUMP,
+	ACTION_LOOKUP,
+	ACTION_TEST,
+	ACTION_BATCH,
+	ACTION_SERVE,
+	ACTION_MAKE_TABLE,
+	ACTION_TABLE
 };
 
-/* Processes arguments, writing back the maximum value given on the
-   command line if the action to take is ACTION_SIEVE */
+/* Largest number of threads that may be requested */
+#define MAX_THREADS (1024U)
+
+/* Values given on the command line */
+struct args
+{
+	uint64_t min;      /* Minimum value to check               */
+	uint64_t max;      /* Maximum value to check               */
+	const char * file; /* File or socket for the chosen mode   */
+	char ** values;    /* Numbers for ACTION_LOOKUP/ACTION_TEST
+	                      (allocated; the caller frees it)    */
+	int n_values;      /* Number of entries in values          */
+	unsigned int threads; /* Worker threads, or 0 for default  */
+	int use_cache;        /* Nonzero to use the seed cache      */
+	int sieve;            /* Nonzero to always count by sieving */
+	uint64_t step;        /* Checkpoint spacing for --make-table */
+	int reporting;        /* Nonzero to print counts at checkpoints */
+	uint64_t checkpoint_step; /* Spacing of checkpoints, or 0 */
+	const char * at_file;     /* File of checkpoints, or NULL */
+	const char * resume_file; /* State file to resume, or NULL */
+	const char * memo_file;   /* Memo of segment counts, or NULL */
+	int stats;                /* Nonzero to report run statistics */
+	int perf;                 /* Nonzero to add hardware counters */
+	int quiet;                /* Nonzero to print only the result */
+	int json;                 /* Nonzero to print it as JSON      */
+	unsigned int telemetry;   /* Seconds between snapshots, or 0  */
+	const char * telemetry_file; /* Snapshot file, or NULL        */
+};
+
+/* Default and largest intervals between telemetry snapshots */
+#define DEFAULT_TELEMETRY_SECONDS (10U)
+#define MAX_TELEMETRY_SECONDS (86400U)
+
+/* Default checkpoint spacing for --make-table */
+#define DEFAULT_TABLE_STEP (UINT64_C(1000000000))
+
+/* Processes arguments, writing back the values given on the command
+   line to args */
 enum args_action process_args(
 		int argc,
 		char * argv[],
-		uint64_t * min,
-		uint64_t * max);
+		struct args * args);
 
 /**********************************************************************\
  * Evaluation of mathematical expressions, e.g. for command line      *
@@ -226,6 +809,12 @@ struct bucket
 	struct prime primes[BUCKET_PRIMES]; /* Prime storage           */
 };
 
+/* Empty buckets move between a set's pool and the shared depot in
+   magazines of this many, and the depot keeps at most this many
+   magazines for each NUMA node */
+#define BUCKET_MAGAZINE (16U)
+#define BUCKET_DEPOT_MAGAZINES (64U)
+
 /* Set structure - contains sieving primes stored to sieve a particular
    interval */
 struct prime_set
@@ -241,6 +830,9 @@ struct prime_set
 	struct bucket * inactive_end; /* Last node, for fast insertion   */
 	struct bucket * unused;       /* List of unused sieving primes   */
 	struct bucket * pool;         /* Pool of unused buckets          */
+	unsigned long pool_size;      /* Number of buckets in the pool   */
+	int pool_tried;               /* Nonzero if the depot was found
+	                                 empty since the pool last was   */
 	struct bucket ** lists;       /* List for each seg. in interval  */
 };
 
@@ -258,10 +850,43 @@ void prime_set_add(struct prime_set * set,
 /* Sets up the set/lists to sieve the next segment */
 void prime_set_advance(struct prime_set * set);
 
-/* Frees any memory allocated for the prime set, including the primes it
-   contains */
+/* Frees any memory allocated for the prime set, handing its buckets
+   to the depot */
 void prime_set_cleanup(struct prime_set * set);
 
+/* Moving a magazine of empty buckets between a set's pool and the
+   depot, and freeing every bucket in the depot */
+void prime_set_pool_refill(struct prime_set * set);
+void prime_set_pool_spill(struct prime_set * set);
+void prime_set_depot_cleanup(void);
+
+/* Sieving primes for a narrow window, in flat arrays */
+struct window
+{
+	uint64_t start;        /* Start byte of the window         */
+	uint64_t end;          /* End byte of the window           */
+	struct prime * small;  /* Small sieving primes             */
+	size_t n_small;        /* Number of small sieving primes   */
+	size_t small_alloc;    /* Number allocated                 */
+	struct prime * large;  /* Large sieving primes             */
+	size_t n_large;        /* Number of large sieving primes   */
+	size_t large_alloc;    /* Number allocated                 */
+};
+
+/* Initializing a window, adding sieving primes (which have multiples in
+   the window) to it, and freeing it */
+void window_init(struct window * win, const struct interval * inter);
+void window_add(struct window * win,
+		uint64_t prime,
+		uint64_t next_byte,
+		uint32_t wheel_idx);
+void window_cleanup(struct window * win);
+
+/* Initializing an empty window over the same bytes as another, and
+   moving its primes onto the end of the other's */
+void window_init_like(struct window * win, const struct window * like);
+void window_merge(struct window * win, struct window * from);
+
 /**********************************************************************\
  * Inline routines                                                    *
 \**********************************************************************/
@@ -294,6 +919,22 @@ static inline void mark_multiple_210(
 	*wheel_idx += wheel210[*wheel_idx].next;
 }
 
+/* Bitmasks for each residue mod 30 in a bitmap byte (0 for residues
+   not on the wheel), and a bitmask of the primes under 30 */
+extern const uint8_t bitmap_masks[30];
+#define BITMAP_PRIMES_UNDER_30 (0x208A28ACUL)
+
+/* Returns nonzero if n is prime, according to the bitmap.  n must be no
+   more than bm->max. */
+static inline int bitmap_isprime(const struct bitmap * bm, uint64_t n)
+{
+	if(n < 30)
+	{
+		return (BITMAP_PRIMES_UNDER_30 >> n) & 1;
+	}
+	return (bm->bits[n / 30] & bitmap_masks[n % 30]) != 0;
+}
+
 /* Adds a prime to a bucket.  Returns false/zero if there's no space,
    true/nonzero otherwise. */
 static inline int bucket_append(
@@ -314,13 +955,17 @@ static inline int bucket_append(
 	return 1;
 }
 
-/* Allocates a bucket for a set, drawing on the existing pool if
-   possible */
+/* Allocates a bucket for a set, drawing on the existing pool, or else
+   the depot, if possible */
 static inline struct bucket * prime_set_bucket_init(
 		struct prime_set * set,
 		struct bucket * next)
 {
 	struct bucket * node;
+	if(set->pool == NULL && !set->pool_tried)
+	{
+		prime_set_pool_refill(set);
+	}
 	if(set->pool == NULL)
 	{
 		/* None left in pool.  Allocate one from scratch. */
@@ -330,12 +975,17 @@ static inline struct bucket * prime_set_bucket_init(
 			YASE_PERROR("malloc");
 			abort();
 		}
+		STATS_PEAK(live, live_peak, 1);
+		YASE_PROBE2(bucket_alloc, set, 0);
 	}
 	else
 	{
 		/* Use one from the set's pool */
 		node = set->pool;
 		set->pool = node->next;
+		set->pool_size--;
+		STATS_COUNT(pool, -1);
+		YASE_PROBE2(bucket_alloc, set, 1);
 	}
 	node->count = 0UL;
 	node->next = next;
@@ -361,13 +1011,21 @@ static inline void prime_set_list_append(
 	}
 }
 
-/* Returns a bucket to a pool for later use */
+/* Returns a bucket to a pool for later use, passing a magazine on to
+   the depot if the pool has grown to two */
 static inline void prime_set_bucket_return(
 		struct prime_set * set,
 		struct bucket * bucket)
 {
 	bucket->next = set->pool;
 	set->pool = bucket;
+	set->pool_tried = 0;
+	STATS_PEAK(pool, pool_peak, 1);
+	YASE_PROBE1(bucket_return, set);
+	if(++set->pool_size >= 2 * BUCKET_MAGAZINE)
+	{
+		prime_set_pool_spill(set);
+	}
 }
 
 /* Saves a processed prime into its next list.  This is only used for
@@ -29,16 +29,52 @@
 #include <string.h>
 #include <yase.h>
 
-/* Processes program arguments, returning the action to take.  If the
-   action is ACTION_SIEVE (i.e. normal program execution), this will
-   write out the maximum value to check to the pointer passed. */
+/* Evaluates an expression given on the command line, printing an error
+   message naming what it is if it is invalid */
+static int evaluate_arg(const char * arg, const char * what,
+                        uint64_t * result)
+{
+	if(!evaluate(arg, result))
+	{
+		fprintf(stderr, "%s: failed to evaluate %s\n",
+		        yase_program_name, what);
+		return 0;
+	}
+	return 1;
+}
+
+/* Processes program arguments, returning the action to take.  The
+   values given on the command line are written back to args. */
 enum args_action process_args(
 		int argc,
 		char * argv[],
-		uint64_t * min,
-		uint64_t * max)
+		struct args * args)
 {
-	int i;
+	enum args_action action = ACTION_SIEVE;
+	char ** positional;
+	int i, n_positional = 0;
+
+	/* Set defaults */
+	args->min      = 0;
+	args->max      = 0;
+	args->file     = NULL;
+	args->values   = NULL;
+	args->n_values = 0;
+	args->threads  = 0;
+	args->use_cache = 0;
+	args->sieve     = 0;
+	args->step      = DEFAULT_TABLE_STEP;
+	args->reporting = 0;
+	args->checkpoint_step = 0;
+	args->at_file   = NULL;
+	args->resume_file = NULL;
+	args->memo_file   = NULL;
+	args->stats       = 0;
+	args->perf        = 0;
+	args->quiet       = 0;
+	args->json        = 0;
+	args->telemetry   = 0;
+	args->telemetry_file = NULL;
 
 	/* If any argument is "--help", we will display help information.
 	   If any argument is "--version", we will display the version.
@@ -55,56 +91,386 @@ enum args_action process_args(
 		}
 	}
 
-	/* No version or help flags.  Proceed as usual, checking that we
-	   only have one or two real arguments. */
-	if(argc != 2 && argc != 3)
+	/* Separate the options from the positional arguments.  The
+	   positional arguments are collected (in order) at the front of a
+	   separate array. */
+	positional = malloc(argc * sizeof(char *));
+	if(positional == NULL)
 	{
-		fprintf(stderr, "%s: invalid arguments (expected 1 or 2, got "
-		        "%d)\n", yase_program_name, argc - 1);
-		return ACTION_FAIL;
+		YASE_PERROR("malloc");
+		abort();
 	}
-
-	/* Get the minimum and maximum values */
-	if(argc == 3)
+	for(i = 1; i < argc; i++)
 	{
-		/* Get the minimum from the first argument */
-		if(!evaluate(argv[1], min))
+		enum args_action mode = ACTION_SIEVE;
+
+		/* Options selecting a mode other than plain sieving */
+		if(strcmp(argv[i], "--dump") == 0)
+		{
+			mode = ACTION_DUMP;
+		}
+		else if(strcmp(argv[i], "--lookup") == 0)
+		{
+			mode = ACTION_LOOKUP;
+		}
+		else if(strcmp(argv[i], "--test") == 0)
+		{
+			mode = ACTION_TEST;
+		}
+		else if(strcmp(argv[i], "--batch") == 0)
+		{
+			mode = ACTION_BATCH;
+		}
+		else if(strcmp(argv[i], "--serve") == 0)
+		{
+			mode = ACTION_SERVE;
+		}
+		else if(strcmp(argv[i], "--make-table") == 0)
+		{
+			mode = ACTION_MAKE_TABLE;
+		}
+		else if(strcmp(argv[i], "--table") == 0)
 		{
-			fprintf(stderr, "%s: failed to evaluate minimum value\n",
-			        yase_program_name);
-			return ACTION_FAIL;
+			mode = ACTION_TABLE;
 		}
+		if(mode != ACTION_SIEVE)
+		{
+			/* Only one mode may be given */
+			if(action != ACTION_SIEVE)
+			{
+				fprintf(stderr, "%s: only one of --dump, --lookup, --test, "
+				        "--batch, --serve, --make-table and --table may "
+				        "be given\n",
+				        yase_program_name);
+				goto fail;
+			}
+			action = mode;
 
-		/* Get the minimum from the second argument */
-		if(!evaluate(argv[2], max))
+			/* All but --test take a file (or socket) name */
+			if(mode != ACTION_TEST)
+			{
+				if(i + 1 == argc)
+				{
+					fprintf(stderr, "%s: %s requires a path\n",
+					        yase_program_name, argv[i]);
+					goto fail;
+				}
+				args->file = argv[++i];
+			}
+		}
+		else if(strcmp(argv[i], "--cache") == 0)
+		{
+			args->use_cache = 1;
+		}
+		else if(strcmp(argv[i], "--sieve") == 0)
+		{
+			args->sieve = 1;
+		}
+		else if(strcmp(argv[i], "--stats") == 0 ||
+		        strcmp(argv[i], "--perf") == 0)
+		{
+#if PHASE_STATS
+			/* --perf adds hardware counters to the statistics */
+			args->stats = 1;
+			if(strcmp(argv[i], "--perf") == 0)
+			{
+				args->perf = 1;
+			}
+#else
+			fprintf(stderr, "%s: %s is not available (built with "
+			        "PHASE_STATS off)\n", yase_program_name, argv[i]);
+			goto fail;
+#endif
+		}
+		else if(strcmp(argv[i], "--quiet") == 0)
+		{
+			args->quiet = 1;
+		}
+		else if(strcmp(argv[i], "--format") == 0)
+		{
+			if(i + 1 == argc)
+			{
+				fprintf(stderr, "%s: --format requires text or json\n",
+				        yase_program_name);
+				goto fail;
+			}
+			i++;
+			if(strcmp(argv[i], "json") == 0)
+			{
+				args->json = 1;
+			}
+			else if(strcmp(argv[i], "text") == 0)
+			{
+				args->json = 0;
+			}
+			else
+			{
+				fprintf(stderr, "%s: unknown format '%s'\n",
+				        yase_program_name, argv[i]);
+				goto fail;
+			}
+		}
+		else if(strcmp(argv[i], "--telemetry") == 0)
 		{
-			fprintf(stderr, "%s: failed to evaluate maximum value\n",
-			        yase_program_name);
-			return ACTION_FAIL;
+			uint64_t seconds;
+			if(i + 1 == argc ||
+			   !evaluate_arg(argv[++i], "telemetry interval", &seconds))
+			{
+				goto fail;
+			}
+			if(seconds == 0 || seconds > MAX_TELEMETRY_SECONDS)
+			{
+				fprintf(stderr, "%s: telemetry interval must be from 1 to "
+				        "%u seconds\n", yase_program_name,
+				        MAX_TELEMETRY_SECONDS);
+				goto fail;
+			}
+			args->telemetry = (unsigned int) seconds;
 		}
+		else if(strcmp(argv[i], "--telemetry-file") == 0)
+		{
+			if(i + 1 == argc)
+			{
+				fprintf(stderr, "%s: --telemetry-file requires a path\n",
+				        yase_program_name);
+				goto fail;
+			}
+			args->telemetry_file = argv[++i];
+		}
+		else if(strcmp(argv[i], "--step") == 0)
+		{
+			if(i + 1 == argc ||
+			   !evaluate_arg(argv[++i], "checkpoint step", &args->step))
+			{
+				goto fail;
+			}
+			if(args->step == 0)
+			{
+				fprintf(stderr, "%s: checkpoint step must be positive\n",
+				        yase_program_name);
+				goto fail;
+			}
+		}
+		else if(strcmp(argv[i], "--checkpoints") == 0 ||
+		        strcmp(argv[i], "--at") == 0)
+		{
+			/* Counts are reported at one set of checkpoints or the
+			   other */
+			if(args->reporting)
+			{
+				fprintf(stderr, "%s: only one of --checkpoints and --at "
+				        "may be given\n", yase_program_name);
+				goto fail;
+			}
+			args->reporting = 1;
+			if(strcmp(argv[i], "--at") == 0)
+			{
+				if(i + 1 == argc)
+				{
+					fprintf(stderr, "%s: --at requires a path\n",
+					        yase_program_name);
+					goto fail;
+				}
+				args->at_file = argv[++i];
+			}
+			else
+			{
+				if(i + 1 == argc ||
+				   !evaluate_arg(argv[++i], "checkpoint step",
+				                 &args->checkpoint_step))
+				{
+					goto fail;
+				}
+				if(args->checkpoint_step == 0)
+				{
+					fprintf(stderr, "%s: checkpoint step must be "
+					        "positive\n", yase_program_name);
+					goto fail;
+				}
+			}
+		}
+		else if(strcmp(argv[i], "--resume") == 0)
+		{
+			if(i + 1 == argc)
+			{
+				fprintf(stderr, "%s: --resume requires a path\n",
+				        yase_program_name);
+				goto fail;
+			}
+			args->resume_file = argv[++i];
+		}
+		else if(strcmp(argv[i], "--memo") == 0)
+		{
+			if(i + 1 == argc)
+			{
+				fprintf(stderr, "%s: --memo requires a path\n",
+				        yase_program_name);
+				goto fail;
+			}
+			args->memo_file = argv[++i];
+		}
+		else if(strcmp(argv[i], "--threads") == 0)
+		{
+			uint64_t threads;
+			if(i + 1 == argc ||
+			   !evaluate_arg(argv[++i], "thread count", &threads))
+			{
+				goto fail;
+			}
+			if(threads == 0 || threads > MAX_THREADS)
+			{
+				fprintf(stderr, "%s: thread count must be from 1 to %u\n",
+				        yase_program_name, MAX_THREADS);
+				goto fail;
+			}
+			args->threads = (unsigned int) threads;
+		}
+		else if(strncmp(argv[i], "--", 2) == 0)
+		{
+			fprintf(stderr, "%s: unrecognized option '%s'\n",
+			        yase_program_name, argv[i]);
+			goto fail;
+		}
+		else
+		{
+			positional[n_positional++] = argv[i];
+		}
+	}
+
+	/* Counts at checkpoints are only reported while plainly sieving */
+	if(args->reporting && action != ACTION_SIEVE)
+	{
+		fprintf(stderr, "%s: --checkpoints and --at may not be given with "
+		        "another mode\n", yase_program_name);
+		goto fail;
 	}
-	else
+
+	/* Only plain sieving runs can be resumed */
+	if(args->resume_file != NULL &&
+	   (action != ACTION_SIEVE || args->reporting))
 	{
-		/* Only the maximum is provided.  Assume the minimum is 0. */
-		*min = 0;
+		fprintf(stderr, "%s: --resume may not be given with another mode, "
+		        "--checkpoints or --at\n", yase_program_name);
+		goto fail;
+	}
 
-		/* Get the maximum from the first argument */
-		if(!evaluate(argv[1], max))
+	/* Only plain counting runs can use a memo */
+	if(args->memo_file != NULL &&
+	   (action != ACTION_SIEVE || args->reporting ||
+	    args->resume_file != NULL))
+	{
+		fprintf(stderr, "%s: --memo may not be given with another mode, "
+		        "--checkpoints, --at or --resume\n", yase_program_name);
+		goto fail;
+	}
+
+	/* Statistics are only gathered while a single thread sieves */
+	if(args->stats && action != ACTION_SIEVE && action != ACTION_DUMP)
+	{
+		fprintf(stderr, "%s: --stats and --perf may only be given when "
+		        "counting or with --dump\n", yase_program_name);
+		goto fail;
+	}
+
+	/* The other modes have outputs of their own.  JSON is a single
+	   object, so it cannot follow checkpoint counts. */
+	if((args->quiet || args->json) && action != ACTION_SIEVE &&
+	   action != ACTION_DUMP && action != ACTION_TABLE)
+	{
+		fprintf(stderr, "%s: --quiet and --format may only be given when "
+		        "counting, with --table or with --dump\n",
+		        yase_program_name);
+		goto fail;
+	}
+	if(args->json && args->reporting)
+	{
+		fprintf(stderr, "%s: --format json may not be given with "
+		        "--checkpoints or --at\n", yase_program_name);
+		goto fail;
+	}
+
+	/* Telemetry follows the sieve, which only these modes run */
+	if((args->telemetry != 0 || args->telemetry_file != NULL) &&
+	   action != ACTION_SIEVE && action != ACTION_DUMP)
+	{
+		fprintf(stderr, "%s: --telemetry and --telemetry-file may only be "
+		        "given when counting or with --dump\n", yase_program_name);
+		goto fail;
+	}
+	if(args->telemetry_file != NULL && args->telemetry == 0)
+	{
+		args->telemetry = DEFAULT_TELEMETRY_SECONDS;
+	}
+
+	/* For lookups and tests, the positional arguments are numbers to
+	   query, evaluated later on.  The caller frees the array. */
+	if(action == ACTION_LOOKUP || action == ACTION_TEST)
+	{
+		args->values   = positional;
+		args->n_values = n_positional;
+		return action;
+	}
+
+	/* Batches take their ranges from the file, and the server from its
+	   clients */
+	if(action == ACTION_BATCH || action == ACTION_SERVE)
+	{
+		if(n_positional != 0)
+		{
+			fprintf(stderr, "%s: invalid arguments (%s takes no MIN or "
+			        "MAX)\n", yase_program_name,
+			        (action == ACTION_BATCH ? "--batch" : "--serve"));
+			goto fail;
+		}
+		free(positional);
+		return action;
+	}
+
+	/* Dumping a bitmap or making a pi table always starts at 0, so
+	   takes only MAX.  Otherwise we have one or two real arguments. */
+	if((action == ACTION_DUMP || action == ACTION_MAKE_TABLE) &&
+	   n_positional != 1)
+	{
+		fprintf(stderr, "%s: invalid arguments (expected MAX with "
+		        "%s)\n", yase_program_name,
+		        (action == ACTION_DUMP ? "--dump" : "--make-table"));
+		goto fail;
+	}
+	if(n_positional != 1 && n_positional != 2)
+	{
+		fprintf(stderr, "%s: invalid arguments (expected 1 or 2, got "
+		        "%d)\n", yase_program_name, n_positional);
+		goto fail;
+	}
+
+	/* Get the minimum and maximum values.  If only the maximum is
+	   provided, the minimum stays at 0. */
+	if(n_positional == 2)
+	{
+		if(!evaluate_arg(positional[0], "minimum value", &args->min) ||
+		   !evaluate_arg(positional[1], "maximum value", &args->max))
 		{
-			fprintf(stderr, "%s: failed to evaluate maximum value\n",
-			        yase_program_name);
-			return ACTION_FAIL;
+			goto fail;
 		}
 	}
+	else if(!evaluate_arg(positional[0], "maximum value", &args->max))
+	{
+		goto fail;
+	}
+	free(positional);
 
 	/* Ensure that max >= min */
-	if(*max < *min)
+	if(args->max < args->min)
 	{
 		fprintf(stderr, "%s: minimum is greater than maximum\n",
 		        yase_program_name);
 		return ACTION_FAIL;
 	}
 
-	/* No problems.  We should sieve. */
-	return ACTION_SIEVE;
+	/* No problems */
+	return action;
+
+fail:
+	free(positional);
+	return ACTION_FAIL;
 }
@@ -0,0 +1,576 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * batch.c: counting primes on many ranges at once
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <yase.h>
+
+/*
+ * Counting many ranges separately repeats a lot of work: the wheel and
+ * pre-sieve setup, the seed sieve, and the sieving of any part of the
+ * number line that several ranges share.  count_ranges() instead takes
+ * a seed sieve computed once by the caller and does the following:
+ *
+ *  - Every range [min, max] is answered as C(max) - C(min - 1), where C
+ *    counts primes from the start of the "run" the range falls in.  The
+ *    ranges are sorted, and overlapping or adjacent ranges are merged
+ *    into runs, so each part of the number line is sieved only once.
+ *  - The endpoints at which C is needed are collected, sorted, and
+ *    handed to whichever chunk of a run contains them.  The segment
+ *    callback counts up to each one exactly, bit by bit.
+ *  - Runs are split into chunks, and the chunks are sieved by a pool of
+ *    threads, each with its own prime set and sieve buffer.  Then the
+ *    chunk totals are summed along each run to turn the per-chunk
+ *    counts into values of C.
+ *  - With several threads, each is pinned to a CPU with numa_pin() and
+ *    sieves with copies of the pre-sieve pattern and seed sieve on its
+ *    own NUMA node, so that its reads and its buckets stay local.
+ */
+
+/* Never split a run into chunks smaller than this many segments, so
+   that each chunk's prime set setup is well amortized */
+#define MIN_CHUNK_SEGMENTS 16
+
+/* How many chunks to aim for per thread, for load balancing */
+#define CHUNKS_PER_THREAD 4
+
+/* A point at which the count from the start of its run is needed */
+struct point
+{
+	uint64_t x;     /* Count primes up to and including x */
+	uint64_t count; /* Count from the start of the chunk  */
+};
+
+/* A chunk of a run, sieved as one interval by one thread */
+struct chunk
+{
+	uint64_t min;        /* First number in the chunk            */
+	uint64_t max;        /* Last number in the chunk             */
+	int run_start;       /* Nonzero if this chunk starts a run   */
+	size_t first_point;  /* First point in the chunk             */
+	size_t end_point;    /* First point past the chunk           */
+	uint64_t total;      /* Primes found on the whole chunk      */
+};
+
+/* State shared by the worker threads */
+struct workers
+{
+	struct chunk * chunks;       /* Chunks to sieve               */
+	size_t n_chunks;             /* Number of chunks              */
+	size_t next_chunk;           /* Next chunk to hand out        */
+	struct point * points;       /* Points, in ascending order    */
+	struct numa_replica seed;    /* Seed sieve shared by all      */
+	int pin;                     /* Nonzero to pin the threads    */
+	unsigned int next_worker;    /* Index of the next to start    */
+	pthread_mutex_t lock;        /* Protects next_*               */
+};
+
+/* Segment callback data while sieving a chunk */
+struct chunk_progress
+{
+	struct point * next;  /* Next point to count up to        */
+	struct point * end;   /* End of the chunk's points        */
+	uint64_t before;      /* Primes found before this segment */
+};
+
+/* Finds how many threads to use when none are requested: one per
+   online CPU */
+unsigned int default_threads(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if(cpus < 1)
+	{
+		return 1;
+	}
+	return (cpus > (long) MAX_THREADS ? MAX_THREADS : (unsigned int) cpus);
+}
+
+/* Segment callback: counts up to each point that falls in the
+   segment */
+static void chunk_segment(const struct segment * seg, void * data)
+{
+	struct chunk_progress * prog = data;
+	while(prog->next < prog->end && segment_reaches(seg, prog->next->x))
+	{
+		prog->next->count = prog->before +
+		                    segment_count_upto(seg, prog->next->x);
+		prog->next++;
+	}
+	prog->before += seg->count;
+}
+
+/* Sieves a single chunk, counting up to each of its points */
+static void sieve_chunk(struct chunk * chunk, struct point * points,
+                        const uint8_t * seed_sieve)
+{
+	struct chunk_progress prog;
+	uint64_t count;
+	size_t i;
+
+	prog.next   = &points[chunk->first_point];
+	prog.end    = &points[chunk->end_point];
+	prog.before = 0;
+	count = sieve_range(chunk->min, chunk->max, seed_sieve,
+	                    chunk_segment, &prog);
+
+	/* Add in the primes that sieving skips */
+	for(i = chunk->first_point; i < chunk->end_point; i++)
+	{
+		points[i].count += skipped_primes(chunk->min, points[i].x);
+	}
+	chunk->total = count + skipped_primes(chunk->min, chunk->max);
+}
+
+/* Worker thread: sieves chunks until there are none left */
+static void * worker_main(void * data)
+{
+	struct workers * workers = data;
+	const uint8_t * seed_sieve = workers->seed.src;
+
+	/* Move to this worker's CPU, and find the shared data there */
+	if(workers->pin)
+	{
+		unsigned int worker;
+
+		pthread_mutex_lock(&workers->lock);
+		worker = workers->next_worker++;
+		pthread_mutex_unlock(&workers->lock);
+		numa_pin(worker);
+		presieve_localize();
+		seed_sieve = numa_replica_get(&workers->seed);
+	}
+
+	for(;;)
+	{
+		size_t idx;
+
+		pthread_mutex_lock(&workers->lock);
+		idx = workers->next_chunk++;
+		pthread_mutex_unlock(&workers->lock);
+		if(idx >= workers->n_chunks)
+		{
+			break;
+		}
+
+		sieve_chunk(&workers->chunks[idx], workers->points, seed_sieve);
+	}
+	if(workers->pin)
+	{
+		numa_unpin();
+	}
+	return NULL;
+}
+
+/* Comparison routines for qsort() */
+static int compare_u64(const void * a, const void * b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+static int compare_range_min(const void * a, const void * b)
+{
+	const struct range * x = *(const struct range * const *) a;
+	const struct range * y = *(const struct range * const *) b;
+	return (x->min > y->min) - (x->min < y->min);
+}
+
+/* Finds the count for x, from the start of its run.  x must be one of
+   the points, or one less than the start of a run. */
+static uint64_t find_point(const struct point * points, size_t n_points,
+                           uint64_t x)
+{
+	size_t lo = 0, hi = n_points;
+	while(lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if(points[mid].x < x)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return (lo < n_points && points[lo].x == x ? points[lo].count : 0);
+}
+
+/*
+ * Counts the primes on each of n ranges, storing each count in the
+ * range's count field.  seed_sieve must be the result of seed_find()
+ * covering the sieving primes for the largest max of the ranges.  The
+ * wheel tables and pre-sieve must be initialized.
+ */
+void count_ranges(
+		struct range * ranges,
+		size_t n,
+		const uint8_t * seed_sieve,
+		unsigned int threads)
+{
+	struct range ** sorted;
+	struct chunk * chunks;
+	struct point * points;
+	uint64_t * xs, total_len = 0, chunk_len, prefix = 0, largest = 0;
+	uint64_t seed_end_byte;
+	unsigned int seed_end_bit;
+	size_t i, j, n_xs = 0, n_points = 0, n_chunks = 0, max_chunks;
+	struct workers workers;
+	pthread_t * tids;
+	unsigned int t;
+
+	if(n == 0)
+	{
+		return;
+	}
+
+	/* Sort the ranges by their minimums, for merging */
+	sorted = malloc(n * sizeof(struct range *));
+	xs     = malloc(2 * n * sizeof(uint64_t));
+	if(sorted == NULL || xs == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(i = 0; i < n; i++)
+	{
+		sorted[i] = &ranges[i];
+	}
+	qsort(sorted, n, sizeof(struct range *), compare_range_min);
+
+	/* Find the length of the merged runs, which decides the chunk size.
+	   The endpoints needed are the maximums, and one before each
+	   minimum that is not the start of a run. */
+	for(i = 0; i < n; i = j)
+	{
+		uint64_t run_min = sorted[i]->min, run_max = sorted[i]->max;
+		for(j = i + 1; j < n &&
+		    (run_max == UINT64_MAX || sorted[j]->min <= run_max + 1); j++)
+		{
+			if(sorted[j]->max > run_max)
+			{
+				run_max = sorted[j]->max;
+			}
+			if(sorted[j]->min > run_min)
+			{
+				xs[n_xs++] = sorted[j]->min - 1;
+			}
+		}
+		total_len += run_max / 30 - run_min / 30 + 1;
+	}
+	for(i = 0; i < n; i++)
+	{
+		xs[n_xs++] = ranges[i].max;
+	}
+	if(threads <= 1)
+	{
+		chunk_len = UINT64_MAX;
+	}
+	else
+	{
+		chunk_len = total_len / ((uint64_t) threads * CHUNKS_PER_THREAD);
+		if(chunk_len < MIN_CHUNK_SEGMENTS * LARGE_SEGMENT_BYTES)
+		{
+			chunk_len = MIN_CHUNK_SEGMENTS * LARGE_SEGMENT_BYTES;
+		}
+	}
+
+	/* Sort the points, dropping duplicates */
+	qsort(xs, n_xs, sizeof(uint64_t), compare_u64);
+	points = malloc(n_xs * sizeof(struct point));
+	if(points == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(i = 0; i < n_xs; i++)
+	{
+		if(n_points == 0 || points[n_points - 1].x != xs[i])
+		{
+			points[n_points].x     = xs[i];
+			points[n_points].count = 0;
+			n_points++;
+		}
+	}
+	free(xs);
+
+	/* Split the runs into chunks, at byte boundaries, and give each
+	   chunk its points */
+	max_chunks = 16;
+	chunks = malloc(max_chunks * sizeof(struct chunk));
+	if(chunks == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(i = 0, j = 0; i < n; )
+	{
+		uint64_t run_min = sorted[i]->min, run_max = sorted[i]->max;
+		uint64_t chunk_min;
+		size_t k;
+
+		for(k = i + 1; k < n &&
+		    (run_max == UINT64_MAX || sorted[k]->min <= run_max + 1); k++)
+		{
+			if(sorted[k]->max > run_max)
+			{
+				run_max = sorted[k]->max;
+			}
+		}
+		i = k;
+
+		chunk_min = run_min;
+		for(;;)
+		{
+			struct chunk * chunk;
+			uint64_t chunk_max = run_max;
+
+			if(run_max / 30 - chunk_min / 30 >= chunk_len)
+			{
+				chunk_max = (chunk_min / 30 + chunk_len) * 30 - 1;
+			}
+
+			if(n_chunks == max_chunks)
+			{
+				max_chunks *= 2;
+				chunks = realloc(chunks, max_chunks * sizeof(struct chunk));
+				if(chunks == NULL)
+				{
+					YASE_PERROR("realloc");
+					abort();
+				}
+			}
+			chunk = &chunks[n_chunks++];
+			chunk->min       = chunk_min;
+			chunk->max       = chunk_max;
+			chunk->run_start = (chunk_min == run_min);
+			chunk->total     = 0;
+
+			/* Skip the point before the run (its count is 0), then
+			   take the points up to the chunk's max */
+			while(j < n_points && points[j].x < chunk_min)
+			{
+				j++;
+			}
+			chunk->first_point = j;
+			while(j < n_points && points[j].x <= chunk_max)
+			{
+				j++;
+			}
+			chunk->end_point = j;
+
+			if(chunk_max == run_max)
+			{
+				break;
+			}
+			chunk_min = chunk_max + 1;
+		}
+	}
+	free(sorted);
+
+	/* Sieve the chunks, with the calling thread doing its share */
+	workers.chunks     = chunks;
+	workers.n_chunks   = n_chunks;
+	workers.next_chunk = 0;
+	workers.points     = points;
+	pthread_mutex_init(&workers.lock, NULL);
+	if(threads > n_chunks)
+	{
+		threads = (unsigned int) n_chunks;
+	}
+	for(i = 0; i < n; i++)
+	{
+		largest = (ranges[i].max > largest ? ranges[i].max : largest);
+	}
+	calculate_seed_interval(largest, &seed_end_byte, &seed_end_bit);
+	numa_replica_init(&workers.seed, seed_sieve, (size_t) seed_end_byte);
+	workers.pin         = (threads > 1);
+	workers.next_worker = 0;
+	tids = malloc((threads > 1 ? threads - 1 : 1) * sizeof(pthread_t));
+	if(tids == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(t = 0; t + 1 < threads; t++)
+	{
+		if(pthread_create(&tids[t], NULL, worker_main, &workers) != 0)
+		{
+			/* Make do with the threads we have */
+			break;
+		}
+	}
+	worker_main(&workers);
+	while(t > 0)
+	{
+		pthread_join(tids[--t], NULL);
+	}
+	free(tids);
+	pthread_mutex_destroy(&workers.lock);
+	numa_replica_cleanup(&workers.seed);
+
+	/* Turn the counts from the start of each chunk into counts from the
+	   start of each run */
+	for(i = 0; i < n_chunks; i++)
+	{
+		if(chunks[i].run_start)
+		{
+			prefix = 0;
+		}
+		for(j = chunks[i].first_point; j < chunks[i].end_point; j++)
+		{
+			points[j].count += prefix;
+		}
+		prefix += chunks[i].total;
+	}
+	free(chunks);
+
+	/* Finally, answer each range */
+	for(i = 0; i < n; i++)
+	{
+		ranges[i].count = find_point(points, n_points, ranges[i].max);
+		if(ranges[i].min != 0)
+		{
+			ranges[i].count -= find_point(points, n_points,
+			                              ranges[i].min - 1);
+		}
+	}
+	free(points);
+}
+
+/* Parses one line of a batch file: either "MAX" or "MIN MAX".  Returns
+   nonzero on success. */
+static int parse_range(char * line, struct range * range)
+{
+	char * first, * second, * extra;
+
+	first  = strtok(line, " \t");
+	second = strtok(NULL, " \t");
+	extra  = strtok(NULL, " \t");
+	if(first == NULL || extra != NULL)
+	{
+		return 0;
+	}
+	if(second == NULL)
+	{
+		range->min = 0;
+		return evaluate(first, &range->max);
+	}
+	return evaluate(first, &range->min) && evaluate(second, &range->max)
+	       && range->min <= range->max;
+}
+
+/* Counts the primes on every range listed in a file (one per line, as
+   either "MAX" or "MIN MAX"), printing "MIN MAX COUNT" for each, in
+   order */
+int batch_run(const char * path, unsigned int threads, int use_cache)
+{
+	struct range * ranges;
+	size_t n = 0, alloc = 64, i;
+	uint64_t max = 0, seed_end_byte;
+	unsigned int seed_end_bit;
+	unsigned long line_no = 0;
+	struct seed seed;
+	char line[256];
+	FILE * file;
+
+	/* Read in the ranges */
+	file = (strcmp(path, "-") == 0 ? stdin : fopen(path, "r"));
+	if(file == NULL)
+	{
+		YASE_PERROR(path);
+		return EXIT_FAILURE;
+	}
+	ranges = malloc(alloc * sizeof(struct range));
+	if(ranges == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	while(fgets(line, sizeof(line), file) != NULL)
+	{
+		line_no++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if(strspn(line, " \t") == strlen(line))
+		{
+			continue;
+		}
+		if(n == alloc)
+		{
+			alloc *= 2;
+			ranges = realloc(ranges, alloc * sizeof(struct range));
+			if(ranges == NULL)
+			{
+				YASE_PERROR("realloc");
+				abort();
+			}
+		}
+		if(!parse_range(line, &ranges[n]))
+		{
+			fprintf(stderr, "%s: %s:%lu: invalid range\n",
+			        yase_program_name, path, line_no);
+			if(file != stdin)
+			{
+				fclose(file);
+			}
+			free(ranges);
+			return EXIT_FAILURE;
+		}
+		if(ranges[n].max > max)
+		{
+			max = ranges[n].max;
+		}
+		n++;
+	}
+	if(file != stdin)
+	{
+		fclose(file);
+	}
+
+	/* Set up everything once, for the largest range */
+	wheel_init();
+	popcnt_init();
+	presieve_init();
+	calculate_seed_interval(max, &seed_end_byte, &seed_end_bit);
+	seed_get(&seed, seed_end_byte, use_cache);
+
+	/* Count and print the results */
+	count_ranges(ranges, n, seed.bits,
+	             (threads == 0 ? default_threads() : threads));
+	for(i = 0; i < n; i++)
+	{
+		printf("%" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+		       ranges[i].min, ranges[i].max, ranges[i].count);
+	}
+
+	seed_put(&seed);
+	presieve_cleanup();
+	prime_set_depot_cleanup();
+	free(ranges);
+	return EXIT_SUCCESS;
+}
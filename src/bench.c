@@ -0,0 +1,597 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * bench.c: yase-bench, end-to-end throughput benchmarks
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <yase.h>
+
+/* Program name, for error messages */
+const char * yase_program_name;
+
+/*
+ * yase-bench runs a fixed matrix of workloads, each a few times to warm
+ * up and then a number of times to measure, and reports the median wall
+ * clock time and its spread for each.  The workloads go through the
+ * same routines the yase binary does, on one thread:
+ *
+ *  - count: counts the primes on [min, max] by sieving, including the
+ *    seed sieve, and checks the count where it is known;
+ *  - presieve: copies the pre-sieve pattern over [0, max];
+ *  - seed: runs the seed sieve on [0, max], as sieving up to max^2
+ *    would.
+ *
+ * The wheel, population count and pre-sieve are set up once, before any
+ * workload, since every run of yase pays for them the same way.
+ *
+ * With --kernels, the microbenchmarks in kernels.c are run instead, and
+ * with --scaling, the thread scaling benchmarks in scaling.c.
+ * --check and --compare (regress.c) make a regression test of a run:
+ * the first checks the counts against known values and a reference
+ * sieve before anything is timed, and the second compares the times
+ * with those of an earlier run.
+ */
+enum workload_kind
+{
+	WORK_COUNT,
+	WORK_PRESIEVE,
+	WORK_SEED
+};
+
+struct workload
+{
+	const char * name;       /* Name, as reported                  */
+	enum workload_kind kind; /* What to run                        */
+	uint64_t min;            /* Start of the range                 */
+	uint64_t max;            /* End of the range                   */
+	uint64_t expected;       /* Known count, or 0 if not checked   */
+};
+
+#define E8  UINT64_C(100000000)
+#define E9  UINT64_C(1000000000)
+#define E10 UINT64_C(10000000000)
+#define E11 UINT64_C(100000000000)
+#define E12 UINT64_C(1000000000000)
+#define E15 UINT64_C(1000000000000000)
+#define E18 UINT64_C(1000000000000000000)
+static const struct workload workloads[] =
+{
+	{ "pi(1e8)",        WORK_COUNT,    0,   E8,  UINT64_C(5761455)     },
+	{ "pi(1e9)",        WORK_COUNT,    0,   E9,  UINT64_C(50847534)    },
+	{ "pi(1e10)",       WORK_COUNT,    0,   E10, UINT64_C(455052511)   },
+	{ "pi(1e11)",       WORK_COUNT,    0,   E11, UINT64_C(4118054813)  },
+	{ "pi(1e12)",       WORK_COUNT,    0,   E12, UINT64_C(37607912018) },
+	{ "window(1e12)",   WORK_COUNT,    E12, E12 + E9 - 1, 0 },
+	{ "window(1e15)",   WORK_COUNT,    E15, E15 + E9 - 1, 0 },
+	{ "window(1e18)",   WORK_COUNT,    E18, E18 + E9 - 1, 0 },
+	{ "presieve(1e10)", WORK_PRESIEVE, 0,   E10, 0 },
+	{ "seed(1e9)",      WORK_SEED,     0,   E9,  0 }
+};
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/* Default warmup and measured runs of each workload, and trials of
+   each kernel */
+#define DEFAULT_WARMUP  1
+#define DEFAULT_REPEATS 5
+#define DEFAULT_TRIALS  15
+
+/* Default slowdown, in percent, past which --compare fails */
+#define DEFAULT_THRESHOLD 5
+
+/* Name filters given with --only, if any */
+static const char ** only;
+static int n_only;
+
+/* Results of one workload */
+struct result
+{
+	double * times;  /* Wall time of each measured run, sorted,
+	                    or NULL if the workload did not finish */
+	uint64_t count;  /* Count found by the last run            */
+	double median;   /* Median wall time                       */
+	double spread;   /* (slowest - fastest) / median           */
+	double rate;     /* Numbers per second, at the median      */
+};
+
+/* Help text */
+static const char help_format[] =
+"Usage: %s [OPTION]...\n"
+"Run yase's benchmark workloads and report the median wall clock time,\n"
+"its spread ((slowest - fastest) / median) and numbers per second of\n"
+"each.  The full matrix counts up to 10^12 by sieving, so it takes a\n"
+"while; use --only to pick workloads.\n\n"
+"With --kernels, instead time each of the sieve's inner loops on its own\n"
+"and report the median time per byte, per multiple marked or per call.\n"
+"On x86, times are also given in time stamp counter ticks.\n\n"
+"With --scaling, instead count a range dominated by small primes and\n"
+"one dominated by large primes with 1, 2, 4, ... threads, at a fixed\n"
+"size (strong scaling) and at a size proportional to the threads (weak\n"
+"scaling), and report the speedup, efficiency and estimated memory\n"
+"bandwidth at each thread count.\n\n"
+"Options:\n"
+" --help          display this help message\n"
+" --list          list the workloads and exit\n"
+" --kernels       run the inner loop microbenchmarks\n"
+" --scaling       run the thread scaling benchmarks\n"
+" --threads N     most threads for --scaling (default: one per CPU)\n"
+" --only NAME     run only the workloads whose names contain NAME (may\n"
+"                 be given more than once)\n"
+" --warmup N      unmeasured runs of each workload (default: %d)\n"
+" --repeats N     measured runs of each workload (default: %d), or\n"
+"                 trials of each kernel (default: %d)\n"
+" --json FILE     also write the results as JSON to FILE (- for\n"
+"                 standard output)\n"
+" --check         first check the sieve's counts against known values\n"
+"                 of pi(10^k) and a reference sieve on random windows\n"
+" --seed N        seed for the random windows of --check (default: 1)\n"
+" --compare FILE  compare the results with those in FILE, an earlier\n"
+"                 --json FILE, and fail if any workload slowed down\n"
+"                 significantly (needs --json FILE)\n"
+" --threshold PCT slowdown of the median, in percent, that --compare\n"
+"                 allows (default: %d)\n\n"
+"Exits with failure if a count is wrong, a check fails or --compare\n"
+"finds a regression.\n";
+
+/* Reads the monotonic clock in seconds */
+static double wall_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Runs a workload once, returning the count it found (if any) */
+static uint64_t run_workload(const struct workload * work)
+{
+	uint64_t seed_end_byte, count = 0;
+	unsigned int seed_end_bit;
+
+	switch(work->kind)
+	{
+		case WORK_COUNT:
+		{
+			uint8_t * seed_sieve;
+			calculate_seed_interval(work->max, &seed_end_byte,
+			                        &seed_end_bit);
+			seed_sieve = seed_find(seed_end_byte);
+			count = skipped_primes(work->min, work->max) +
+			        sieve_range(work->min, work->max, seed_sieve, NULL,
+			                    NULL);
+			free(seed_sieve);
+			break;
+		}
+
+		case WORK_PRESIEVE:
+		{
+			uint64_t byte, end_byte = work->max / 30 + 1;
+			uint8_t * sieve = malloc(LARGE_SEGMENT_BYTES);
+			if(sieve == NULL)
+			{
+				YASE_PERROR("malloc");
+				abort();
+			}
+			for(byte = 0; byte < end_byte; byte += LARGE_SEGMENT_BYTES)
+			{
+				uint64_t end = byte + LARGE_SEGMENT_BYTES;
+				presieve_copy(sieve, byte, (end < end_byte ? end :
+				                            end_byte));
+				count += sieve[0];
+			}
+			free(sieve);
+			break;
+		}
+
+		case WORK_SEED:
+			free(seed_find(work->max / 30 + 1));
+			break;
+	}
+	return count;
+}
+
+/* Checks whether a workload or kernel was picked with --only */
+static int bench_selected(const char * name)
+{
+	int i;
+	if(n_only == 0)
+	{
+		return 1;
+	}
+	for(i = 0; i < n_only; i++)
+	{
+		if(strstr(name, only[i]) != NULL)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Sorts doubles */
+static int compare_double(const void * a, const void * b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* Runs a workload warmup + repeats times, measuring the last repeats
+   runs.  Returns nonzero if the counts were right; if not, res->times
+   is left NULL. */
+static int measure(const struct workload * work, unsigned int warmup,
+                   unsigned int repeats, struct result * res)
+{
+	uint64_t numbers = work->max - work->min + 1;
+	unsigned int i;
+
+	res->times = malloc(repeats * sizeof(double));
+	if(res->times == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(i = 0; i < warmup + repeats; i++)
+	{
+		double start = wall_now();
+		res->count = run_workload(work);
+		if(i >= warmup)
+		{
+			res->times[i - warmup] = wall_now() - start;
+		}
+		if(work->expected != 0 && res->count != work->expected)
+		{
+			fprintf(stderr, "%s: %s: counted %" PRIu64 ", expected "
+			        "%" PRIu64 "\n", yase_program_name, work->name,
+			        res->count, work->expected);
+			free(res->times);
+			res->times = NULL;
+			return 0;
+		}
+	}
+
+	qsort(res->times, repeats, sizeof(double), compare_double);
+	if(repeats % 2 != 0)
+	{
+		res->median = res->times[repeats / 2];
+	}
+	else
+	{
+		res->median = (res->times[repeats / 2 - 1] +
+		               res->times[repeats / 2]) / 2;
+	}
+	res->spread = (res->times[repeats - 1] - res->times[0]) / res->median;
+	res->rate   = numbers / res->median;
+	return 1;
+}
+
+/* Writes the results as JSON */
+static void write_json(FILE * file, const struct result * results,
+                       unsigned int warmup, unsigned int repeats)
+{
+	struct utsname host;
+	unsigned int w, i;
+	int first = 1;
+
+	if(uname(&host) != 0)
+	{
+		strcpy(host.nodename, "unknown");
+		strcpy(host.sysname, "unknown");
+		strcpy(host.release, "unknown");
+		strcpy(host.machine, "unknown");
+	}
+
+	fprintf(file, "{\n");
+	fprintf(file, "  \"version\": \"%u.%u.%u\",\n",
+	        VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH);
+	fprintf(file, "  \"host\": {\"name\": \"%s\", \"system\": \"%s\", "
+	        "\"release\": \"%s\", \"machine\": \"%s\", \"cpus\": %ld},\n",
+	        host.nodename, host.sysname, host.release, host.machine,
+	        sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(file, "  \"params\": {\"small_segment_bytes\": %u, "
+	        "\"large_segment_bytes\": %u, \"presieve_primes\": %u, "
+	        "\"small_threshold_factor\": %u, \"bucket_primes\": %u},\n",
+	        (unsigned int) SMALL_SEGMENT_BYTES,
+	        (unsigned int) LARGE_SEGMENT_BYTES,
+	        (unsigned int) PRESIEVE_PRIMES,
+	        (unsigned int) SMALL_THRESHOLD_FACTOR,
+	        (unsigned int) BUCKET_PRIMES);
+	fprintf(file, "  \"warmup\": %u,\n  \"repeats\": %u,\n", warmup,
+	        repeats);
+	fprintf(file, "  \"results\": [");
+	for(w = 0; w < N_WORKLOADS; w++)
+	{
+		const struct workload * work = &workloads[w];
+		const struct result * res = &results[w];
+
+		if(res->times == NULL)
+		{
+			continue;
+		}
+		fprintf(file, "%s\n    {\"name\": \"%s\", \"min\": %" PRIu64 ", "
+		        "\"max\": %" PRIu64 ", ", (first ? "" : ","), work->name,
+		        work->min, work->max);
+		if(work->kind == WORK_COUNT)
+		{
+			fprintf(file, "\"count\": %" PRIu64 ", ", res->count);
+		}
+		fprintf(file, "\"median_s\": %.6f, \"min_s\": %.6f, "
+		        "\"max_s\": %.6f, \"spread\": %.4f, "
+		        "\"numbers_per_s\": %.6g, \"times_s\": [",
+		        res->median, res->times[0], res->times[repeats - 1],
+		        res->spread, res->rate);
+		for(i = 0; i < repeats; i++)
+		{
+			fprintf(file, "%s%.6f", (i == 0 ? "" : ", "), res->times[i]);
+		}
+		fprintf(file, "]}");
+		first = 0;
+	}
+	fprintf(file, "\n  ]\n}\n");
+}
+
+/* Parses a run count option */
+static int parse_runs(const char * arg, const char * what, int allow_zero,
+                      unsigned int * runs)
+{
+	uint64_t value;
+	if(!evaluate(arg, &value) || value > 1000 ||
+	   (value == 0 && !allow_zero))
+	{
+		fprintf(stderr, "%s: invalid %s '%s'\n", yase_program_name, what,
+		        arg);
+		return 0;
+	}
+	*runs = (unsigned int) value;
+	return 1;
+}
+
+int main(int argc, char * argv[])
+{
+	struct result results[N_WORKLOADS];
+	unsigned int warmup = DEFAULT_WARMUP, repeats = 0, w;
+	const char * json_file = NULL, * baseline = NULL;
+	FILE * json = NULL;
+	uint64_t seed = 1;
+	double threshold = DEFAULT_THRESHOLD / 100.0;
+	unsigned int threads = 0;
+	int i, kernels = 0, scaling = 0, check = 0, ok = 1;
+
+	yase_program_name = argv[0];
+	for(w = 0; w < N_WORKLOADS; w++)
+	{
+		results[w].times = NULL;
+	}
+	only = malloc(argc * sizeof(char *));
+	if(only == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+
+	/* Process arguments */
+	for(i = 1; i < argc; i++)
+	{
+		if(strcmp(argv[i], "--help") == 0)
+		{
+			printf(help_format, argv[0], DEFAULT_WARMUP, DEFAULT_REPEATS,
+			       DEFAULT_TRIALS, DEFAULT_THRESHOLD);
+			return EXIT_SUCCESS;
+		}
+		else if(strcmp(argv[i], "--list") == 0)
+		{
+			for(w = 0; w < N_WORKLOADS; w++)
+			{
+				puts(workloads[w].name);
+			}
+			return EXIT_SUCCESS;
+		}
+		else if(strcmp(argv[i], "--kernels") == 0)
+		{
+			kernels = 1;
+		}
+		else if(strcmp(argv[i], "--scaling") == 0)
+		{
+			scaling = 1;
+		}
+		else if(strcmp(argv[i], "--check") == 0)
+		{
+			check = 1;
+		}
+		else if(i + 1 == argc)
+		{
+			fprintf(stderr, "%s: %s requires an argument\n",
+			        yase_program_name, argv[i]);
+			return EXIT_FAILURE;
+		}
+		else if(strcmp(argv[i], "--only") == 0)
+		{
+			only[n_only++] = argv[++i];
+		}
+		else if(strcmp(argv[i], "--warmup") == 0)
+		{
+			if(!parse_runs(argv[++i], "warmup count", 1, &warmup))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--repeats") == 0)
+		{
+			if(!parse_runs(argv[++i], "repeat count", 0, &repeats))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--threads") == 0)
+		{
+			if(!parse_runs(argv[++i], "thread count", 0, &threads))
+			{
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--json") == 0)
+		{
+			json_file = argv[++i];
+		}
+		else if(strcmp(argv[i], "--seed") == 0)
+		{
+			if(!evaluate(argv[++i], &seed))
+			{
+				fprintf(stderr, "%s: invalid seed '%s'\n",
+				        yase_program_name, argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else if(strcmp(argv[i], "--compare") == 0)
+		{
+			baseline = argv[++i];
+		}
+		else if(strcmp(argv[i], "--threshold") == 0)
+		{
+			char * end;
+			threshold = strtod(argv[++i], &end) / 100;
+			if(*argv[i] == '\0' || *end != '\0' || !(threshold >= 0) ||
+			   threshold >= 1)
+			{
+				fprintf(stderr, "%s: invalid threshold '%s'\n",
+				        yase_program_name, argv[i]);
+				return EXIT_FAILURE;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "%s: unrecognized option '%s'\n",
+			        yase_program_name, argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* The comparison reads the results back from the JSON file */
+	if(baseline != NULL && (kernels || scaling || json_file == NULL ||
+	                        strcmp(json_file, "-") == 0))
+	{
+		fprintf(stderr, "%s: --compare needs --json FILE and cannot be "
+		        "used with --kernels or --scaling\n", yase_program_name);
+		return EXIT_FAILURE;
+	}
+	if(kernels && scaling)
+	{
+		fprintf(stderr, "%s: --kernels and --scaling cannot be used "
+		        "together\n", yase_program_name);
+		return EXIT_FAILURE;
+	}
+
+	/* Open the JSON file first, so as not to waste a run on a bad
+	   path */
+	if(json_file != NULL)
+	{
+		json = stdout;
+		if(strcmp(json_file, "-") != 0)
+		{
+			json = fopen(json_file, "w");
+			if(json == NULL)
+			{
+				YASE_PERROR(json_file);
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	/* Set up what every run shares */
+	wheel_init();
+	popcnt_init();
+	presieve_init();
+
+	/* Don't time a sieve that gives wrong answers */
+	if(check && !bench_check(seed))
+	{
+		ok = 0;
+		goto done;
+	}
+
+	if(kernels)
+	{
+		bench_kernels((repeats != 0 ? repeats : DEFAULT_TRIALS),
+		              bench_selected, json);
+		goto done;
+	}
+
+	if(repeats == 0)
+	{
+		repeats = DEFAULT_REPEATS;
+	}
+	if(scaling)
+	{
+		ok = bench_scaling((threads != 0 ? threads : default_threads()),
+		                   warmup, repeats, bench_selected, json);
+		goto done;
+	}
+	printf("yase-bench %u.%u.%u: %u warmup and %u measured runs each\n",
+	       VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, warmup, repeats);
+	printf("%-16s %12s %12s %8s %14s\n", "Workload", "Median (s)",
+	       "Fastest (s)", "Spread", "Numbers/s");
+	for(w = 0; w < N_WORKLOADS && ok; w++)
+	{
+		if(!bench_selected(workloads[w].name))
+		{
+			continue;
+		}
+		ok = measure(&workloads[w], warmup, repeats, &results[w]);
+		if(ok)
+		{
+			printf("%-16s %12.4f %12.4f %7.1f%% %14.4g\n",
+			       workloads[w].name, results[w].median,
+			       results[w].times[0], results[w].spread * 100,
+			       results[w].rate);
+			fflush(stdout);
+		}
+	}
+
+	/* Write the JSON for whatever finished */
+	if(json != NULL)
+	{
+		write_json(json, results, warmup, repeats);
+	}
+	for(w = 0; w < N_WORKLOADS; w++)
+	{
+		free(results[w].times);
+	}
+
+done:
+	presieve_cleanup();
+	prime_set_depot_cleanup();
+	free(only);
+	if(json != NULL && json != stdout && fclose(json) != 0)
+	{
+		YASE_PERROR(json_file);
+		ok = 0;
+	}
+	if(ok && baseline != NULL)
+	{
+		ok = bench_compare(json_file, baseline, threshold);
+	}
+	return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
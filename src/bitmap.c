@@ -0,0 +1,220 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * bitmap.c: prime bitmap files and lookups
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <yase.h>
+
+/*
+ * A bitmap file is just a dump of every segment sieved for [0, max],
+ * one after another, so that the bit for n is at byte n / 30 and can be
+ * found with a single load and mask.  The header holds a magic string,
+ * a format version, the header length, max, and the number of bitmap
+ * bytes that follow.  Everything is stored in native byte order; bitmap
+ * files are meant to be shared between processes on one machine, not
+ * between machines.
+ */
+static const char bitmap_magic[8] = "YASEBMP";
+#define BITMAP_VERSION (1U)
+
+/* Offsets of each header field */
+#define HDR_MAGIC   0
+#define HDR_VERSION 8
+#define HDR_LENGTH  12
+#define HDR_MAX     16
+#define HDR_BYTES   24
+
+/* Bitmask for each residue mod 30, from wheel30_offs */
+const uint8_t bitmap_masks[30] =
+	{ 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00,
+	  0x00, 0x04, 0x00, 0x08, 0x00, 0x00, 0x00, 0x10, 0x00, 0x20,
+	  0x00, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80 };
+
+/* How many lookups bitmap_isprime_batch() issues loads for at once */
+#define BATCH_BLOCK 16
+
+/* Creates a bitmap file for [0, max] and writes its header.  The bitmap
+   itself is written by using bitmap_write_segment() as the segment
+   callback while sieving the interval. */
+FILE * bitmap_create(const char * path, uint64_t max)
+{
+	uint8_t header[BITMAP_HEADER_BYTES];
+	uint32_t version = BITMAP_VERSION, length = BITMAP_HEADER_BYTES;
+	uint64_t bytes = ((max + 1) + 28) / 30;
+	FILE * file;
+
+	/* Build the header */
+	memset(header, 0, sizeof(header));
+	memcpy(&header[HDR_MAGIC],   bitmap_magic, sizeof(bitmap_magic));
+	memcpy(&header[HDR_VERSION], &version, sizeof(version));
+	memcpy(&header[HDR_LENGTH],  &length, sizeof(length));
+	memcpy(&header[HDR_MAX],     &max, sizeof(max));
+	memcpy(&header[HDR_BYTES],   &bytes, sizeof(bytes));
+
+	/* Open the file and write it */
+	file = fopen(path, "wb");
+	if(file == NULL)
+	{
+		YASE_PERROR(path);
+		return NULL;
+	}
+	if(fwrite(header, 1, sizeof(header), file) != sizeof(header))
+	{
+		YASE_PERROR(path);
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+/* Appends a sieved segment to a bitmap file.  data is the FILE * from
+   bitmap_create().  Write errors are reported by bitmap_finish(). */
+void bitmap_write_segment(const struct segment * seg, void * data)
+{
+	FILE * file = data;
+	fwrite(seg->sieve, 1, (size_t) (seg->end - seg->start), file);
+}
+
+/* Closes a bitmap file after writing, returning nonzero on success */
+int bitmap_finish(FILE * file, const char * path)
+{
+	int ok = !ferror(file);
+	if(fclose(file) != 0)
+	{
+		ok = 0;
+	}
+	if(!ok)
+	{
+		fprintf(stderr, "%s: %s: error writing bitmap\n",
+		        yase_program_name, path);
+	}
+	return ok;
+}
+
+/* Memory-maps a bitmap file for lookups.  Returns nonzero on success.
+   On failure, an error message is printed. */
+int bitmap_open(struct bitmap * bm, const char * path)
+{
+	struct stat st;
+	const uint8_t * header;
+	uint32_t version, length;
+	uint64_t max, bytes;
+	int fd;
+
+	/* Open and map the entire file */
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		YASE_PERROR(path);
+		return 0;
+	}
+	if(fstat(fd, &st) != 0)
+	{
+		YASE_PERROR(path);
+		close(fd);
+		return 0;
+	}
+	if((uint64_t) st.st_size < BITMAP_HEADER_BYTES)
+	{
+		fprintf(stderr, "%s: %s: not a bitmap file\n",
+		        yase_program_name, path);
+		close(fd);
+		return 0;
+	}
+	bm->map_len = (size_t) st.st_size;
+	bm->map = mmap(NULL, bm->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(bm->map == MAP_FAILED)
+	{
+		YASE_PERROR("mmap");
+		return 0;
+	}
+
+	/* Validate the header */
+	header = bm->map;
+	memcpy(&version, &header[HDR_VERSION], sizeof(version));
+	memcpy(&length,  &header[HDR_LENGTH],  sizeof(length));
+	memcpy(&max,     &header[HDR_MAX],     sizeof(max));
+	memcpy(&bytes,   &header[HDR_BYTES],   sizeof(bytes));
+	if(memcmp(&header[HDR_MAGIC], bitmap_magic, sizeof(bitmap_magic)) != 0
+	   || version != BITMAP_VERSION
+	   || length != BITMAP_HEADER_BYTES
+	   || bytes != ((max + 1) + 28) / 30
+	   || bm->map_len - BITMAP_HEADER_BYTES < bytes)
+	{
+		fprintf(stderr, "%s: %s: not a valid bitmap file\n",
+		        yase_program_name, path);
+		munmap(bm->map, bm->map_len);
+		return 0;
+	}
+	bm->bits = header + BITMAP_HEADER_BYTES;
+	bm->max  = max;
+
+	/* Lookups are scattered, so read-ahead would only waste memory */
+	posix_madvise(bm->map, bm->map_len, POSIX_MADV_RANDOM);
+	return 1;
+}
+
+/* Unmaps a bitmap file */
+void bitmap_close(struct bitmap * bm)
+{
+	munmap(bm->map, bm->map_len);
+}
+
+/* Looks up many numbers at once.  Each block of lookups first touches
+   all of the bytes it needs, so that the cache (and page) misses for the
+   block overlap rather than being taken one at a time. */
+void bitmap_isprime_batch(
+		const struct bitmap * bm,
+		const uint64_t * n,
+		size_t count,
+		uint8_t * result)
+{
+	size_t i, j;
+
+	for(i = 0; i < count; i += BATCH_BLOCK)
+	{
+		size_t end = (count - i < BATCH_BLOCK ? count : i + BATCH_BLOCK);
+
+#if defined(__GNUC__) || defined(__clang__)
+		for(j = i; j < end; j++)
+		{
+			__builtin_prefetch(&bm->bits[n[j] / 30]);
+		}
+#endif
+
+		for(j = i; j < end; j++)
+		{
+			result[j] = (uint8_t) bitmap_isprime(bm, n[j]);
+		}
+	}
+}
@@ -0,0 +1,226 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * cache.c: persistent on-disk cache of seed sieves
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <yase.h>
+
+/*
+ * The seed sieve is rebuilt from scratch on every run, which adds up
+ * when running repeatedly at high MAX.  With the cache enabled, the
+ * largest seed sieve computed so far is kept in a file, in
+ * $XDG_CACHE_HOME/yase (or ~/.cache/yase), and later runs that need no
+ * more than it holds just map it and feed their prime sets straight from
+ * the mapping.  A run that needs more computes a larger seed sieve and
+ * replaces the file.
+ *
+ * The file is a header of SEED_HEADER_BYTES bytes, followed by the seed
+ * sieve bits.  The first byte is stored with exactly the primes under 30
+ * set, rather than however the pre-sieve left it, so that the file does
+ * not depend on PRESIEVE_PRIMES.  (The bits seed_fill() reads are the
+ * same either way.)  New files are written under a temporary name and
+ * renamed into place, so concurrent runs always see a complete file.
+ */
+static const char seed_magic[8] = "YASESD1";
+#define SEED_HEADER_BYTES 64
+#define SEED_FILE_NAME "seed.bin"
+
+/* Bits of the first seed sieve byte that are prime: 7 through 29 */
+#define SEED_FIRST_BYTE 0xFE
+
+/* Builds the cache directory name into buf, creating the directory if
+   needed.  Returns zero if there is no usable cache directory. */
+static int cache_dir(char * buf, size_t len)
+{
+	const char * base = getenv("XDG_CACHE_HOME");
+	int n;
+
+	if(base != NULL && base[0] != '\0')
+	{
+		n = snprintf(buf, len, "%s/yase", base);
+	}
+	else if((base = getenv("HOME")) != NULL && base[0] != '\0')
+	{
+		/* Create ~/.cache first, if need be */
+		n = snprintf(buf, len, "%s/.cache", base);
+		if(n < 0 || (size_t) n >= len ||
+		   (mkdir(buf, 0755) != 0 && errno != EEXIST))
+		{
+			return 0;
+		}
+		n = snprintf(buf, len, "%s/.cache/yase", base);
+	}
+	else
+	{
+		return 0;
+	}
+	if(n < 0 || (size_t) n >= len ||
+	   (mkdir(buf, 0755) != 0 && errno != EEXIST))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/* Maps the cached seed sieve at path if it covers at least end_byte
+   bytes.  Returns nonzero on success. */
+static int seed_map(struct seed * seed, const char * path,
+                    uint64_t end_byte)
+{
+	struct stat st;
+	const uint8_t * header;
+	uint64_t bytes;
+	void * map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		return 0;
+	}
+	if(fstat(fd, &st) != 0 || (uint64_t) st.st_size < SEED_HEADER_BYTES)
+	{
+		close(fd);
+		return 0;
+	}
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	/* Check the header, and whether the file is big enough for us */
+	header = map;
+	memcpy(&bytes, &header[8], sizeof(bytes));
+	if(memcmp(header, seed_magic, sizeof(seed_magic)) != 0 ||
+	   (uint64_t) st.st_size - SEED_HEADER_BYTES < bytes ||
+	   bytes < end_byte)
+	{
+		munmap(map, (size_t) st.st_size);
+		return 0;
+	}
+
+	seed->bits    = header + SEED_HEADER_BYTES;
+	seed->bytes   = bytes;
+	seed->owned   = NULL;
+	seed->map     = map;
+	seed->map_len = (size_t) st.st_size;
+	return 1;
+}
+
+/* Writes a seed sieve to the cache file at path, atomically replacing
+   whatever was there.  Failure just means there is no cache next time,
+   so it is reported but not fatal. */
+static void seed_store(const uint8_t * bits, uint64_t bytes,
+                       const char * path)
+{
+	uint8_t header[SEED_HEADER_BYTES];
+	char tmp[4096];
+	FILE * file;
+	int ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+	file = fopen(tmp, "wb");
+	if(file == NULL)
+	{
+		YASE_PERROR(tmp);
+		return;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(header, seed_magic, sizeof(seed_magic));
+	memcpy(&header[8], &bytes, sizeof(bytes));
+	ok = (fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+	      fwrite(bits, 1, (size_t) bytes, file) == bytes);
+	ok = (fclose(file) == 0) && ok;
+	if(!ok || rename(tmp, path) != 0)
+	{
+		YASE_PERROR(tmp);
+		unlink(tmp);
+	}
+}
+
+/*
+ * Gets a seed sieve covering at least end_byte bytes.  If use_cache is
+ * set, the cached seed sieve is mapped if it is big enough; otherwise
+ * one is computed and, if use_cache is set, stored for next time.
+ */
+void seed_get(struct seed * seed, uint64_t end_byte, int use_cache)
+{
+	char path[4096];
+	int have_dir = 0;
+
+	if(use_cache)
+	{
+		have_dir = cache_dir(path, sizeof(path) - sizeof(SEED_FILE_NAME));
+		if(have_dir)
+		{
+			strcat(path, "/" SEED_FILE_NAME);
+			if(seed_map(seed, path, end_byte))
+			{
+				return;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "%s: no cache directory; not caching seed "
+			        "primes\n", yase_program_name);
+		}
+	}
+
+	/* Compute it ourselves (at least one byte, for the header's sake) */
+	if(end_byte == 0)
+	{
+		end_byte = 1;
+	}
+	seed->owned   = seed_find(end_byte);
+	seed->bits    = seed->owned;
+	seed->owned[0] = SEED_FIRST_BYTE;
+	seed->bytes   = end_byte;
+	seed->map     = NULL;
+	seed->map_len = 0;
+	if(have_dir)
+	{
+		seed_store(seed->bits, seed->bytes, path);
+	}
+}
+
+/* Releases a seed sieve from seed_get() */
+void seed_put(struct seed * seed)
+{
+	if(seed->map != NULL)
+	{
+		munmap(seed->map, seed->map_len);
+	}
+	free(seed->owned);
+}
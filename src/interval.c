@@ -29,6 +29,38 @@
 #include <math.h>
 #include <yase.h>
 
+/* Table of pi(x) values for x < 30 */
+const unsigned int pi_under_30[30] =
+{
+	0, 0, 1, 2, 2, 3, 3, 4, 4, 4,
+	4, 5, 5, 6, 6, 6, 6, 7, 7, 8,
+	8, 8, 8, 9, 9, 9, 9, 9, 9, 10
+};
+
+/* Counts the primes no more than x that sieving skips over, i.e. the
+   wheel primes and the pre-sieved primes.  These are the first few
+   primes, so they must be added to a sieved count by hand. */
+uint64_t skipped_primes_upto(uint64_t x)
+{
+	const unsigned int skipped = WHEEL_PRIMES_SKIPPED + PRESIEVE_PRIMES;
+	if(x < 30 && pi_under_30[x] < skipped)
+	{
+		return pi_under_30[x];
+	}
+	return skipped;
+}
+
+/* Counts the primes on [min, max] that sieving skips over */
+uint64_t skipped_primes(uint64_t min, uint64_t max)
+{
+	uint64_t count = skipped_primes_upto(max);
+	if(min != 0)
+	{
+		count -= skipped_primes_upto(min - 1);
+	}
+	return count;
+}
+
 /* Calculates the end bytes and bits for the seed sieve */
 void calculate_seed_interval(
 		uint64_t max,
@@ -43,9 +75,20 @@ void calculate_seed_interval(
 	 */
 	seed_max = (uint64_t) sqrt((double) max);
 
+	/* The double may have been rounded either way, so correct the root
+	   exactly.  (It is never more than 2^32 - 1.) */
+	while(seed_max > UINT32_MAX || seed_max * seed_max > max)
+	{
+		seed_max--;
+	}
+	while(seed_max < UINT32_MAX && (seed_max + 1) * (seed_max + 1) <= max)
+	{
+		seed_max++;
+	}
+
 	/* Find the end byte (the first byte that is not touched) for the
 	   seed sieve.  This "magic expression" is explained in
-	   interval_calculate(). */
+	   calculate_interval(). */
 	*seed_end_byte = ((seed_max + 1) + 28) / 30;
 
 	/* Find the first bit of byte (seed_end_byte - 1) that we don't need
@@ -86,9 +129,10 @@ void calculate_interval(
 	 * find p/q rounding up, you can round down (p+q-1)/q.  28 is used
 	 * instead of 29 because the first bit in each byte is 30k+1.  Thus,
 	 * 30k should still round down.  Try it with a few numbers--you'll
-	 * see that it works.
+	 * see that it works.  It is written out so that max + 29 does not
+	 * overflow near 2^64.
 	 */
-	inter->end_byte = ((max + 1) + 28) / 30;
+	inter->end_byte = max / 30 + (max % 30 != 0);
 
 	/* Calculate the end bit of the interval */
 	if(max % 30 != 0)
@@ -102,22 +146,32 @@ void calculate_interval(
 }
 
 /* Sieves an entire interval, breaking it into segments.  The prime
-   set must be initialized for the interval specified. */
+   set must be initialized for the interval specified.  If a callback is
+   given, it is run after every segment with the segment's bits. */
 void sieve_interval(
 		const struct interval * inter,
 		struct prime_set * set,
-		uint64_t * count)
+		uint64_t * count,
+		segment_callback callback,
+		void * data)
 {
-	unsigned int percent = 0;
 	uint64_t next_byte = inter->start_byte;
+	uint8_t * sieve;
+
+	/* Allocate the sieve bit array */
+	sieve = malloc(LARGE_SEGMENT_BYTES);
+	if(sieve == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
 
-	printf("Sieving . . . %u%%", 0);
-	fflush(stdout);
 	while(next_byte < inter->end_byte)
 	{
 		uint64_t seg_end_byte = next_byte + LARGE_SEGMENT_BYTES;
 		unsigned int seg_start_bit = 0, seg_end_bit = 0;
-		unsigned int new_percent;
+		uint64_t seg_count = 0;
+		STATS_STAMP(stamp);
 
 		/* If this is the first segment, load the right start bit */
 		if(next_byte == inter->start_byte)
@@ -125,36 +179,150 @@ void sieve_interval(
 			seg_start_bit = inter->start_bit;
 		}
 
-		/* If segment is longer than necessary, trim it and load the
-		   right end bit */
-		if(seg_end_byte > inter->end_byte)
-		{ 
+		/* If this is the last segment, trim it if it is longer than
+		   necessary and load the right end bit */
+		if(seg_end_byte >= inter->end_byte)
+		{
 			seg_end_byte = inter->end_byte;
 			seg_end_bit  = inter->end_bit;
 		}
 
 		/* Run the sieve on the segment */
-		sieve_segment(next_byte,
+		YASE_PROBE2(segment_start, next_byte, seg_end_byte);
+		sieve_segment(sieve,
+		              next_byte,
 		              seg_start_bit,
 		              seg_end_byte,
 		              seg_end_bit,
 		              set,
-		              count);
+		              &seg_count);
+		*count += seg_count;
+		YASE_PROBE3(segment_end, next_byte, seg_end_byte, seg_count);
+
+		/* Hand the segment to the callback */
+		if(callback != NULL)
+		{
+			struct segment seg;
+			seg.sieve     = sieve;
+			seg.start     = next_byte;
+			seg.end       = seg_end_byte;
+			seg.start_bit = seg_start_bit;
+			seg.end_bit   = seg_end_bit;
+			seg.count     = seg_count;
+			callback(&seg, data);
+		}
 
 		/* Move forward */
 		next_byte = seg_end_byte;
+		STATS_BEGIN(stamp);
 		prime_set_advance(set);
+		STATS_END(PHASE_ADVANCE, stamp);
+	}
 
-		/* Update the progress counter if the percentage has changed */
-		new_percent = (unsigned int)
-		              ((next_byte - inter->start_byte) * 100 /
-		               (inter->end_byte - inter->start_byte));
-		if(new_percent != percent)
-		{
-			percent = new_percent;
-			printf("\rSieving . . . %u%%", percent);
-			fflush(stdout);
-		}
+	free(sieve);
+}
+
+/* Sieves [min, max] from scratch, using the sieving primes found by a
+   seed sieve that covers max, as a narrow window if it is one.  Returns
+   the number of primes found by sieving, which does not include the
+   skipped primes. */
+uint64_t sieve_range(
+		uint64_t min,
+		uint64_t max,
+		const uint8_t * seed_sieve,
+		segment_callback callback,
+		void * data)
+{
+	uint64_t seed_end_byte, count = 0;
+	unsigned int seed_end_bit;
+	struct interval inter;
+	struct prime_set set;
+
+	calculate_interval(min, max, &inter);
+	calculate_seed_interval(max, &seed_end_byte, &seed_end_bit);
+	if(window_preferred(&inter, seed_end_byte))
+	{
+		struct window win;
+		window_init(&win, &inter);
+		seed_fill_window(seed_sieve, seed_end_byte, seed_end_bit, &win,
+		                 1);
+		sieve_window(&inter, &win, &count, callback, data);
+		window_cleanup(&win);
+		return count;
+	}
+	prime_set_init(&set, &inter);
+	seed_fill(seed_sieve, seed_end_byte, seed_end_bit, &set);
+	sieve_interval(&inter, &set, &count, callback, data);
+	prime_set_cleanup(&set);
+	return count;
+}
+
+/* Counts the primes on a sieved segment that are no more than x */
+uint64_t segment_count_upto(const struct segment * seg, uint64_t x)
+{
+	uint64_t end_byte;
+	unsigned int end_bit;
+
+	/* Nothing before the segment; everything after it */
+	if(x / 30 < seg->start)
+	{
+		return 0;
+	}
+	end_byte = x / 30 + (x % 30 != 0);
+	end_bit  = (x % 30 != 0 ? (wheel30_last_idx[x % 30] + 1) % 8 : 0);
+	if(end_byte > seg->end || (end_byte == seg->end && end_bit == 0))
+	{
+		return seg->count;
+	}
+
+	/* Count up to x, as calculate_interval() would find the end */
+	if(end_byte == seg->start)
+	{
+		return 0;
 	}
+	return popcnt(seg->sieve, seg->start_bit,
+	              (unsigned long) (end_byte - seg->start), end_bit);
+}
+
+/* Checks whether the primes up to x are all on or before a sieved
+   segment, i.e. whether segment_count_upto() can count up to x yet */
+int segment_reaches(const struct segment * seg, uint64_t x)
+{
+	/* Multiples of 30 have no bit; 30k belongs with byte k - 1 */
+	return x / 30 < seg->end || (x % 30 == 0 && x / 30 == seg->end);
+}
+
+/* Starts a progress display for an interval */
+void progress_start(struct progress * prog, const struct interval * inter)
+{
+	prog->start   = inter->start_byte;
+	prog->end     = inter->end_byte;
+	prog->percent = 0;
+	printf("Sieving . . . %u%%", 0);
+	fflush(stdout);
+}
+
+/* Updates the progress display after a segment.  This is a segment
+   callback; data must point to the struct progress. */
+void progress_update(const struct segment * seg, void * data)
+{
+	struct progress * prog = data;
+	unsigned int new_percent;
+
+	/* Update the progress counter if the percentage has changed */
+	new_percent = (unsigned int)
+	              ((seg->end - prog->start) * 100 /
+	               (prog->end - prog->start));
+	if(new_percent != prog->percent)
+	{
+		prog->percent = new_percent;
+		printf("\rSieving . . . %u%%", prog->percent);
+		fflush(stdout);
+	}
+}
+
+/* Finishes a progress display */
+void progress_finish(void)
+{
 	putchar('\n');
 }
@@ -0,0 +1,571 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * kernels.c: microbenchmarks of the sieve's inner loops, for yase-bench
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <yase.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+/*
+ * Each kernel is run on synthetic but realistic input: sieving primes
+ * are the real ones for a segment far from 0, found with a seed sieve
+ * and a window (see set.c), and buffers are segment-sized.  A kernel is
+ * timed over a number of trials, each doing a fixed amount of work, and
+ * the median trial is reported per unit of work: per byte for copies and
+ * counts, per multiple marked for marking loops, and per call for
+ * prime_set_advance().  Times are in nanoseconds and, on x86, in time
+ * stamp counter ticks, which track cycles at the CPU's base clock.
+ */
+
+/* Where the sieving primes for the kernels are taken from */
+#define SMALL_START UINT64_C(1000000000000)
+#define LARGE_START UINT64_C(1000000000000000)
+#define ADVANCE_START UINT64_C(1000000000000000000)
+
+/* Segments marked or copied in each trial */
+#define TRIAL_SEGMENTS 16
+
+/* Advances timed in each trial of prime_set_advance() */
+#define TRIAL_ADVANCES 64
+
+/* A time, in nanoseconds and in ticks */
+struct kernel_time
+{
+	uint64_t ns;
+	uint64_t ticks;
+};
+
+/* Median time per unit of one kernel */
+struct kernel_result
+{
+	char name[32];      /* Kernel and its parameter */
+	const char * unit;  /* Unit of work             */
+	double ns;          /* Nanoseconds per unit     */
+	double ticks;       /* Ticks per unit           */
+};
+
+/* Reads both clocks */
+static void kernel_now(struct kernel_time * t)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t->ns = (uint64_t) ts.tv_sec * UINT64_C(1000000000) +
+	        (uint64_t) ts.tv_nsec;
+#if HAVE_TSC
+	t->ticks = __rdtsc();
+#else
+	t->ticks = 0;
+#endif
+}
+
+/* Adds the time since start to total */
+static void kernel_add(struct kernel_time * total,
+                       const struct kernel_time * start)
+{
+	struct kernel_time now;
+	kernel_now(&now);
+	total->ns    += now.ns - start->ns;
+	total->ticks += now.ticks - start->ticks;
+}
+
+/* Sorts the trials by time */
+static int compare_time(const void * a, const void * b)
+{
+	const struct kernel_time * x = a, * y = b;
+	return (x->ns > y->ns) - (x->ns < y->ns);
+}
+
+/* Fills in a result from the trials, each covering units of work */
+static void kernel_finish(struct kernel_result * res,
+                          struct kernel_time * trials, unsigned int n,
+                          double units)
+{
+	qsort(trials, n, sizeof(*trials), compare_time);
+	res->ns    = trials[n / 2].ns / units;
+	res->ticks = trials[n / 2].ticks / units;
+}
+
+/* Allocates a segment buffer */
+static uint8_t * segment_alloc(void)
+{
+	uint8_t * sieve = malloc(LARGE_SEGMENT_BYTES);
+	if(sieve == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	memset(sieve, 0xFF, LARGE_SEGMENT_BYTES);
+	return sieve;
+}
+
+/* Finds the sieving primes with a multiple in the first segment at
+   start, in a window */
+static void window_for(struct window * win, uint64_t start)
+{
+	uint64_t seed_end_byte;
+	unsigned int seed_end_bit;
+	struct interval inter;
+
+	calculate_interval(start, start + LARGE_SEGMENT_BYTES * 30 - 1,
+	                   &inter);
+	calculate_seed_interval(start + LARGE_SEGMENT_BYTES * 30 - 1,
+	                        &seed_end_byte, &seed_end_bit);
+	window_init(win, &inter);
+	sieve_seed_window(seed_end_byte, seed_end_bit, win, 1);
+}
+
+/* Returns all of the buckets in a set's lists to its pool */
+static void drain_lists(struct prime_set * set)
+{
+	unsigned long i;
+	for(i = 0; i < set->lists_alloc; i++)
+	{
+		while(set->lists[i] != NULL)
+		{
+			struct bucket * bucket = set->lists[i];
+			set->lists[i] = bucket->next;
+			prime_set_bucket_return(set, bucket);
+		}
+	}
+}
+
+/* presieve_copy(), per byte, over consecutive segments */
+static void bench_presieve(struct kernel_result * res, unsigned int trials,
+                           struct kernel_time * t)
+{
+	uint8_t * sieve = segment_alloc();
+	unsigned int trial, s;
+
+	for(trial = 0; trial < trials; trial++)
+	{
+		struct kernel_time start;
+		uint64_t byte = (uint64_t) trial * TRIAL_SEGMENTS *
+		                LARGE_SEGMENT_BYTES;
+		t[trial].ns = t[trial].ticks = 0;
+		kernel_now(&start);
+		for(s = 0; s < TRIAL_SEGMENTS; s++)
+		{
+			presieve_copy(sieve, byte, byte + LARGE_SEGMENT_BYTES);
+			byte += LARGE_SEGMENT_BYTES;
+		}
+		kernel_add(&t[trial], &start);
+	}
+	strcpy(res->name, "presieve_copy");
+	res->unit = "byte";
+	kernel_finish(res, t, trials,
+	              (double) TRIAL_SEGMENTS * LARGE_SEGMENT_BYTES);
+	free(sieve);
+}
+
+/* process_small_prime(), per multiple marked, for the small sieving
+   primes of one residue class mod 30 */
+static void bench_small(struct kernel_result * res, unsigned int trials,
+                        struct kernel_time * t, const struct window * win,
+                        unsigned int cls)
+{
+	uint8_t * sieve = segment_alloc();
+	struct prime * primes;
+	double multiples = 0;
+	unsigned int trial, s;
+	size_t i, n = 0;
+
+	/* The wheel_idx of a small prime is its class times 8, plus its
+	   place in the cycle */
+	primes = malloc((win->n_small + 1) * sizeof(struct prime));
+	if(primes == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(i = 0; i < win->n_small; i++)
+	{
+		if(win->small[i].wheel_idx / 8 == cls)
+		{
+			uint64_t prime = (uint64_t) win->small[i].prime_adj * 30 +
+			                 wheel30_offs[cls];
+			primes[n++] = win->small[i];
+			multiples += LARGE_SEGMENT_BYTES * 8.0 / prime;
+		}
+	}
+
+	for(trial = 0; trial < trials; trial++)
+	{
+		struct kernel_time start;
+		t[trial].ns = t[trial].ticks = 0;
+		kernel_now(&start);
+		for(s = 0; s < TRIAL_SEGMENTS; s++)
+		{
+			mark_small_primes(sieve, primes, n);
+		}
+		kernel_add(&t[trial], &start);
+	}
+	sprintf(res->name, "small_prime/%u", wheel30_offs[cls]);
+	res->unit = "multiple";
+	kernel_finish(res, t, trials, multiples * TRIAL_SEGMENTS);
+	free(primes);
+	free(sieve);
+}
+
+/* process_large_prime_bucket(), per multiple marked, with buckets filled
+   to fill primes */
+static void bench_large(struct kernel_result * res, unsigned int trials,
+                        struct kernel_time * t, const struct window * win,
+                        unsigned long fill)
+{
+	uint8_t * sieve = segment_alloc();
+	struct prime_set set;
+	struct interval inter;
+	struct bucket * bucket;
+	unsigned int trial, s;
+	size_t next = 0;
+
+	/* The set is only there to take the primes back */
+	calculate_interval(LARGE_START, LARGE_START * 2, &inter);
+	prime_set_init(&set, &inter);
+	bucket = prime_set_bucket_init(&set, NULL);
+
+	for(trial = 0; trial < trials; trial++)
+	{
+		t[trial].ns = t[trial].ticks = 0;
+		for(s = 0; s < TRIAL_SEGMENTS * 8; s++)
+		{
+			struct kernel_time start;
+
+			/* Take the next fill primes, round robin */
+			bucket->count = 0;
+			bucket->next  = NULL;
+			while(bucket->count < fill)
+			{
+				bucket->primes[bucket->count++] = win->large[next];
+				next = (next + 1) % win->n_large;
+			}
+
+			kernel_now(&start);
+			mark_large_bucket(sieve, &set, bucket);
+			kernel_add(&t[trial], &start);
+			drain_lists(&set);
+		}
+	}
+	sprintf(res->name, "large_bucket/%lu", fill);
+	res->unit = "multiple";
+	kernel_finish(res, t, trials, (double) TRIAL_SEGMENTS * 8 * fill);
+	prime_set_bucket_return(&set, bucket);
+	prime_set_cleanup(&set);
+	free(sieve);
+}
+
+/* prime_set_advance(), per call, activating density primes each time.
+   The set is far from 0, so it has as many lists as a real one. */
+static void bench_advance(struct kernel_result * res, unsigned int trials,
+                          struct kernel_time * t, unsigned long density)
+{
+	struct prime_set set;
+	struct interval inter;
+	unsigned int trial, a;
+	unsigned long i;
+
+	calculate_interval(ADVANCE_START, ADVANCE_START * 2, &inter);
+	prime_set_init(&set, &inter);
+
+	for(trial = 0; trial < trials; trial++)
+	{
+		/* Queue density primes for each advance, in order */
+		set.current = 0;
+		for(a = 1; a <= TRIAL_ADVANCES; a++)
+		{
+			for(i = 0; i < density; i++)
+			{
+				uint64_t next_byte = (uint64_t) a * LARGE_SEGMENT_BYTES +
+				                     (i * 7919) % LARGE_SEGMENT_BYTES;
+				if(set.inactive_end == NULL ||
+				   !bucket_append(set.inactive_end, 100000, next_byte, 0))
+				{
+					struct bucket * node = prime_set_bucket_init(&set,
+					                                             NULL);
+					bucket_append(node, 100000, next_byte, 0);
+					if(set.inactive_end != NULL)
+					{
+						set.inactive_end->next = node;
+					}
+					else
+					{
+						set.inactive = node;
+					}
+					set.inactive_end = node;
+				}
+			}
+		}
+
+		t[trial].ns = t[trial].ticks = 0;
+		for(a = 0; a < TRIAL_ADVANCES; a++)
+		{
+			struct kernel_time start;
+			kernel_now(&start);
+			prime_set_advance(&set);
+			kernel_add(&t[trial], &start);
+			drain_lists(&set);
+		}
+		set.inactive_end = NULL;
+	}
+	sprintf(res->name, "set_advance/%lu", density);
+	res->unit = "call";
+	kernel_finish(res, t, trials, TRIAL_ADVANCES);
+	prime_set_cleanup(&set);
+}
+
+/* popcnt(), per byte, on buffers of a given length */
+static void bench_popcnt(struct kernel_result * res, unsigned int trials,
+                         struct kernel_time * t, unsigned long bytes)
+{
+	uint8_t * sieve = segment_alloc();
+	unsigned long i, rounds = TRIAL_SEGMENTS * LARGE_SEGMENT_BYTES / bytes;
+	volatile uint64_t sink = 0;
+	unsigned int trial;
+
+	/* Something like a sieved segment, about a quarter of bits set */
+	srand(1);
+	for(i = 0; i < LARGE_SEGMENT_BYTES; i++)
+	{
+		sieve[i] = (uint8_t) (rand() & rand());
+	}
+	for(trial = 0; trial < trials; trial++)
+	{
+		struct kernel_time start;
+		t[trial].ns = t[trial].ticks = 0;
+		kernel_now(&start);
+		for(i = 0; i < rounds; i++)
+		{
+			sink += popcnt(sieve, 0, bytes, 0);
+		}
+		kernel_add(&t[trial], &start);
+	}
+	sprintf(res->name, "popcnt/%lu", bytes);
+	res->unit = "byte";
+	kernel_finish(res, t, trials, (double) rounds * bytes);
+	free(sieve);
+}
+
+/* mark_multiple_210(), per multiple marked, for one prime at a time
+   across a segment */
+static void bench_mark_210(struct kernel_result * res, unsigned int trials,
+                           struct kernel_time * t, uint32_t prime)
+{
+	uint8_t * sieve = segment_alloc();
+	uint32_t prime_adj = prime / 30;
+	uint64_t marked = 0;
+	unsigned int trial, s, sweeps;
+
+	/* Sweep large primes over the segment more times, since each
+	   marks only a few multiples */
+	sweeps = TRIAL_SEGMENTS * (1 + prime_adj / 1024);
+
+	for(trial = 0; trial < trials; trial++)
+	{
+		struct kernel_time start;
+		t[trial].ns = t[trial].ticks = 0;
+		marked = 0;
+		kernel_now(&start);
+		for(s = 0; s < sweeps; s++)
+		{
+			uint32_t byte = s % prime_adj;
+			uint32_t wheel_idx = wheel30_find_idx[prime % 30] * 48 +
+			                     wheel210_last_idx[prime % 210];
+			while(byte < LARGE_SEGMENT_BYTES)
+			{
+				mark_multiple_210(sieve, prime_adj, &byte, &wheel_idx);
+				marked++;
+			}
+		}
+		kernel_add(&t[trial], &start);
+	}
+	sprintf(res->name, "mark_multiple_210/%" PRIu32, prime);
+	res->unit = "multiple";
+	kernel_finish(res, t, trials, (double) marked);
+	free(sieve);
+}
+
+/* Kernels and their parameters, in the order they run */
+enum kernel_kind
+{
+	KERNEL_PRESIEVE,
+	KERNEL_SMALL,
+	KERNEL_LARGE,
+	KERNEL_ADVANCE,
+	KERNEL_POPCNT,
+	KERNEL_MARK_210
+};
+static const struct
+{
+	enum kernel_kind kind;
+	unsigned long param;
+}
+kernels[] =
+{
+	{ KERNEL_PRESIEVE, 0 },
+	{ KERNEL_SMALL, 0 }, { KERNEL_SMALL, 1 }, { KERNEL_SMALL, 2 },
+	{ KERNEL_SMALL, 3 }, { KERNEL_SMALL, 4 }, { KERNEL_SMALL, 5 },
+	{ KERNEL_SMALL, 6 }, { KERNEL_SMALL, 7 },
+	{ KERNEL_LARGE, BUCKET_PRIMES / 8 }, { KERNEL_LARGE, BUCKET_PRIMES / 4 },
+	{ KERNEL_LARGE, BUCKET_PRIMES / 2 }, { KERNEL_LARGE, BUCKET_PRIMES },
+	{ KERNEL_ADVANCE, 0 }, { KERNEL_ADVANCE, 64 },
+	{ KERNEL_ADVANCE, 1024 }, { KERNEL_ADVANCE, 16384 },
+	{ KERNEL_POPCNT, 1024 }, { KERNEL_POPCNT, 8192 },
+	{ KERNEL_POPCNT, SMALL_SEGMENT_BYTES },
+	{ KERNEL_POPCNT, LARGE_SEGMENT_BYTES },
+	{ KERNEL_MARK_210, 65537 }, { KERNEL_MARK_210, 1000003 },
+	{ KERNEL_MARK_210, 31622777 }
+};
+#define N_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+/* Writes the results as JSON */
+static void kernels_json(FILE * file, const struct kernel_result * results,
+                         unsigned int n, unsigned int trials)
+{
+	unsigned int i;
+
+	fprintf(file, "{\n  \"version\": \"%u.%u.%u\",\n  \"trials\": %u,\n"
+	        "  \"kernels\": [", VERSION_MAJOR, VERSION_MINOR,
+	        VERSION_PATCH, trials);
+	for(i = 0; i < n; i++)
+	{
+		fprintf(file, "%s\n    {\"name\": \"%s\", \"unit\": \"%s\", "
+		        "\"ns_per_unit\": %.6g", (i == 0 ? "" : ","),
+		        results[i].name, results[i].unit, results[i].ns);
+		if(HAVE_TSC)
+		{
+			fprintf(file, ", \"ticks_per_unit\": %.6g", results[i].ticks);
+		}
+		fprintf(file, "}");
+	}
+	fprintf(file, "\n  ]\n}\n");
+}
+
+/*
+ * Runs the kernel benchmarks, each over the given number of trials,
+ * printing a table and writing JSON to json if it is not NULL.  Only the
+ * kernels for which selected() returns nonzero are run.  The wheel,
+ * population count and pre-sieve must be initialized.
+ */
+void bench_kernels(unsigned int trials, int (*selected)(const char * name),
+                   FILE * json)
+{
+	struct kernel_result results[N_KERNELS];
+	struct kernel_time * t;
+	struct window small_win, large_win;
+	unsigned int k, n = 0;
+
+	t = malloc(trials * sizeof(*t));
+	if(t == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	window_for(&small_win, SMALL_START);
+	window_for(&large_win, LARGE_START);
+
+	printf("%-28s %-10s %12s %12s\n", "Kernel", "Unit", "ns/unit",
+	       (HAVE_TSC ? "ticks/unit" : ""));
+	for(k = 0; k < N_KERNELS; k++)
+	{
+		struct kernel_result * res = &results[n];
+		unsigned long param = kernels[k].param;
+		char name[32];
+
+		/* Name the kernel first, so that it can be skipped cheaply */
+		switch(kernels[k].kind)
+		{
+			case KERNEL_PRESIEVE:
+				strcpy(name, "presieve_copy");
+				break;
+			case KERNEL_SMALL:
+				sprintf(name, "small_prime/%u", wheel30_offs[param]);
+				break;
+			case KERNEL_LARGE:
+				sprintf(name, "large_bucket/%lu", param);
+				break;
+			case KERNEL_ADVANCE:
+				sprintf(name, "set_advance/%lu", param);
+				break;
+			case KERNEL_POPCNT:
+				sprintf(name, "popcnt/%lu", param);
+				break;
+			case KERNEL_MARK_210:
+				sprintf(name, "mark_multiple_210/%lu", param);
+				break;
+		}
+		if(!selected(name))
+		{
+			continue;
+		}
+
+		switch(kernels[k].kind)
+		{
+			case KERNEL_PRESIEVE:
+				bench_presieve(res, trials, t);
+				break;
+			case KERNEL_SMALL:
+				bench_small(res, trials, t, &small_win,
+				            (unsigned int) param);
+				break;
+			case KERNEL_LARGE:
+				bench_large(res, trials, t, &large_win, param);
+				break;
+			case KERNEL_ADVANCE:
+				bench_advance(res, trials, t, param);
+				break;
+			case KERNEL_POPCNT:
+				bench_popcnt(res, trials, t, param);
+				break;
+			case KERNEL_MARK_210:
+				bench_mark_210(res, trials, t, (uint32_t) param);
+				break;
+		}
+		printf("%-28s %-10s %12.4f", res->name, res->unit, res->ns);
+		if(HAVE_TSC)
+		{
+			printf(" %12.3f", res->ticks);
+		}
+		printf("\n");
+		fflush(stdout);
+		n++;
+	}
+
+	if(json != NULL)
+	{
+		kernels_json(json, results, n, trials);
+	}
+	window_cleanup(&small_win);
+	window_cleanup(&large_win);
+	free(t);
+}
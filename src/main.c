@@ -26,6 +26,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 #include <yase.h>
@@ -36,22 +37,534 @@ const char * yase_program_name;
 /* Help format string */
 static const char * help_format =
 "Usage: %s [OPTION]... [MIN] MAX\n"
+"  or:  %s --dump FILE MAX\n"
+"  or:  %s --lookup FILE [N]...\n"
+"  or:  %s --test [N]...\n"
+"  or:  %s --batch FILE [--threads N]\n"
+"  or:  %s --serve SOCKET [--threads N]\n"
+"  or:  %s --make-table FILE [--step STEP] MAX\n"
+"  or:  %s --table FILE [MIN] MAX\n"
 "Count and display the number of primes on the interval [MIN,MAX].  MIN\n"
 "and MAX be expressions, e.g. 2^32-1.  Supported operations are addition\n"
 "(+), subtraction (-), multiplication (*), and exponentiation (** or ^).\n"
-"If MIN is not provided, it is assumed to be 0.\n\n"
+"If MIN is not provided, it is assumed to be 0.  Long ranges are counted\n"
+"combinatorially, without sieving all of them, unless --sieve is given.\n\n"
+"With --dump, also write the sieved bitmap for [0,MAX] to FILE.  With\n"
+"--lookup, report whether each N is prime using a bitmap written by\n"
+"--dump.  With --test, test each N for primality directly, which works\n"
+"for any N < 2^64.  Both read the numbers from standard input if none\n"
+"are given.\n\n"
+"With --batch, count the primes on each range in FILE (- for standard\n"
+"input), given one per line as MAX or MIN MAX, and print MIN MAX COUNT\n"
+"for each.  Overlapping ranges are only sieved once.\n\n"
+"With --serve, stay resident and answer \"count [MIN] MAX\", \"nth N\",\n"
+"and \"list [MIN] MAX\" requests, one per line, on the Unix domain socket\n"
+"SOCKET.\n\n"
+"With --checkpoints STEP, also print the count from MIN up to every\n"
+"multiple of STEP on [MIN,MAX] as it is reached, one \"X COUNT\" per line.\n"
+"--at FILE does the same for the numbers listed in FILE (- for standard\n"
+"input).  Either way, [MIN,MAX] is sieved in a single pass, and standard\n"
+"output holds only the counts; everything else goes to standard error.\n\n"
+"With --resume FILE, save the state of the run to FILE every minute, and\n"
+"when it is done or interrupted.  Running again with the same FILE and\n"
+"MIN carries on from there, even to a larger MAX.\n\n"
+"With --memo FILE, remember the count of every whole segment sieved in\n"
+"FILE, and take the counts of segments seen before from it, sieving only\n"
+"the rest.  Several runs may share FILE at once.\n\n"
+"With --stats, also report the wall clock and CPU time spent in each\n"
+"phase of the sieve, and how many segments and buckets it went through.\n"
+"It implies --sieve.  --perf does the same, and adds the instructions per\n"
+"cycle and cache, TLB and branch misses per segment of each phase, read\n"
+"from the CPU's performance counters.\n\n"
+"With --quiet, print only the result: no progress, and no work done to\n"
+"track it.  With --format json, print the result as a single JSON object\n"
+"instead, with the range, count, method, times, threads, build parameters\n"
+"and (when built with PHASE_STATS) the time spent in each phase that\n"
+"ran.  Both also work with --table.\n\n"
+"With --telemetry SECONDS, write a snapshot of the run to standard error\n"
+"every SECONDS seconds: how far it has got, the rate, the time left, the\n"
+"primes found so far and the memory in use.  --telemetry-file FILE\n"
+"appends them to FILE as JSON lines instead (every 10 seconds unless\n"
+"--telemetry says otherwise).  A sieving run also takes a snapshot\n"
+"whenever it gets SIGUSR1 (one asked for while finding the sieving\n"
+"primes comes once sieving starts), unless it is --quiet without these\n"
+"options.  Other counting runs ignore SIGUSR1.\n\n"
+"With --make-table, sieve [0,MAX] once and write pi(x) at every multiple\n"
+"of STEP (default 10^9) to FILE.  With --table, count the primes on\n"
+"[MIN,MAX] using such a file, sieving only from the nearest multiples\n"
+"of STEP.\n\n"
 "Options:\n"
-" --help      display this help meessage\n"
-" --version   display version information\n";
+" --help          display this help meessage\n"
+" --version       display version information\n"
+" --dump FILE     write the prime bitmap for [0,MAX] to FILE\n"
+" --lookup FILE   look up numbers in the prime bitmap FILE\n"
+" --test          test numbers for primality without sieving\n"
+" --batch FILE    count the primes on each range listed in FILE\n"
+" --serve SOCKET  answer queries on the Unix domain socket SOCKET\n"
+" --make-table FILE\n"
+"                 write a table of pi(x) checkpoints to FILE\n"
+" --table FILE    count using the pi(x) checkpoints in FILE\n"
+" --step STEP     space checkpoints STEP apart (default: 10^9)\n"
+" --checkpoints STEP\n"
+"                 print the count up to every multiple of STEP\n"
+" --at FILE       print the count up to each number listed in FILE\n"
+" --resume FILE   save the run's state in FILE, and resume from it\n"
+" --memo FILE     reuse and record segment counts in FILE\n"
+" --sieve         always count by sieving\n"
+" --stats         report time spent in each phase of the sieve\n"
+" --perf          also report hardware counters for each phase\n"
+" --quiet         print only the result\n"
+" --format FMT    print the result as text (default) or json, which\n"
+"                 implies --quiet\n"
+" --telemetry SECONDS\n"
+"                 report on the run every SECONDS seconds\n"
+" --telemetry-file FILE\n"
+"                 append the reports to FILE as JSON lines\n"
+" --threads N     use N threads (default: one per CPU)\n"
+" --cache         keep the sieving primes in $XDG_CACHE_HOME/yase for\n"
+"                 later runs\n";
 
-/* Table of pi(x) values for x < 30 */
-static unsigned int pi_under_30[30] =
+/* Data for the segment callback when dumping a bitmap */
+struct dump_data
 {
-	0, 0, 1, 2, 2, 3, 3, 4, 4, 4,
-	4, 5, 5, 6, 6, 6, 6, 7, 7, 8,
-	8, 8, 8, 9, 9, 9, 9, 9, 9, 10
+	FILE * file;            /* Bitmap file being written         */
+	struct progress * prog; /* Progress display, or NULL if quiet */
 };
 
+/* Segment callback when dumping a bitmap: writes out the segment and
+   updates the progress display */
+static void dump_segment(const struct segment * seg, void * data)
+{
+	struct dump_data * dump = data;
+	bitmap_write_segment(seg, dump->file);
+	if(dump->prog != NULL)
+	{
+		progress_update(seg, dump->prog);
+	}
+}
+
+/* Nonzero if only the result is to be printed */
+static int quiet;
+
+/* Where messages for people go: standard output, unless it is taken by
+   the counts at checkpoints */
+static FILE * human;
+
+/* Prints a line of progress, unless quiet */
+static void say(const char * message)
+{
+	if(!quiet)
+	{
+		fprintf(human, "%s\n", message);
+	}
+}
+
+/* Reads the monotonic clock in seconds */
+static double wall_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Prints the result of a count for --format json: the range asked for,
+ * the count, how it was found ("table", "combinatorial", "memo",
+ * "resumed" or "sieve"), the CPU and wall clock time since the sieve
+ * was set up, the threads used and the build parameters, then the phase
+ * timings if stats is nonzero.
+ */
+static void report_json(const struct args * args, uint64_t count,
+                        const char * method, double cpu, double wall,
+                        unsigned int threads, int stats)
+{
+	printf("{\"yase\": \"%u.%u.%u\", \"min\": %" PRIu64 ", "
+	       "\"max\": %" PRIu64 ", \"count\": %" PRIu64 ", "
+	       "\"method\": \"%s\", \"cpu_s\": %.6f, \"wall_s\": %.6f, "
+	       "\"threads\": %u,\n \"config\": {\"small_segment_bytes\": %u, "
+	       "\"large_segment_bytes\": %u, \"small_threshold\": %u, "
+	       "\"bucket_primes\": %u, \"presieve_primes\": %u, "
+	       "\"phase_stats\": %u}", VERSION_MAJOR, VERSION_MINOR,
+	       VERSION_PATCH, args->min, args->max, count, method, cpu, wall,
+	       threads, (unsigned int) SMALL_SEGMENT_BYTES,
+	       (unsigned int) LARGE_SEGMENT_BYTES,
+	       (unsigned int) SMALL_THRESHOLD, (unsigned int) BUCKET_PRIMES,
+	       (unsigned int) PRESIEVE_PRIMES, (unsigned int) PHASE_STATS);
+	if(stats)
+	{
+		printf(",\n \"stats\": ");
+		stats_json(stdout);
+	}
+	printf("}\n");
+}
+
+/* Number of queries to batch together when reading standard input */
+#define QUERY_BATCH 4096
+
+/* Answers a batch of primality queries, writing 1 (prime) or 0 (not
+   prime) to each result */
+typedef void (*query_fn)(
+		const uint64_t * n,
+		size_t count,
+		uint8_t * result,
+		void * data);
+
+/* Prints the results of a batch of queries */
+static void print_queries(const uint64_t * n, const uint8_t * result,
+                          size_t count)
+{
+	size_t i;
+	for(i = 0; i < count; i++)
+	{
+		printf("%" PRIu64 " %s\n", n[i], result[i] ? "prime" : "not prime");
+	}
+}
+
+/* Evaluates a number to query, checking it against the largest number
+   that can be answered.  Returns nonzero if it can be queried. */
+static int query_value(const char * expr, uint64_t limit, uint64_t * n)
+{
+	if(!evaluate(expr, n))
+	{
+		fprintf(stderr, "%s: failed to evaluate '%s'\n",
+		        yase_program_name, expr);
+		return 0;
+	}
+	if(*n > limit)
+	{
+		fprintf(stderr, "%s: %" PRIu64 " is beyond the maximum of "
+		        "%" PRIu64 "\n", yase_program_name, *n, limit);
+		return 0;
+	}
+	return 1;
+}
+
+/* Answers primality queries for the numbers given on the command line,
+   or on standard input if there are none, in batches */
+static int run_queries(const struct args * args, uint64_t limit,
+                       query_fn fn, void * data)
+{
+	static uint64_t n[QUERY_BATCH];
+	static uint8_t result[QUERY_BATCH];
+	size_t count = 0;
+	int status = EXIT_SUCCESS;
+
+	if(args->n_values > 0)
+	{
+		int i;
+		for(i = 0; i < args->n_values; i++)
+		{
+			if(query_value(args->values[i], limit, &n[0]))
+			{
+				fn(n, 1, result, data);
+				print_queries(n, result, 1);
+			}
+			else
+			{
+				status = EXIT_FAILURE;
+			}
+		}
+	}
+	else
+	{
+		char line[256];
+		while(fgets(line, sizeof(line), stdin) != NULL)
+		{
+			/* Strip the newline and skip blank lines */
+			line[strcspn(line, "\r\n")] = '\0';
+			if(line[0] == '\0')
+			{
+				continue;
+			}
+
+			/* Queue the number, and run the batch once it fills up */
+			if(!query_value(line, limit, &n[count]))
+			{
+				status = EXIT_FAILURE;
+				continue;
+			}
+			if(++count == QUERY_BATCH)
+			{
+				fn(n, count, result, data);
+				print_queries(n, result, count);
+				count = 0;
+			}
+		}
+		fn(n, count, result, data);
+		print_queries(n, result, count);
+	}
+
+	return status;
+}
+
+/* Query function for bitmap lookups */
+static void lookup_batch(const uint64_t * n, size_t count,
+                         uint8_t * result, void * data)
+{
+	bitmap_isprime_batch(data, n, count, result);
+}
+
+/* Looks up numbers in a bitmap file */
+static int run_lookup(const struct args * args)
+{
+	struct bitmap bm;
+	int status;
+
+	if(!bitmap_open(&bm, args->file))
+	{
+		return EXIT_FAILURE;
+	}
+	status = run_queries(args, bm.max, lookup_batch, &bm);
+	bitmap_close(&bm);
+	return status;
+}
+
+/* Query function for primality tests */
+static void test_batch(const uint64_t * n, size_t count,
+                       uint8_t * result, void * data)
+{
+	(void) data;
+	yase_is_prime_u64_batch(n, count, result);
+}
+
+/* Tests numbers for primality directly, without sieving */
+static int run_test(const struct args * args)
+{
+	int status;
+
+	wheel_init();
+	presieve_init();
+	primality_init();
+	status = run_queries(args, UINT64_MAX, test_batch, NULL);
+	primality_cleanup();
+	presieve_cleanup();
+	return status;
+}
+
+/* Data for the segment callback when reporting cumulative counts.  The
+   checkpoints are either every step from first on, or those in at. */
+struct checkpoint_data
+{
+	uint64_t min;        /* Start of the interval                */
+	uint64_t max;        /* End of the interval                  */
+	uint64_t before;     /* Primes sieved before this segment    */
+	uint64_t x;          /* Next checkpoint                      */
+	int done;            /* Nonzero once past the last checkpoint */
+	uint64_t step;       /* Spacing of checkpoints, or 0 for at  */
+	uint64_t * at;       /* Checkpoints from a file, ascending   */
+	size_t n_at;         /* Number of checkpoints in at          */
+	size_t next_at;      /* Index of x in at                     */
+};
+
+/* Moves on to the next checkpoint */
+static void checkpoint_next(struct checkpoint_data * cp)
+{
+	if(cp->step != 0)
+	{
+		if(cp->max - cp->x < cp->step)
+		{
+			cp->done = 1;
+		}
+		else
+		{
+			cp->x += cp->step;
+		}
+	}
+	else if(++cp->next_at == cp->n_at)
+	{
+		cp->done = 1;
+	}
+	else
+	{
+		cp->x = cp->at[cp->next_at];
+	}
+}
+
+/* Segment callback when reporting cumulative counts: prints the count
+   from the start of the interval up to each checkpoint that the segment
+   reaches, counting the last partial byte bit by bit */
+static void checkpoint_segment(const struct segment * seg, void * data)
+{
+	struct checkpoint_data * cp = data;
+	while(!cp->done && segment_reaches(seg, cp->x))
+	{
+		printf("%" PRIu64 " %" PRIu64 "\n", cp->x,
+		       cp->before + segment_count_upto(seg, cp->x) +
+		       skipped_primes(cp->min, cp->x));
+		checkpoint_next(cp);
+	}
+	cp->before += seg->count;
+}
+
+/* Compares checkpoints, for sorting */
+static int compare_u64(const void * a, const void * b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Sets up the checkpoints for [min, max]: every step, starting at the
+   first multiple of step no less than min, or else the numbers listed in
+   a file (- for standard input), one per line.  Returns nonzero on
+   success. */
+static int checkpoint_init(struct checkpoint_data * cp,
+                           const struct args * args)
+{
+	size_t alloc = 64;
+	char line[256];
+	FILE * file;
+
+	cp->min     = args->min;
+	cp->max     = args->max;
+	cp->before  = 0;
+	cp->done    = 0;
+	cp->step    = args->checkpoint_step;
+	cp->at      = NULL;
+	cp->n_at    = 0;
+	cp->next_at = 0;
+	if(cp->step != 0)
+	{
+		/* Round min up to a multiple of step, watching for overflow */
+		uint64_t x = cp->min / cp->step * cp->step;
+		if(x < cp->min && UINT64_MAX - x < cp->step)
+		{
+			cp->done = 1;
+			return 1;
+		}
+		cp->x    = (x < cp->min ? x + cp->step : x);
+		cp->done = (cp->x > cp->max);
+		return 1;
+	}
+
+	/* Read the checkpoints from the file */
+	file = (strcmp(args->at_file, "-") == 0 ? stdin
+	                                        : fopen(args->at_file, "r"));
+	if(file == NULL)
+	{
+		YASE_PERROR(args->at_file);
+		return 0;
+	}
+	cp->at = malloc(alloc * sizeof(uint64_t));
+	if(cp->at == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	while(fgets(line, sizeof(line), file) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if(strspn(line, " \t") == strlen(line))
+		{
+			continue;
+		}
+		if(cp->n_at == alloc)
+		{
+			alloc *= 2;
+			cp->at = realloc(cp->at, alloc * sizeof(uint64_t));
+			if(cp->at == NULL)
+			{
+				YASE_PERROR("realloc");
+				abort();
+			}
+		}
+		if(!query_value(line, cp->max, &cp->at[cp->n_at]))
+		{
+			break;
+		}
+		if(cp->at[cp->n_at] < cp->min)
+		{
+			fprintf(stderr, "%s: %" PRIu64 " is below the minimum of "
+			        "%" PRIu64 "\n", yase_program_name, cp->at[cp->n_at],
+			        cp->min);
+			break;
+		}
+		cp->n_at++;
+	}
+	if(!feof(file))
+	{
+		if(file != stdin)
+		{
+			fclose(file);
+		}
+		free(cp->at);
+		return 0;
+	}
+	if(file != stdin)
+	{
+		fclose(file);
+	}
+
+	/* Report them in ascending order */
+	qsort(cp->at, cp->n_at, sizeof(uint64_t), compare_u64);
+	if(cp->n_at == 0)
+	{
+		cp->done = 1;
+	}
+	else
+	{
+		cp->x = cp->at[0];
+	}
+	return 1;
+}
+
+/* Sieves an interval with its prime set, or as a narrow window if win is
+   not NULL, taking telemetry snapshots if tel is not NULL */
+static void run_sieve(const struct interval * inter, struct prime_set * set,
+                      struct window * win, uint64_t * count,
+                      segment_callback callback, void * data,
+                      struct telemetry * tel)
+{
+	if(tel != NULL)
+	{
+		tel->inner      = callback;
+		tel->inner_data = data;
+		tel->count      = count;
+		callback = telemetry_segment;
+		data     = tel;
+	}
+	if(win != NULL)
+	{
+		sieve_window(inter, win, count, callback, data);
+	}
+	else
+	{
+		sieve_interval(inter, set, count, callback, data);
+	}
+}
+
+/* Counts the primes on [MIN, MAX] using a pi table */
+static int run_table(const struct args * args)
+{
+	struct pi_table table;
+	uint64_t count;
+	double start, elapsed, wall_start;
+
+	if(!pi_table_open(&table, args->file))
+	{
+		return EXIT_FAILURE;
+	}
+	wheel_init();
+	popcnt_init();
+	start = clock();
+	wall_start = wall_now();
+	presieve_init();
+	count = pi_table_count(&table, args->min, args->max, args->threads,
+	                       args->use_cache);
+	presieve_cleanup();
+	pi_table_close(&table);
+	elapsed = (clock() - start) / CLOCKS_PER_SEC;
+	if(args->json)
+	{
+		report_json(args, count, "table", elapsed,
+		            wall_now() - wall_start,
+		            (args->threads != 0 ? args->threads :
+		             default_threads()), 0);
+		return EXIT_SUCCESS;
+	}
+	printf("Found %" PRIu64 " primes in %.2f seconds.\n", count, elapsed);
+	return EXIT_SUCCESS;
+}
+
 /*
  * Main routine!
  *
@@ -64,17 +577,30 @@ static unsigned int pi_under_30[30] =
 int main(int argc, char * argv[])
 {
 	uint64_t seed_end_byte, min, max, count;
-	unsigned int seed_end_bit;
+	unsigned int seed_end_bit, threads = 1;
 	struct interval inter;
-	double start, elapsed;
+	double start, elapsed, wall_start;
 	struct prime_set set;
+	struct window win, * narrow = NULL;
+	struct args args;
+	struct dump_data dump;
+	struct progress prog;
+	struct checkpoint_data cp;
+	struct resume res;
+	struct telemetry tel, * live = NULL;
 	enum args_action action;
+	int status;
+	STATS_STAMP(stamp);
 
 	/* Save program name, for error messages and such */
 	yase_program_name = argv[0];
 
 	/* Process arguments */
-	action = process_args(argc, argv, &min, &max);
+	action = process_args(argc, argv, &args);
+	min = args.min;
+	max = args.max;
+	quiet = args.quiet || args.json;
+	human = (args.reporting ? stderr : stdout);
 
 	/* Act according to the arguments passed */
 	switch(action)
@@ -86,7 +612,8 @@ int main(int argc, char * argv[])
 		/* Display help.  We intentionally fall through to display the
 		 * version as well. */
 		case ACTION_HELP:
-			printf(help_format, argv[0]);
+			printf(help_format, argv[0], argv[0], argv[0], argv[0],
+			       argv[0], argv[0], argv[0], argv[0]);
 			putchar('\n');
 
 		/* Display version */
@@ -96,18 +623,78 @@ int main(int argc, char * argv[])
 			puts("Copyright (c) 2015 Matthew Ingwersen");
 			return EXIT_SUCCESS;
 
+		/* Look up numbers in a bitmap */
+		case ACTION_LOOKUP:
+			status = run_lookup(&args);
+			free(args.values);
+			return status;
+
+		/* Test numbers for primality */
+		case ACTION_TEST:
+			status = run_test(&args);
+			free(args.values);
+			return status;
+
+		/* Count primes on a batch of ranges */
+		case ACTION_BATCH:
+			return batch_run(args.file, args.threads, args.use_cache);
+
+		/* Serve queries on a socket */
+		case ACTION_SERVE:
+			return server_run(args.file, args.threads, args.use_cache);
+
+		/* Write a pi table */
+		case ACTION_MAKE_TABLE:
+			return pi_table_make(args.file, args.step, max, args.threads,
+			                     args.use_cache);
+
+		/* Count primes using a pi table */
+		case ACTION_TABLE:
+			return run_table(&args);
+
 		/* Perform sieving */
 		case ACTION_SIEVE:
+		case ACTION_DUMP:
 			/* Handled by everything that follows */
 			break;
 	}
 
+	/* From here on, SIGUSR1 asks for a snapshot of the run rather than
+	   killing it, even before the sieve itself starts */
+	telemetry_init();
+
+	/* Set up any checkpoints to report counts at */
+	if(args.reporting && !checkpoint_init(&cp, &args))
+	{
+		return EXIT_FAILURE;
+	}
+
+	/* Pick up where a saved run left off, if there is one */
+	if(args.resume_file != NULL &&
+	   !resume_start(&res, args.resume_file, min, max))
+	{
+		return EXIT_FAILURE;
+	}
+	if(args.resume_file != NULL && !quiet &&
+	   (res.done || res.from != min))
+	{
+		printf("Resuming after %" PRIu64 ", with %" PRIu64 " primes "
+		       "found so far\n", (res.done ? max : res.from - 1),
+		       res.count);
+	}
+
 	/* Initialization message */
-	printf("yase %u.%u.%u starting, checking numbers on "
-	       "[%" PRIu64 ", %" PRIu64"]\n",
-	       VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, min, max);
+	if(!quiet)
+	{
+		fprintf(human, "yase %u.%u.%u starting, checking numbers on "
+		        "[%" PRIu64 ", %" PRIu64"]\n",
+		        VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, min, max);
+	}
 
-	/* If the maximum is under 30, we handle calculations via table */
+	/* If the maximum is under 30, we handle calculations via table.  (A
+	   bitmap still has to be sieved, though, so when dumping we carry on
+	   and ignore the sieve's count, and likewise when reporting counts at
+	   checkpoints.) */
 	if(max < 30)
 	{
 		count = pi_under_30[max];
@@ -115,39 +702,152 @@ int main(int argc, char * argv[])
 		{
 			count -= pi_under_30[min - 1];
 		}
-		printf("Found %" PRIu64 " primes (via pi(x) table).\n", count);
-		return EXIT_SUCCESS;
+		if(action != ACTION_DUMP && !args.reporting)
+		{
+			if(args.json)
+			{
+				report_json(&args, count, "table", 0, 0, 1, 0);
+			}
+			else
+			{
+				printf("Found %" PRIu64 " primes (via pi(x) table).\n",
+				       count);
+			}
+			return EXIT_SUCCESS;
+		}
 	}
 
 	/* The sieving skips over all of the wheel primes and the pre-sieved
 	   primes, so account for them manually */
-	if(min < 30)
+	else
 	{
-		count = WHEEL_PRIMES_SKIPPED + PRESIEVE_PRIMES;
-		if(min != 0)
-		{
-			count -= pi_under_30[min - 1];
-		}
+		count = skipped_primes(min, max);
 	}
-	else
+
+	/* Time everything from here on if asked to.  JSON always has the
+	   phase timings, when they are compiled in. */
+	if(args.stats || (args.json && PHASE_STATS))
 	{
-		count = 0;
+		stats_start();
+		if(args.perf && !stats_perf_open())
+		{
+			fprintf(stderr, "%s: reporting times without hardware "
+			        "counters\n", yase_program_name);
+		}
 	}
+	STATS_BEGIN(stamp);
 
 	/* Initialize wheel table */
-	puts("Initializing wheel table . . .");
+	say("Initializing wheel table . . .");
 	wheel_init();
+	STATS_END(PHASE_WHEEL_INIT, stamp);
 
 	/* Initialize popcnt */
-	puts("Initializing population count . . .");
+	say("Initializing population count . . .");
 	popcnt_init();
 
-	/* Get start CPU time */
+	/* Get start CPU and wall clock times */
 	start = clock();
+	wall_start = wall_now();
 
 	/* Initialize pre-sieve */
-	puts("Initializing pre-sieve . . .");
+	say("Initializing pre-sieve . . .");
+	STATS_BEGIN(stamp);
 	presieve_init();
+	STATS_END(PHASE_PRESIEVE_INIT, stamp);
+
+	/* Long ranges are counted combinatorially, as pi(MAX) - pi(MIN - 1),
+	   unless sieving is asked for (or needed, for a dump) */
+	if(action == ACTION_SIEVE && !args.sieve && !args.stats &&
+	   !args.reporting &&
+	   args.resume_file == NULL && args.memo_file == NULL &&
+	   pi_count_preferred(min, max))
+	{
+		say("Counting combinatorially . . .");
+
+		/* The statistics are not synchronized, so stop gathering them
+		   before the threads start */
+		yase_stats.enabled = 0;
+		count = pi_count(max, args.threads, args.use_cache);
+		if(min != 0)
+		{
+			count -= pi_count(min - 1, args.threads, args.use_cache);
+		}
+		presieve_cleanup();
+		elapsed = (clock() - start) / CLOCKS_PER_SEC;
+		if(args.json)
+		{
+			report_json(&args, count, "combinatorial", elapsed,
+			            wall_now() - wall_start,
+			            (args.threads != 0 ? args.threads :
+			             default_threads()), PHASE_STATS);
+		}
+		else
+		{
+			printf("Found %" PRIu64 " primes in %.2f seconds.\n", count,
+			       elapsed);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	/* With a memo, only the segments it does not know are sieved */
+	if(args.memo_file != NULL)
+	{
+		struct memo memo;
+		struct seed seed;
+
+		if(!memo_open(&memo, args.memo_file))
+		{
+			presieve_cleanup();
+			return EXIT_FAILURE;
+		}
+		say("Counting with memo . . .");
+		calculate_seed_interval(max, &seed_end_byte, &seed_end_bit);
+		STATS_BEGIN(stamp);
+		seed_get(&seed, seed_end_byte, args.use_cache);
+		STATS_END(PHASE_SEED, stamp);
+		count += memo_count(&memo, min, max, seed.bits);
+		seed_put(&seed);
+		memo_close(&memo);
+		presieve_cleanup();
+		elapsed = (clock() - start) / CLOCKS_PER_SEC;
+		if(args.json)
+		{
+			report_json(&args, count, "memo", elapsed,
+			            wall_now() - wall_start, 1, PHASE_STATS);
+			return EXIT_SUCCESS;
+		}
+		printf("Reused %" PRIu64 " segments from the memo and sieved "
+		       "%" PRIu64 ".\n", memo.reused, memo.sieved);
+		printf("Found %" PRIu64 " primes in %.2f seconds.\n", count,
+		       elapsed);
+		if(args.stats)
+		{
+			stats_report(stdout, max - min + 1);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	/* A resumed run only sieves what the saved run did not */
+	if(args.resume_file != NULL)
+	{
+		if(res.done)
+		{
+			presieve_cleanup();
+			if(args.json)
+			{
+				report_json(&args, res.count, "resumed", 0, 0, 1, 0);
+			}
+			else
+			{
+				printf("Found %" PRIu64 " primes (already counted).\n",
+				       res.count);
+			}
+			return EXIT_SUCCESS;
+		}
+		min   = res.from;
+		count = res.count + skipped_primes(min, max);
+	}
 
 	/* Calculate start and end values */
 	calculate_interval(min, max, &inter);
@@ -155,25 +855,165 @@ int main(int argc, char * argv[])
 	/* Calculate seed start and end values */
 	calculate_seed_interval(max, &seed_end_byte, &seed_end_bit);
 
-	/* Initialize prime set */
-	puts("Initializing sieving prime set . . .");
-	prime_set_init(&set, &inter);
+	/* Initialize prime set, or a window if the interval is narrow */
+	if(window_preferred(&inter, seed_end_byte))
+	{
+		say("Initializing narrow window . . .");
+		window_init(&win, &inter);
+		narrow = &win;
+	}
+	else
+	{
+		say("Initializing sieving prime set . . .");
+		prime_set_init(&set, &inter);
+	}
 
-	/* Run the sieve for seeds */
-	puts("Finding sieving primes . . .");
-	sieve_seed(seed_end_byte, seed_end_bit, &set);
+	/* Run the sieve for seeds, or get them from the cache */
+	say("Finding sieving primes . . .");
+	STATS_BEGIN(stamp);
+	if(args.use_cache)
+	{
+		struct seed seed;
+		seed_get(&seed, seed_end_byte, 1);
+		if(narrow != NULL)
+		{
+			threads = seed_fill_window(seed.bits, seed_end_byte,
+			                           seed_end_bit, narrow,
+			                           (args.threads != 0 ?
+			                            args.threads :
+			                            default_threads()));
+		}
+		else
+		{
+			seed_fill(seed.bits, seed_end_byte, seed_end_bit, &set);
+		}
+		seed_put(&seed);
+	}
+	else if(narrow != NULL)
+	{
+		threads = sieve_seed_window(seed_end_byte, seed_end_bit, narrow,
+		                            (args.threads != 0 ? args.threads :
+		                             default_threads()));
+	}
+	else
+	{
+		sieve_seed(seed_end_byte, seed_end_bit, &set);
+	}
+	STATS_END(PHASE_SEED, stamp);
+
+	/* Take snapshots of the run on SIGUSR1, and on a timer if asked;
+	   a quiet run does neither unless asked */
+	if(!quiet || args.telemetry != 0 || args.telemetry_file != NULL)
+	{
+		if(!telemetry_start(&tel, &inter, args.telemetry,
+		                    args.telemetry_file))
+		{
+			return EXIT_FAILURE;
+		}
+		live = &tel;
+	}
+
+	/* Run the main sieve, writing out the bitmap if dumping */
+	if(action == ACTION_DUMP)
+	{
+		dump.file = bitmap_create(args.file, max);
+		if(dump.file == NULL)
+		{
+			return EXIT_FAILURE;
+		}
+		dump.prog = NULL;
+		if(!quiet)
+		{
+			dump.prog = &prog;
+			progress_start(&prog, &inter);
+		}
+		if(max < 30)
+		{
+			uint64_t ignored = 0;
+			run_sieve(&inter, &set, narrow, &ignored, dump_segment, &dump,
+			          live);
+		}
+		else
+		{
+			run_sieve(&inter, &set, narrow, &count, dump_segment, &dump,
+			          live);
+		}
+		if(!quiet)
+		{
+			progress_finish();
+		}
+		if(!bitmap_finish(dump.file, args.file))
+		{
+			return EXIT_FAILURE;
+		}
+	}
+	else if(args.resume_file != NULL)
+	{
+		if(!quiet)
+		{
+			progress_start(&prog, &inter);
+			res.prog = &prog;
+		}
+		run_sieve(&inter, &set, narrow, &count, resume_segment, &res,
+		          live);
+		if(!quiet)
+		{
+			progress_finish();
+		}
+		resume_finish(&res, count);
+	}
+	else if(args.reporting)
+	{
+		/* The counts go to standard output, so show no progress */
+		uint64_t ignored = 0;
+		run_sieve(&inter, &set, narrow, (max < 30 ? &ignored : &count),
+		          checkpoint_segment, &cp, live);
+		free(cp.at);
+	}
+	else if(quiet)
+	{
+		/* No callback at all, so nothing is done between segments */
+		run_sieve(&inter, &set, narrow, &count, NULL, NULL, live);
+	}
+	else
+	{
+		progress_start(&prog, &inter);
+		run_sieve(&inter, &set, narrow, &count, progress_update, &prog,
+		          live);
+		progress_finish();
+	}
 
-	/* Run the main sieve */
-	sieve_interval(&inter, &set, &count);
+	if(live != NULL)
+	{
+		telemetry_finish(live);
+	}
 
 	/* Perform cleanup (freeing dynamically-allocated memory) */
-	puts("Cleaning up . . .");
-	prime_set_cleanup(&set);
+	say("Cleaning up . . .");
+	if(narrow != NULL)
+	{
+		window_cleanup(narrow);
+	}
+	else
+	{
+		prime_set_cleanup(&set);
+	}
 	presieve_cleanup();
+	prime_set_depot_cleanup();
 	
 	/* Print number found and elapsed time */
 	elapsed = (clock() - start) / CLOCKS_PER_SEC;
-	printf("Found %" PRIu64 " primes in %.2f seconds.\n", count,
-	       elapsed);
+	if(args.json)
+	{
+		report_json(&args, count, "sieve", elapsed,
+		            wall_now() - wall_start, threads, PHASE_STATS);
+		return EXIT_SUCCESS;
+	}
+	fprintf(human, "Found %" PRIu64 " primes in %.2f seconds.\n", count,
+	        elapsed);
+	if(args.stats)
+	{
+		stats_report(human, max - args.min + 1);
+	}
 	return EXIT_SUCCESS;
 }
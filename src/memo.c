@@ -0,0 +1,293 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * memo.c: memoized counts of whole segments
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <yase.h>
+
+/*
+ * A memo file remembers how many primes each whole, aligned segment
+ * holds, i.e. the count for bytes [s * LARGE_SEGMENT_BYTES,
+ * (s + 1) * LARGE_SEGMENT_BYTES).  Counting [min, max] with a memo only
+ * sieves the ragged segments at either end and the segments that no
+ * earlier run has seen; the rest are summed from the file.  Every
+ * segment sieved whole is recorded for next time.
+ *
+ * The file is a header of MEMO_HEADER_BYTES bytes holding a magic
+ * string, a format version, the header length and the segment size,
+ * followed by one 32-bit entry per segment, indexed by s.  An entry is
+ * the count plus one, so that 0 (including the holes of a sparse file,
+ * and anything past its end) means "not seen yet".  The counts are of
+ * sieved bits only, so they do not depend on PRESIEVE_PRIMES: the
+ * skipped primes all lie in segment 0, which is never whole, since the
+ * sieve always starts after 1.
+ *
+ * Several runs may share a memo at once.  Each entry is written once,
+ * with a single aligned pwrite(), and any two runs agree on its value,
+ * so a reader sees either 0 or the right count.  Only creating the
+ * header needs a lock.
+ */
+static const char memo_magic[8] = "YASESGM";
+#define MEMO_VERSION (1U)
+#define MEMO_HEADER_BYTES (64U)
+
+/* Offsets of each header field */
+#define HDR_MAGIC    0
+#define HDR_VERSION  8
+#define HDR_LENGTH   12
+#define HDR_SEGMENT  16
+
+/* Number of entries read from the file at a time */
+#define MEMO_BLOCK 4096
+
+/* Offset of the entry for segment s */
+#define ENTRY_OFFSET(s) \
+	((off_t) MEMO_HEADER_BYTES + (off_t) (s) * (off_t) sizeof(uint32_t))
+
+/* Takes or releases a lock on the whole file, waiting for it */
+static int memo_lock(int fd, short type)
+{
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type   = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start  = 0;
+	fl.l_len    = 0;
+	return fcntl(fd, F_SETLKW, &fl) == 0;
+}
+
+/* Opens the memo file at path, creating it if it does not exist.
+   Returns nonzero on success.  On failure, an error message is
+   printed. */
+int memo_open(struct memo * memo, const char * path)
+{
+	uint8_t header[MEMO_HEADER_BYTES];
+	uint32_t version = MEMO_VERSION, length = MEMO_HEADER_BYTES;
+	uint64_t segment = LARGE_SEGMENT_BYTES;
+	struct stat st;
+	int ok;
+
+	memo->path   = path;
+	memo->reused = 0;
+	memo->sieved = 0;
+	memo->failed = 0;
+	memo->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(memo->fd < 0)
+	{
+		YASE_PERROR(path);
+		return 0;
+	}
+
+	/* Write the header if the file is new, or check it if not.  The lock
+	   keeps a run from reading a header that is still being written. */
+	if(!memo_lock(memo->fd, F_WRLCK) || fstat(memo->fd, &st) != 0)
+	{
+		YASE_PERROR(path);
+		close(memo->fd);
+		return 0;
+	}
+	if(st.st_size == 0)
+	{
+		memset(header, 0, sizeof(header));
+		memcpy(&header[HDR_MAGIC],   memo_magic, sizeof(memo_magic));
+		memcpy(&header[HDR_VERSION], &version, sizeof(version));
+		memcpy(&header[HDR_LENGTH],  &length, sizeof(length));
+		memcpy(&header[HDR_SEGMENT], &segment, sizeof(segment));
+		ok = (pwrite(memo->fd, header, sizeof(header), 0) ==
+		      (ssize_t) sizeof(header));
+		if(!ok)
+		{
+			YASE_PERROR(path);
+		}
+	}
+	else
+	{
+		ok = (pread(memo->fd, header, sizeof(header), 0) ==
+		      (ssize_t) sizeof(header));
+		memcpy(&version, &header[HDR_VERSION], sizeof(version));
+		memcpy(&length,  &header[HDR_LENGTH],  sizeof(length));
+		memcpy(&segment, &header[HDR_SEGMENT], sizeof(segment));
+		if(!ok
+		   || memcmp(&header[HDR_MAGIC], memo_magic,
+		             sizeof(memo_magic)) != 0
+		   || version != MEMO_VERSION
+		   || length != MEMO_HEADER_BYTES)
+		{
+			fprintf(stderr, "%s: %s: not a valid memo file\n",
+			        yase_program_name, path);
+			ok = 0;
+		}
+		else if(segment != LARGE_SEGMENT_BYTES)
+		{
+			fprintf(stderr, "%s: %s: memo is for %" PRIu64 "-byte "
+			        "segments, not %u-byte segments\n", yase_program_name,
+			        path, segment, (unsigned int) LARGE_SEGMENT_BYTES);
+			ok = 0;
+		}
+	}
+	memo_lock(memo->fd, F_UNLCK);
+	if(!ok)
+	{
+		close(memo->fd);
+	}
+	return ok;
+}
+
+/* Closes a memo file */
+void memo_close(struct memo * memo)
+{
+	close(memo->fd);
+}
+
+/* Segment callback: records the count of every whole, aligned segment.
+   data must point to the struct memo. */
+static void memo_segment(const struct segment * seg, void * data)
+{
+	struct memo * memo = data;
+	uint32_t entry;
+
+	memo->sieved++;
+	if(seg->start % LARGE_SEGMENT_BYTES != 0 ||
+	   seg->end - seg->start != LARGE_SEGMENT_BYTES ||
+	   seg->start_bit != 0 || seg->end_bit != 0)
+	{
+		return;
+	}
+	entry = (uint32_t) seg->count + 1;
+	if(pwrite(memo->fd, &entry, sizeof(entry),
+	          ENTRY_OFFSET(seg->start / LARGE_SEGMENT_BYTES)) !=
+	   (ssize_t) sizeof(entry) && !memo->failed)
+	{
+		/* The count is still right; only the memo misses out */
+		YASE_PERROR(memo->path);
+		memo->failed = 1;
+	}
+}
+
+/* Sieves [min, max], recording whole segments in the memo */
+static uint64_t memo_sieve(struct memo * memo, uint64_t min, uint64_t max,
+                           const uint8_t * seed_sieve)
+{
+	return sieve_range(min, max, seed_sieve, memo_segment, memo);
+}
+
+/*
+ * Counts the primes on [min, max] with the help of a memo, sieving
+ * everything that the memo does not already know, with the sieving
+ * primes from seed_sieve (which must cover max).  As with sieve_range(),
+ * the skipped primes are not included.  The wheel tables, population
+ * count and pre-sieve must be initialized.
+ */
+uint64_t memo_count(struct memo * memo, uint64_t min, uint64_t max,
+                    const uint8_t * seed_sieve)
+{
+	static uint32_t entries[MEMO_BLOCK];
+	struct interval inter;
+	uint64_t first, last, s, block = 0, run = 0, count = 0;
+	int have_block = 0, in_run = 0;
+
+	calculate_interval(min, max, &inter);
+	if(inter.start_byte >= inter.end_byte)
+	{
+		return 0;
+	}
+	first = inter.start_byte / LARGE_SEGMENT_BYTES;
+	last  = (inter.end_byte - 1) / LARGE_SEGMENT_BYTES;
+
+	/* A head that does not start on a segment boundary is sieved by
+	   itself, so that the segments of every later run are aligned */
+	s = first;
+	if(inter.start_byte % LARGE_SEGMENT_BYTES != 0)
+	{
+		count += memo_sieve(memo, min, (s == last ? max :
+		                    (s + 1) * LARGE_SEGMENT_BYTES * 30 - 1),
+		                    seed_sieve);
+		s++;
+	}
+
+	/* Sum the segments the memo knows, and sieve runs of the rest */
+	for(; s <= last; s++)
+	{
+		uint32_t entry = 0;
+
+		/* Only whole segments can be taken from the memo */
+		if((s > first || inter.start_bit == 0) &&
+		   (s < last || inter.end_bit == 0) &&
+		   (s < last || inter.end_byte % LARGE_SEGMENT_BYTES == 0))
+		{
+			if(!have_block || s - block >= MEMO_BLOCK)
+			{
+				ssize_t got;
+
+				block = s;
+				got = pread(memo->fd, entries, sizeof(entries),
+				            ENTRY_OFFSET(block));
+				if(got < 0)
+				{
+					got = 0;
+				}
+				memset((uint8_t *) entries + got, 0,
+				       sizeof(entries) - (size_t) got);
+				have_block = 1;
+			}
+			entry = entries[s - block];
+			if(entry > LARGE_SEGMENT_BYTES * 8U + 1U)
+			{
+				entry = 0;
+			}
+		}
+
+		if(entry != 0)
+		{
+			if(in_run)
+			{
+				count += memo_sieve(memo, run * LARGE_SEGMENT_BYTES * 30,
+				                    s * LARGE_SEGMENT_BYTES * 30 - 1,
+				                    seed_sieve);
+				in_run = 0;
+			}
+			count += entry - 1;
+			memo->reused++;
+		}
+		else if(!in_run)
+		{
+			run = s;
+			in_run = 1;
+		}
+	}
+	if(in_run)
+	{
+		count += memo_sieve(memo, (run == first ? min :
+		                    run * LARGE_SEGMENT_BYTES * 30), max,
+		                    seed_sieve);
+	}
+	return count;
+}
@@ -0,0 +1,317 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * numa.c: placement of worker threads and shared data on NUMA nodes
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* pthread_setaffinity_np() and cpu_set_t are GNU extensions */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <yase.h>
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
+/*
+ * On a host with several NUMA nodes, memory lives on the node whose CPU
+ * first touched it.  Left alone, a parallel run's workers wander between
+ * nodes, and half of them read the pre-sieve pattern and seed sieve (set
+ * up by the main thread) from another node's memory.
+ *
+ * So each worker pins itself to a CPU with numa_pin(), dealing workers
+ * out to the nodes in turn so that even a few threads spread over every
+ * socket.  Everything a worker allocates and fills afterwards, such as
+ * its sieve buffer and buckets, then lands on its own node.  Read-only
+ * data shared by the workers is kept in a struct numa_replica, and
+ * copied by the first worker on each node to need it; the copy is local
+ * because that worker touches it first.  The wheel tables are small
+ * enough to stay in each core's cache, so they are not copied.
+ *
+ * The nodes, and the CPUs on each, come from /sys.  Only CPUs the
+ * process may run on count.  With a single node (or without
+ * pthread_setaffinity_np()), nothing is pinned or copied.
+ */
+
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+
+/* CPUs of each node that has any the process may use */
+static cpu_set_t node_cpus[MAX_NUMA_NODES];
+static unsigned int node_n_cpus[MAX_NUMA_NODES];
+static unsigned int n_nodes = 0;
+
+/* Node of each pinned thread (plus one), and the CPU set it had
+   before */
+static pthread_key_t node_key, saved_key;
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+
+/* Parses a list of CPUs such as "0-3,8-11" into set.  Returns nonzero on
+   success. */
+static int parse_cpulist(const char * list, cpu_set_t * set)
+{
+	const char * p = list;
+
+	CPU_ZERO(set);
+	while(*p != '\0' && *p != '\n')
+	{
+		char * end;
+		unsigned long first, last, cpu;
+
+		first = strtoul(p, &end, 10);
+		if(end == p)
+		{
+			return 0;
+		}
+		last = first;
+		if(*end == '-')
+		{
+			p = end + 1;
+			last = strtoul(p, &end, 10);
+			if(end == p || last < first)
+			{
+				return 0;
+			}
+		}
+		for(cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+		{
+			CPU_SET(cpu, set);
+		}
+		p = (*end == ',' ? end + 1 : end);
+	}
+	return 1;
+}
+
+/* Finds the nodes, and the CPUs the process may use on each */
+static void numa_init(void)
+{
+	cpu_set_t allowed;
+	unsigned int node;
+
+	pthread_key_create(&node_key, NULL);
+	pthread_key_create(&saved_key, NULL);
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+	{
+		return;
+	}
+	for(node = 0; node < MAX_NUMA_NODES; node++)
+	{
+		char path[64], list[4096];
+		cpu_set_t cpus;
+		FILE * file;
+
+		snprintf(path, sizeof(path),
+		         "/sys/devices/system/node/node%u/cpulist", node);
+		file = fopen(path, "r");
+		if(file == NULL)
+		{
+			continue;
+		}
+		if(fgets(list, sizeof(list), file) != NULL &&
+		   parse_cpulist(list, &cpus))
+		{
+			CPU_AND(&node_cpus[n_nodes], &cpus, &allowed);
+			node_n_cpus[n_nodes] = (unsigned int)
+			                       CPU_COUNT(&node_cpus[n_nodes]);
+			if(node_n_cpus[n_nodes] > 0)
+			{
+				n_nodes++;
+			}
+		}
+		fclose(file);
+	}
+}
+
+/*
+ * Pins the calling thread, as the worker-th worker of a parallel run,
+ * to a CPU, returning the index of its node.  Worker 0 goes on the first
+ * node, worker 1 on the second, and so on, wrapping round.
+ * numa_unpin() lets the thread run anywhere it could before.
+ */
+unsigned int numa_pin(unsigned int worker)
+{
+	cpu_set_t * saved, cpu_only;
+	unsigned int node, nth, cpu;
+
+	pthread_once(&numa_once, numa_init);
+	if(n_nodes <= 1)
+	{
+		return 0;
+	}
+
+	/* Find the CPU: the nth the process may use on the node */
+	node = worker % n_nodes;
+	nth  = worker / n_nodes % node_n_cpus[node];
+	for(cpu = 0; ; cpu++)
+	{
+		if(CPU_ISSET(cpu, &node_cpus[node]) && nth-- == 0)
+		{
+			break;
+		}
+	}
+
+	/* Save the thread's CPUs the first time it is pinned */
+	if(pthread_getspecific(saved_key) == NULL)
+	{
+		saved = malloc(sizeof(cpu_set_t));
+		if(saved == NULL)
+		{
+			YASE_PERROR("malloc");
+			abort();
+		}
+		if(pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t),
+		                          saved) != 0)
+		{
+			free(saved);
+			return 0;
+		}
+		pthread_setspecific(saved_key, saved);
+	}
+
+	CPU_ZERO(&cpu_only);
+	CPU_SET(cpu, &cpu_only);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+	                          &cpu_only) != 0)
+	{
+		return 0;
+	}
+	pthread_setspecific(node_key, (void *) (uintptr_t) (node + 1));
+	return node;
+}
+
+/* Lets a thread pinned by numa_pin() run on the CPUs it had before */
+void numa_unpin(void)
+{
+	cpu_set_t * saved;
+
+	if(n_nodes <= 1)
+	{
+		return;
+	}
+	saved = pthread_getspecific(saved_key);
+	if(saved != NULL)
+	{
+		pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), saved);
+		free(saved);
+		pthread_setspecific(saved_key, NULL);
+	}
+	pthread_setspecific(node_key, NULL);
+}
+
+/* Finds the node the calling thread is pinned to, or -1 if it is not
+   pinned */
+int numa_node(void)
+{
+	pthread_once(&numa_once, numa_init);
+	if(n_nodes <= 1)
+	{
+		return -1;
+	}
+	return (int) (uintptr_t) pthread_getspecific(node_key) - 1;
+}
+
+#else /* !HAVE_PTHREAD_SETAFFINITY_NP */
+
+unsigned int numa_pin(unsigned int worker)
+{
+	(void) worker;
+	return 0;
+}
+
+void numa_unpin(void)
+{
+}
+
+int numa_node(void)
+{
+	return -1;
+}
+
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
+
+/* Protects the copies of every replica */
+static pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Sets up a replica of the len bytes at src, which must not change
+   until numa_replica_cleanup() */
+void numa_replica_init(struct numa_replica * rep, const void * src,
+                       size_t len)
+{
+	rep->src = src;
+	rep->len = len;
+	memset(rep->copies, 0, sizeof(rep->copies));
+}
+
+/*
+ * Finds the copy of a replica for the calling thread's node, making it
+ * if this is the first thread there to ask.  Threads that are not
+ * pinned get the original.
+ */
+const void * numa_replica_get(struct numa_replica * rep)
+{
+	int node = numa_node();
+	void * copy;
+
+	if(node < 0)
+	{
+		return rep->src;
+	}
+	pthread_mutex_lock(&replica_lock);
+	copy = rep->copies[node];
+	if(copy == NULL)
+	{
+		copy = malloc(rep->len);
+		if(copy == NULL)
+		{
+			YASE_PERROR("malloc");
+			abort();
+		}
+		memcpy(copy, rep->src, rep->len);
+		rep->copies[node] = copy;
+	}
+	pthread_mutex_unlock(&replica_lock);
+	return copy;
+}
+
+/* Finds the copy of a replica for the calling thread's node without
+   taking a lock, for hot paths.  The thread must have called
+   numa_replica_get() on the replica since it was pinned. */
+const void * numa_replica_local(const struct numa_replica * rep)
+{
+	int node = numa_node();
+	return (node < 0 ? rep->src : rep->copies[node]);
+}
+
+/* Frees the copies of a replica */
+void numa_replica_cleanup(struct numa_replica * rep)
+{
+	unsigned int node;
+	for(node = 0; node < MAX_NUMA_NODES; node++)
+	{
+		free(rep->copies[node]);
+		rep->copies[node] = NULL;
+	}
+}
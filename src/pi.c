@@ -0,0 +1,977 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * pi.c: combinatorial prime counting
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <yase.h>
+
+/*
+ * Counting the primes up to x by sieving does O(x) work, which is hours
+ * at 1e16.  pi_count() instead uses the Deléglise-Rivat variant of the
+ * Lagarias-Miller-Odlyzko method, which does about O(x^(2/3)) work:
+ *
+ *   pi(x) = phi(x, a) + a - 1 - P2(x, a),  a = pi(y),  y >= x^(1/3)
+ *
+ * where phi(x, a) counts the numbers up to x with no prime factor among
+ * the first a primes, and P2(x, a) counts those with exactly two prime
+ * factors (both greater than y).  phi(x, a) is expanded into leaves:
+ *
+ *  - Ordinary leaves (S1): mu(m) * phi(x / m, 3) for squarefree m <= y
+ *    with no factor of 2, 3 or 5.  phi(n, 3) comes straight from the
+ *    mod 30 wheel.
+ *  - Special leaves (S2): -mu(m) * phi(x / (p_b m), b - 1) for
+ *    squarefree m <= y < p_b m, where every factor of m exceeds p_b.
+ *    For p_b > sqrt(y), m must be a prime q; when x / (p_b q) is below
+ *    both p_b^2 and y, phi() there is just 1 or pi() of it less b - 2
+ *    (the "easy" and "trivial" leaves), read from a table of pi() up to
+ *    y, with leaves sharing a value of pi() counted in clusters.
+ *  - The remaining "hard" special leaves need phi() on [0, x / y].
+ *    That range is sieved in segments with the sieve's mod 30 layout,
+ *    crossing off one prime at a time, and each leaf counts the bits
+ *    still set up to its point.  Per-block counters (kept up to date as
+ *    bits are crossed off) and a cursor that only moves forward for
+ *    each prime keep the counting cheap.
+ *
+ * P2(x, a) needs pi(x / p) for the primes p in (y, sqrt(x)], i.e.
+ * counts on [sqrt(x), x / y], which is exactly what the ordinary
+ * segmented sieve provides through sieve_range() and
+ * segment_count_upto().  The primes p come from the seed sieve covering
+ * sqrt(x).
+ *
+ * Both the hard leaves and P2 are split into chunks of the range and
+ * handed to a pool of threads.  A chunk of the hard leaf sieve does not
+ * know phi() at its start, so it records, for every prime, the number
+ * of bits still set over the whole chunk and the sum of mu(m) over its
+ * leaves; these are combined in order afterwards.  Likewise, P2 chunks
+ * count from the start of the chunk and are corrected by the chunk
+ * totals before them.  All of the sums are taken modulo 2^64: the
+ * intermediate terms can exceed 64 bits, but the result cannot.
+ */
+
+/* Below this, pi_count() just sieves */
+#define PI_SIEVE_BELOW 100000000ULL
+
+/* Number of primes (2, 3 and 5) taken care of by the mod 30 layout */
+#define PI_C 3
+
+/* Size in bytes of the blocks of the hard leaf sieve that have their
+   own counters */
+#define COUNTER_BYTES 64
+#if (SMALL_SEGMENT_BYTES % COUNTER_BYTES) != 0
+#error "SMALL_SEGMENT_BYTES must be a multiple of 64"
+#endif
+#define COUNTERS (SMALL_SEGMENT_BYTES / COUNTER_BYTES)
+
+/* How many chunks to aim for per thread, for load balancing */
+#define PI_CHUNKS_PER_THREAD 8
+
+/* Roughly how many numbers can be sieved in the time pi_count() takes
+   for each unit of x^(2/3) */
+#define PI_SIEVE_RATIO 3.0
+
+/* Never make a P2 chunk shorter than this many sieve segments */
+#define P2_MIN_CHUNK_SEGMENTS 16
+
+/* Tables for the numbers up to y */
+struct pi_tables
+{
+	uint64_t x;         /* Number to count the primes up to       */
+	uint64_t y;         /* Leaf bound, x^(1/3) <= y <= sqrt(x)    */
+	uint64_t sqrt_y;    /* Largest integer with square <= y       */
+	uint32_t a;         /* pi(y)                                  */
+	uint32_t * primes;  /* primes[1..a] are the primes up to y    */
+	uint32_t * pi;      /* pi[n] for n <= y                       */
+	int32_t * mu_lpf;   /* mu(m) times the least prime factor of
+	                       m (INT32_MAX for m = 1)                */
+};
+
+/* A chunk of the hard leaf sieve */
+struct s2_chunk
+{
+	uint64_t start;     /* First byte of the chunk                */
+	uint64_t end;       /* First byte past the chunk              */
+	uint32_t b_end;     /* First prime index with no leaves here  */
+	uint64_t * phi;     /* Bits set over the chunk, for each b    */
+	int64_t * mu_sum;   /* Sum of mu(m) over leaves, for each b   */
+	uint64_t sum;       /* Sum of the leaves from the chunk start */
+};
+
+/* A range of primes p_b for the easy leaves */
+struct easy_chunk
+{
+	uint64_t b_min;     /* First prime index                      */
+	uint64_t b_end;     /* First prime index past the chunk       */
+	uint64_t sum;       /* Sum of the leaves                      */
+};
+
+/* A chunk of the P2 range */
+struct p2_chunk
+{
+	uint64_t min;       /* First number in the chunk              */
+	uint64_t max;       /* Last number in the chunk               */
+	uint64_t sum;       /* Sum of pi(x / p) from the chunk start  */
+	uint64_t n;         /* Number of primes p with x / p here     */
+	uint64_t total;     /* Primes found on the whole chunk        */
+};
+
+/* State shared by the worker threads */
+struct pi_workers
+{
+	const struct pi_tables * t;  /* Tables up to y                */
+	struct numa_replica seed;    /* Seed sieve covering sqrt(x)   */
+	struct s2_chunk * s2;        /* Hard leaf chunks              */
+	size_t n_s2;                 /* Number of hard leaf chunks    */
+	struct easy_chunk * easy;    /* Easy leaf chunks              */
+	size_t n_easy;               /* Number of easy leaf chunks    */
+	struct p2_chunk * p2;        /* P2 chunks                     */
+	size_t n_p2;                 /* Number of P2 chunks           */
+	size_t next;                 /* Next chunk to hand out        */
+	int pin;                     /* Nonzero to pin the threads    */
+	unsigned int next_worker;    /* Index of the next to start    */
+	pthread_mutex_t lock;        /* Protects next and next_worker */
+};
+
+/* Per-thread state for sieving hard leaves */
+struct s2_sieve
+{
+	uint8_t * sieve;              /* Segment bits                 */
+	uint32_t counters[COUNTERS];  /* Bits set in each block       */
+	uint64_t * next_byte;         /* Next multiple of each prime  */
+	uint32_t * wheel_idx;         /* Wheel index of each prime    */
+	uint64_t pos;                 /* Bytes counted by the cursor  */
+	uint64_t counted;             /* Bits set before pos          */
+};
+
+/* P2 segment callback data */
+struct p2_progress
+{
+	const uint8_t * seed_sieve;  /* Seed sieve covering sqrt(x)   */
+	uint64_t x;                  /* Number to count up to         */
+	uint64_t p;                  /* Next prime p, or 0 if none    */
+	uint64_t p_min;              /* Primes p must exceed this     */
+	uint64_t min;                /* First number in the chunk     */
+	uint64_t before;             /* Primes found before segment   */
+	uint64_t sum;                /* Sum of pi(x / p) so far       */
+	uint64_t n;                  /* Number of primes p so far     */
+};
+
+/* Integer square and cube roots, corrected for floating point error */
+static uint64_t isqrt(uint64_t n)
+{
+	uint64_t r = (uint64_t) sqrt((double) n);
+	while(r > 0 && r > n / r)
+	{
+		r--;
+	}
+	while(r < UINT32_MAX && (r + 1) <= n / (r + 1))
+	{
+		r++;
+	}
+	return r;
+}
+static uint64_t icbrt(uint64_t n)
+{
+	uint64_t r = (uint64_t) cbrt((double) n);
+	while(r > 0 && r > n / r / r)
+	{
+		r--;
+	}
+	while((r + 1) <= n / (r + 1) / (r + 1))
+	{
+		r++;
+	}
+	return r;
+}
+
+/* phi(n, 3): the numbers up to n with no factor of 2, 3 or 5 */
+static uint64_t phi30(uint64_t n)
+{
+	unsigned int r = (unsigned int) (n % 30);
+	return (n / 30) * 8 + (r != 0 ? wheel30_last_idx[r] + 1U : 0U);
+}
+
+/* Picks y.  Larger y moves work from the sieving of [0, x / y] to the
+   leaves; the balance found best here grows slowly with x. */
+static uint64_t choose_y(uint64_t x)
+{
+	double alpha, lx = log10((double) x);
+	uint64_t y, cbrt_x = icbrt(x), sqrt_x = isqrt(x);
+
+	alpha = (lx > 9 ? (lx - 9) * 1.5 + 1 : 1);
+	y = (uint64_t) (alpha * (double) cbrt_x);
+	if(y < cbrt_x)
+	{
+		y = cbrt_x;
+	}
+	if(y > sqrt_x)
+	{
+		y = sqrt_x;
+	}
+	return y;
+}
+
+/* Finds the primes, pi(), mu() and least prime factors up to y */
+static void tables_init(struct pi_tables * t, uint64_t x, uint64_t y)
+{
+	uint64_t i, j;
+	int8_t * mu;
+
+	t->x      = x;
+	t->y      = y;
+	t->sqrt_y = isqrt(y);
+	t->pi     = malloc((y + 1) * sizeof(uint32_t));
+	t->mu_lpf = calloc(y + 1, sizeof(int32_t));
+	mu        = malloc(y + 1);
+	if(t->pi == NULL || t->mu_lpf == NULL || mu == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	memset(mu, 1, y + 1);
+
+	/* Sieve for least prime factors (kept as positive numbers for now)
+	   and mu() */
+	t->a = 0;
+	for(i = 2; i <= y; i++)
+	{
+		if(t->mu_lpf[i] == 0)
+		{
+			t->a++;
+			for(j = i; j <= y; j += i)
+			{
+				if(t->mu_lpf[j] == 0)
+				{
+					t->mu_lpf[j] = (int32_t) i;
+				}
+				mu[j] = (int8_t) -mu[j];
+			}
+			if(i <= y / i)
+			{
+				for(j = i * i; j <= y; j += i * i)
+				{
+					mu[j] = 0;
+				}
+			}
+		}
+	}
+
+	/* Gather the primes and pi(), and fold mu() into the factors */
+	t->primes = malloc((t->a + 1) * sizeof(uint32_t));
+	if(t->primes == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	t->primes[0] = 0;
+	t->pi[0]     = 0;
+	t->pi[1]     = 0;
+	t->mu_lpf[1] = INT32_MAX;
+	for(i = 2, j = 0; i <= y; i++)
+	{
+		if((uint64_t) t->mu_lpf[i] == i)
+		{
+			t->primes[++j] = (uint32_t) i;
+		}
+		t->pi[i]     = (uint32_t) j;
+		t->mu_lpf[i] = mu[i] * t->mu_lpf[i];
+	}
+	free(mu);
+}
+
+/* Frees the tables */
+static void tables_cleanup(struct pi_tables * t)
+{
+	free(t->primes);
+	free(t->pi);
+	free(t->mu_lpf);
+}
+
+/* Sums the ordinary leaves */
+static uint64_t sum_ordinary(const struct pi_tables * t)
+{
+	uint64_t m, sum = 0;
+	for(m = 1; m <= t->y; m++)
+	{
+		int32_t v = t->mu_lpf[m];
+		if(v > 5)
+		{
+			sum += phi30(t->x / m);
+		}
+		else if(v < -5)
+		{
+			sum -= phi30(t->x / m);
+		}
+	}
+	return sum;
+}
+
+/* Sums the easy and trivial special leaves, those with b > pi(sqrt(y))
+   and x / (p_b q) below both p_b^2 and y, for b on [b_min, b_end) */
+static uint64_t sum_easy(const struct pi_tables * t, uint64_t b_min,
+                         uint64_t b_end)
+{
+	uint64_t b, sum = 0;
+	for(b = b_min; b < b_end; b++)
+	{
+		uint64_t p = t->primes[b], xp = t->x / p, lo, hi, j, end;
+
+		/* Trivial leaves: q > x / p^2, so phi() is 1 */
+		lo = (p > xp / p ? p : xp / p);
+		if(lo < t->y)
+		{
+			sum += t->a - t->pi[lo];
+		}
+
+		/* Easy leaves: phi() is pi(x / (p q)) - b + 2.  Runs of q with
+		   the same pi(x / (p q)) = k end at x / (p p_k). */
+		lo = xp / (p * p < t->y ? p * p : t->y);
+		lo = (lo > p ? lo : p);
+		hi = (xp / p < t->y ? xp / p : t->y);
+		if(lo >= hi)
+		{
+			continue;
+		}
+		end = t->pi[hi];
+		for(j = t->pi[lo] + 1; j <= end; )
+		{
+			uint64_t k = t->pi[xp / t->primes[j]], last;
+			uint64_t q_max = xp / t->primes[k];
+			last = (q_max >= t->y ? end : t->pi[q_max]);
+			last = (last < end ? last : end);
+			sum += (last - j + 1) * (k - b + 2);
+			j = last + 1;
+		}
+	}
+	return sum;
+}
+
+/* Counts the bits still set in the current segment of the hard leaf
+   sieve up to n, which must not be below the last n counted since the
+   cursor was reset.  The cursor moves a counter block at a time, so at
+   most one block is counted bit by bit. */
+static uint64_t s2_count_upto(struct s2_sieve * s, uint64_t start,
+                              uint64_t n)
+{
+	uint64_t end_byte = ((n + 1) + 28) / 30 - start;
+	unsigned int end_bit;
+
+	end_bit = (n % 30 != 0 ? (wheel30_last_idx[n % 30] + 1) % 8 : 0);
+	while(s->pos + COUNTER_BYTES < end_byte)
+	{
+		s->counted += s->counters[s->pos / COUNTER_BYTES];
+		s->pos += COUNTER_BYTES;
+	}
+	if(end_byte == s->pos)
+	{
+		return s->counted;
+	}
+	return s->counted + popcnt(&s->sieve[s->pos], 0,
+	                           (unsigned long) (end_byte - s->pos),
+	                           end_bit);
+}
+
+/* Finds the largest m that can make a special leaf with p_b on a
+   segment starting at the number low */
+static uint64_t s2_max_m(const struct pi_tables * t, uint64_t xp,
+                         uint64_t low)
+{
+	if(low != 0 && xp / low < t->y)
+	{
+		return xp / low;
+	}
+	return t->y;
+}
+
+/* Sieves a chunk of [0, x / y] for the hard special leaves */
+static void s2_chunk_run(const struct pi_tables * t, struct s2_sieve * s,
+                         struct s2_chunk * chunk)
+{
+	uint64_t b, start, end, x = t->x;
+
+	/* Find which primes have leaves at all in the chunk.  No later
+	   segment (or chunk) has leaves for more of them. */
+	for(b = PI_C + 1; b <= t->a; b++)
+	{
+		uint64_t p = t->primes[b];
+		if(p >= s2_max_m(t, x / p, chunk->start * 30))
+		{
+			break;
+		}
+	}
+	chunk->b_end  = (uint32_t) b;
+	chunk->sum    = 0;
+	chunk->phi    = calloc(b, sizeof(uint64_t));
+	chunk->mu_sum = calloc(b, sizeof(int64_t));
+	if(chunk->phi == NULL || chunk->mu_sum == NULL)
+	{
+		YASE_PERROR("calloc");
+		abort();
+	}
+
+	/* Find each prime's first multiple (the prime itself, at the
+	   start) to cross off in the chunk, as adjust_up() does */
+	for(b = PI_C + 1; b < chunk->b_end; b++)
+	{
+		uint64_t p = t->primes[b], q;
+		unsigned int q_mod, idx;
+
+		q = (chunk->start * 30 + p - 1) / p;
+		q_mod = (unsigned int) (q % 30);
+		idx   = wheel30_find_idx[q_mod];
+		q     = q - q_mod + wheel30_offs[idx];
+		s->next_byte[b] = (p * q) / 30;
+		s->wheel_idx[b] = wheel30_last_idx[p % 30] * 8U + idx;
+	}
+
+	for(start = chunk->start; start < chunk->end; start = end)
+	{
+		uint64_t low = start * 30, high, total, len;
+		unsigned int i;
+
+		end = start + SMALL_SEGMENT_BYTES;
+		if(end > chunk->end)
+		{
+			end = chunk->end;
+		}
+		high = end * 30;
+		len  = end - start;
+
+		/* Start with everything but multiples of 2, 3 and 5 */
+		memset(s->sieve, 0xFF, len);
+		for(i = 0; i < COUNTERS; i++)
+		{
+			uint64_t block = (uint64_t) i * COUNTER_BYTES;
+			s->counters[i] = (uint32_t) (block >= len ? 0 :
+			                 (len - block >= COUNTER_BYTES ?
+			                  COUNTER_BYTES : len - block) * 8);
+		}
+		total = len * 8;
+
+		for(b = PI_C + 1; b < chunk->b_end; b++)
+		{
+			uint64_t p = t->primes[b], xp = x / p, max_m, min_m, byte;
+			uint32_t wheel_idx, prime_adj = (uint32_t) (p / 30);
+
+			max_m = s2_max_m(t, xp, low);
+			if(p >= max_m)
+			{
+				break;
+			}
+			min_m = xp / high;
+			min_m = (min_m > t->y / p ? min_m : t->y / p);
+			min_m = (min_m > p ? min_m : p);
+
+			/* Count the leaves, in increasing order of x / (p m) */
+			s->pos     = 0;
+			s->counted = 0;
+			if(p <= t->sqrt_y)
+			{
+				uint64_t m;
+				for(m = max_m; m > min_m; m--)
+				{
+					int32_t v = t->mu_lpf[m];
+					if(v > (int64_t) p)
+					{
+						chunk->sum -= chunk->phi[b] +
+						              s2_count_upto(s, start, xp / m);
+						chunk->mu_sum[b]++;
+					}
+					else if(v < -(int64_t) p)
+					{
+						chunk->sum += chunk->phi[b] +
+						              s2_count_upto(s, start, xp / m);
+						chunk->mu_sum[b]--;
+					}
+				}
+			}
+			else
+			{
+				/* Only primes q, and only those whose leaves are not
+				   easy */
+				uint64_t q_max = xp / (p * p < t->y ? p * p : t->y), j;
+				q_max = (q_max < max_m ? q_max : max_m);
+				if(q_max > min_m)
+				{
+					for(j = t->pi[q_max]; j > t->pi[min_m]; j--)
+					{
+						chunk->sum += chunk->phi[b] +
+						              s2_count_upto(s, start,
+						                            xp / t->primes[j]);
+						chunk->mu_sum[b]--;
+					}
+				}
+			}
+			chunk->phi[b] += total;
+
+			/* Cross off the multiples of p, keeping the counts */
+			byte      = s->next_byte[b];
+			wheel_idx = s->wheel_idx[b];
+			while(byte < end)
+			{
+				uint8_t * bits = &s->sieve[byte - start];
+				uint8_t mask   = wheel30[wheel_idx].mask;
+				if((*bits & (uint8_t) ~mask) != 0)
+				{
+					*bits &= mask;
+					s->counters[(byte - start) / COUNTER_BYTES]--;
+					total--;
+				}
+				byte += wheel30[wheel_idx].delta_f * prime_adj;
+				byte += wheel30[wheel_idx].delta_c;
+				wheel_idx += wheel30[wheel_idx].next;
+			}
+			s->next_byte[b] = byte;
+			s->wheel_idx[b] = wheel_idx;
+		}
+	}
+}
+
+/* Finds the largest prime below n in the seed sieve, or 0 if there is
+   none above the pre-sieved primes */
+static uint64_t seed_prev_prime(const uint8_t * seed_sieve, uint64_t n)
+{
+	uint64_t byte;
+	int bit;
+
+	if(n < 2)
+	{
+		return 0;
+	}
+	n--;
+	byte = n / 30;
+	bit  = (n % 30 != 0 ? wheel30_last_idx[n % 30] : -1);
+	for(;;)
+	{
+		for(; bit >= 0; bit--)
+		{
+			if(byte * 8 + (uint64_t) bit < PRESIEVE_PRIMES + 2)
+			{
+				return 0;
+			}
+			if((seed_sieve[byte] & (1U << bit)) != 0)
+			{
+				return byte * 30 + wheel30_offs[bit];
+			}
+		}
+		if(byte == 0)
+		{
+			return 0;
+		}
+		byte--;
+		bit = 7;
+	}
+}
+
+/* Counts the primes up to n (at least 30) in the seed sieve */
+static uint64_t seed_pi(const uint8_t * seed_sieve, uint64_t n)
+{
+	uint64_t count, end_byte = ((n + 1) + 28) / 30, i;
+	unsigned int end_bit;
+
+	end_bit = (n % 30 != 0 ? (wheel30_last_idx[n % 30] + 1) % 8 : 0);
+	count = popcnt(seed_sieve, 0, (unsigned long) end_byte, end_bit);
+
+	/* The bits before the first prime not pre-sieved are not primes
+	   (or are the skipped primes, counted separately) */
+	for(i = 0; i < PRESIEVE_PRIMES + 2; i++)
+	{
+		if((seed_sieve[i / 8] & (1U << (i % 8))) != 0)
+		{
+			count--;
+		}
+	}
+	return count + skipped_primes_upto(n);
+}
+
+/* Segment callback for P2: counts up to x / p for each prime p whose
+   x / p falls on the segment */
+static void p2_segment(const struct segment * seg, void * data)
+{
+	struct p2_progress * prog = data;
+	while(prog->p > prog->p_min &&
+	      segment_reaches(seg, prog->x / prog->p))
+	{
+		uint64_t z = prog->x / prog->p;
+		prog->sum += prog->before + segment_count_upto(seg, z) +
+		             skipped_primes(prog->min, z);
+		prog->n++;
+		prog->p = seed_prev_prime(prog->seed_sieve, prog->p);
+	}
+	prog->before += seg->count;
+}
+
+/* Sieves a P2 chunk, summing pi(x / p) from the chunk start for the
+   primes p with x / p on it */
+static void p2_chunk_run(const struct pi_tables * t,
+                         const uint8_t * seed_sieve,
+                         struct p2_chunk * chunk)
+{
+	struct p2_progress prog;
+	uint64_t p_max = t->x / chunk->min, sqrt_x = isqrt(t->x), count;
+
+	prog.seed_sieve = seed_sieve;
+	prog.x          = t->x;
+	prog.p          = seed_prev_prime(seed_sieve,
+	                                  (p_max < sqrt_x ? p_max : sqrt_x) + 1);
+	prog.p_min      = t->x / (chunk->max + 1);
+	prog.p_min      = (prog.p_min > t->y ? prog.p_min : t->y);
+	prog.min        = chunk->min;
+	prog.before     = 0;
+	prog.sum        = 0;
+	prog.n          = 0;
+	count = sieve_range(chunk->min, chunk->max, seed_sieve,
+	                    p2_segment, &prog);
+	chunk->sum   = prog.sum;
+	chunk->n     = prog.n;
+	chunk->total = count + skipped_primes(chunk->min, chunk->max);
+}
+
+/* Worker thread: runs hard leaf chunks, then easy leaf chunks, then P2
+   chunks, until there are none left */
+static void * pi_worker_main(void * data)
+{
+	struct pi_workers * workers = data;
+	const struct pi_tables * t = workers->t;
+	const uint8_t * seed_sieve = workers->seed.src;
+	struct s2_sieve s;
+
+	/* Move to this worker's CPU before allocating, so that the sieve
+	   lands on its NUMA node */
+	if(workers->pin)
+	{
+		unsigned int worker;
+
+		pthread_mutex_lock(&workers->lock);
+		worker = workers->next_worker++;
+		pthread_mutex_unlock(&workers->lock);
+		numa_pin(worker);
+		presieve_localize();
+		seed_sieve = numa_replica_get(&workers->seed);
+	}
+
+	s.sieve     = malloc(SMALL_SEGMENT_BYTES);
+	s.next_byte = malloc((t->a + 1) * sizeof(uint64_t));
+	s.wheel_idx = malloc((t->a + 1) * sizeof(uint32_t));
+	if(s.sieve == NULL || s.next_byte == NULL || s.wheel_idx == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+
+	for(;;)
+	{
+		size_t idx;
+
+		pthread_mutex_lock(&workers->lock);
+		idx = workers->next++;
+		pthread_mutex_unlock(&workers->lock);
+		if(idx < workers->n_s2)
+		{
+			s2_chunk_run(t, &s, &workers->s2[idx]);
+			continue;
+		}
+		idx -= workers->n_s2;
+		if(idx < workers->n_easy)
+		{
+			struct easy_chunk * easy = &workers->easy[idx];
+			easy->sum = sum_easy(t, easy->b_min, easy->b_end);
+			continue;
+		}
+		idx -= workers->n_easy;
+		if(idx < workers->n_p2)
+		{
+			p2_chunk_run(t, seed_sieve, &workers->p2[idx]);
+			continue;
+		}
+		break;
+	}
+
+	free(s.sieve);
+	free(s.next_byte);
+	free(s.wheel_idx);
+	if(workers->pin)
+	{
+		numa_unpin();
+	}
+	return NULL;
+}
+
+/* Splits [first, last] into at most n_max chunks of at least min_len,
+   returning the number of chunks and writing the start of each */
+static size_t split_range(uint64_t first, uint64_t last, uint64_t min_len,
+                          size_t n_max, uint64_t * starts)
+{
+	uint64_t len = (last - first) / n_max + 1;
+	size_t n = 0;
+
+	if(len < min_len)
+	{
+		len = min_len;
+	}
+	while(n < n_max && (n == 0 || starts[n - 1] + len <= last))
+	{
+		starts[n] = (n == 0 ? first : starts[n - 1] + len);
+		n++;
+	}
+	return n;
+}
+
+/* Counts the primes up to x by sieving */
+static uint64_t pi_sieve(uint64_t x, int use_cache)
+{
+	uint64_t seed_end_byte, count;
+	unsigned int seed_end_bit;
+	struct seed seed;
+
+	if(x < 30)
+	{
+		return pi_under_30[x];
+	}
+	calculate_seed_interval(x, &seed_end_byte, &seed_end_bit);
+	seed_get(&seed, seed_end_byte, use_cache);
+	count = sieve_range(0, x, seed.bits, NULL, NULL);
+	seed_put(&seed);
+	return count + skipped_primes_upto(x);
+}
+
+/* Checks whether counting the primes on [min, max] is expected to be
+   faster with pi_count() than by sieving */
+int pi_count_preferred(uint64_t min, uint64_t max)
+{
+	double cost = PI_SIEVE_RATIO * pow((double) max, 2.0 / 3.0);
+	if(max < PI_SIEVE_BELOW)
+	{
+		return 0;
+	}
+	if(min > 1)
+	{
+		cost += PI_SIEVE_RATIO * pow((double) (min - 1), 2.0 / 3.0);
+	}
+	return (double) (max - min) > cost;
+}
+
+/*
+ * Counts the primes up to x combinatorially, using the given number of
+ * threads (0 for one per online CPU) and optionally the seed cache.
+ * Small x is just sieved.  The wheel tables, pre-sieve and population
+ * count must be initialized.
+ */
+uint64_t pi_count(uint64_t x, unsigned int threads, int use_cache)
+{
+	uint64_t seed_end_byte, sqrt_x, s2_end, p2_min, p2_max, phi, p2;
+	uint64_t * starts, * phi_before, b_sqrt_x, b_easy;
+	unsigned int seed_end_bit, t;
+	struct pi_tables tables;
+	struct pi_workers workers;
+	struct seed seed;
+	size_t i, n_max;
+	pthread_t * tids;
+
+	if(x < PI_SIEVE_BELOW)
+	{
+		return pi_sieve(x, use_cache);
+	}
+	if(threads == 0)
+	{
+		threads = default_threads();
+	}
+
+	/* Tables up to y, and the seed sieve up to sqrt(x) for P2 */
+	sqrt_x = isqrt(x);
+	tables_init(&tables, x, choose_y(x));
+	calculate_seed_interval(x, &seed_end_byte, &seed_end_bit);
+	if(seed_end_byte < (sqrt_x + 29) / 30)
+	{
+		seed_end_byte = (sqrt_x + 29) / 30;
+	}
+	seed_get(&seed, seed_end_byte, use_cache);
+
+	/* Split the hard leaf sieve's bytes, and the range [sqrt(x), x / y]
+	   that P2 needs counts on, into chunks */
+	n_max  = (size_t) threads * PI_CHUNKS_PER_THREAD;
+	starts = malloc(n_max * sizeof(uint64_t));
+	if(starts == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	s2_end = x / (tables.y + 1) / 30 + 1;
+	workers.n_s2 = split_range(0, s2_end - 1, SMALL_SEGMENT_BYTES, n_max,
+	                           starts);
+	workers.s2 = malloc(workers.n_s2 * sizeof(struct s2_chunk));
+	if(workers.s2 == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(i = 0; i < workers.n_s2; i++)
+	{
+		/* Chunks are whole segments long, but for the last */
+		uint64_t chunk_start = starts[i] / SMALL_SEGMENT_BYTES *
+		                       SMALL_SEGMENT_BYTES;
+		workers.s2[i].start = chunk_start;
+		if(i > 0)
+		{
+			workers.s2[i - 1].end = chunk_start;
+		}
+	}
+	workers.s2[workers.n_s2 - 1].end = s2_end;
+
+	workers.n_easy = 0;
+	workers.easy   = NULL;
+	b_easy = tables.pi[tables.sqrt_y] + 1;
+	if(b_easy <= tables.a)
+	{
+		workers.n_easy = split_range(b_easy, tables.a, 1, n_max, starts);
+		workers.easy = malloc(workers.n_easy * sizeof(struct easy_chunk));
+		if(workers.easy == NULL)
+		{
+			YASE_PERROR("malloc");
+			abort();
+		}
+		for(i = 0; i < workers.n_easy; i++)
+		{
+			workers.easy[i].b_min = starts[i];
+			workers.easy[i].b_end = (i + 1 < workers.n_easy ?
+			                         starts[i + 1] : tables.a + 1);
+		}
+	}
+
+	p2_min = sqrt_x;
+	p2_max = x / (tables.y + 1);
+	workers.n_p2 = 0;
+	workers.p2   = NULL;
+	if(p2_max >= p2_min)
+	{
+		workers.n_p2 = split_range(p2_min, p2_max,
+		                           P2_MIN_CHUNK_SEGMENTS *
+		                           (uint64_t) LARGE_SEGMENT_BYTES * 30,
+		                           n_max, starts);
+		workers.p2 = malloc(workers.n_p2 * sizeof(struct p2_chunk));
+		if(workers.p2 == NULL)
+		{
+			YASE_PERROR("malloc");
+			abort();
+		}
+		for(i = 0; i < workers.n_p2; i++)
+		{
+			workers.p2[i].min = starts[i];
+			workers.p2[i].max = (i + 1 < workers.n_p2 ?
+			                     starts[i + 1] - 1 : p2_max);
+		}
+	}
+	free(starts);
+
+	/* Run the chunks, with the calling thread doing its share */
+	workers.t          = &tables;
+	numa_replica_init(&workers.seed, seed.bits, (size_t) seed_end_byte);
+	workers.next       = 0;
+	pthread_mutex_init(&workers.lock, NULL);
+	if(threads > workers.n_s2 + workers.n_easy + workers.n_p2)
+	{
+		threads = (unsigned int) (workers.n_s2 + workers.n_easy +
+		                          workers.n_p2);
+	}
+	workers.pin         = (threads > 1);
+	workers.next_worker = 0;
+	tids = malloc((threads > 1 ? threads - 1 : 1) * sizeof(pthread_t));
+	if(tids == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(t = 0; t + 1 < threads; t++)
+	{
+		if(pthread_create(&tids[t], NULL, pi_worker_main, &workers) != 0)
+		{
+			/* Make do with the threads we have */
+			break;
+		}
+	}
+	pi_worker_main(&workers);
+	while(t > 0)
+	{
+		pthread_join(tids[--t], NULL);
+	}
+	free(tids);
+	pthread_mutex_destroy(&workers.lock);
+	numa_replica_cleanup(&workers.seed);
+
+	/* phi(x, a): the ordinary and easy leaves, then the hard leaves,
+	   with each chunk's phi() values from the start of the chunk
+	   corrected by the chunks before it */
+	phi = sum_ordinary(&tables);
+	for(i = 0; i < workers.n_easy; i++)
+	{
+		phi += workers.easy[i].sum;
+	}
+	free(workers.easy);
+	phi_before = calloc(tables.a + 1, sizeof(uint64_t));
+	if(phi_before == NULL)
+	{
+		YASE_PERROR("calloc");
+		abort();
+	}
+	for(i = 0; i < workers.n_s2; i++)
+	{
+		struct s2_chunk * chunk = &workers.s2[i];
+		uint32_t b;
+		phi += chunk->sum;
+		for(b = PI_C + 1; b < chunk->b_end; b++)
+		{
+			phi -= (uint64_t) chunk->mu_sum[b] * phi_before[b];
+			phi_before[b] += chunk->phi[b];
+		}
+		free(chunk->phi);
+		free(chunk->mu_sum);
+	}
+	free(phi_before);
+	free(workers.s2);
+
+	/* P2(x, a), the sum of pi(x / p_b) - b + 1 over the primes p_b in
+	   (y, sqrt(x)] */
+	b_sqrt_x = seed_pi(seed.bits, sqrt_x);
+	p2 = 0;
+	if(workers.n_p2 > 0)
+	{
+		uint64_t before = seed_pi(seed.bits, p2_min - 1);
+		for(i = 0; i < workers.n_p2; i++)
+		{
+			p2 += workers.p2[i].sum + workers.p2[i].n * before;
+			before += workers.p2[i].total;
+		}
+	}
+	p2 -= (b_sqrt_x * (b_sqrt_x - 1)) / 2 -
+	      ((uint64_t) tables.a * (tables.a - 1)) / 2;
+	free(workers.p2);
+
+	seed_put(&seed);
+	tables_cleanup(&tables);
+	return phi + tables.a - 1 - p2;
+}
@@ -33,6 +33,9 @@
 static uint8_t *     presieve;
 static unsigned long presieve_len;
 
+/* Copies of the buffer on each NUMA node that sieves */
+static struct numa_replica presieve_copies;
+
 /* List of first few primes and their wheel spokes */
 static unsigned long presieve_primes[6] =
 	{ 11, 13, 17, 19, 23, 29 };
@@ -90,20 +93,31 @@ void presieve_init(void)
 			mark_multiple_210(presieve, prime_adj, &byte, &wheel_idx);
 		}
 	}
+	numa_replica_init(&presieve_copies, presieve, len);
 }
 
 /* Pre-sieve cleanup */
 void presieve_cleanup(void)
 {
+	numa_replica_cleanup(&presieve_copies);
 	free(presieve);
 }
 
+/* Makes sure there is a copy of the pre-sieve buffer on the calling
+   thread's NUMA node, for presieve_copy() to use.  Threads pinned with
+   numa_pin() must call this before sieving. */
+void presieve_localize(void)
+{
+	numa_replica_get(&presieve_copies);
+}
+
 /* Copies pre-sieve data into a sieve buffer */
 void presieve_copy(
 		uint8_t * sieve,
 		uint64_t start,
 		uint64_t end)
 {
+	const uint8_t * pattern = numa_replica_local(&presieve_copies);
 	unsigned long ps_idx, sv_idx, sv_len;
 
 	/* Find the start point in the pre-sieve buffer */
@@ -124,7 +138,7 @@ void presieve_copy(
 		}
 
 		/* Perform the copy and update working indices */
-		memcpy(&sieve[sv_idx], &presieve[ps_idx], len);
+		memcpy(&sieve[sv_idx], &pattern[ps_idx], len);
 		ps_idx = 0;
 		sv_idx += len;
 	}
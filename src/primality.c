@@ -0,0 +1,519 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * primality.c: primality testing of single 64-bit numbers
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <yase.h>
+
+/*
+ * Some queries are about a handful of scattered numbers, possibly far
+ * beyond anything it would be sensible to sieve.  These are tested one
+ * at a time instead.  Each number is first trial divided by the primes
+ * below TRIAL_LIMIT, which are taken from the seed sieve, and numbers
+ * that survive get a deterministic set of Miller-Rabin (strong probable
+ * prime) tests.  Below 4,759,123,141 the bases 2, 7 and 61 suffice;
+ * above that, Jim Sinclair's set of seven bases is known to be correct
+ * for every n < 2^64.
+ *
+ * The modular arithmetic is done in Montgomery form, so the tests
+ * themselves need no divisions at all.  The batch version runs
+ * MR_LANES tests in lock-step, so that the independent multiplications
+ * of each lane overlap in the CPU pipeline instead of each waiting out
+ * the latency of the one before.
+ */
+
+/* Trial divide by primes below this (rounded down to a multiple of
+   30) */
+#define TRIAL_LIMIT 1024
+#define TRIAL_END   ((uint64_t) (TRIAL_LIMIT / 30 * 30))
+
+/* Number of Miller-Rabin tests run in lock-step by the batch version */
+#define MR_LANES 4
+
+/* A trial division prime.  n is divisible by prime exactly when
+   n * inverse (mod 2^64) is no more than limit. */
+struct trial_prime
+{
+	uint64_t prime;   /* The prime itself           */
+	uint64_t inverse; /* Inverse of prime mod 2^64  */
+	uint64_t limit;   /* (2^64 - 1) / prime         */
+};
+
+/* Trial division table */
+static struct trial_prime * trial_primes;
+static unsigned long trial_count;
+
+/* The odd primes under 30, which the seed sieve does not report */
+static const uint8_t odd_primes_under_30[9] =
+	{ 3, 5, 7, 11, 13, 17, 19, 23, 29 };
+
+/* Miller-Rabin bases */
+#define SMALL_BASES_LIMIT UINT64_C(4759123141)
+static const uint64_t small_bases[3] = { 2, 7, 61 };
+static const uint64_t large_bases[7] =
+	{ 2, 325, 9375, 28178, 450775, 9780504, 1795265022 };
+
+/* Montgomery arithmetic parameters for one (odd) modulus */
+struct mont
+{
+	uint64_t n;         /* Modulus                          */
+	uint64_t inverse;   /* Inverse of n mod 2^64            */
+	uint64_t one;       /* 1 in Montgomery form (2^64 mod n) */
+	uint64_t minus_one; /* n - 1 in Montgomery form         */
+	uint64_t r2;        /* 2^128 mod n                      */
+	uint64_t d;         /* Odd part of n - 1                */
+	unsigned int s;     /* n - 1 = d * 2^s                  */
+};
+
+/* Finds the inverse of an odd number mod 2^64 with Newton's method.
+   Every odd x is its own inverse mod 8, and each step doubles the number
+   of correct bits. */
+static uint64_t inverse_mod_2_64(uint64_t x)
+{
+	uint64_t inv = x;
+	int i;
+	for(i = 0; i < 5; i++)
+	{
+		inv *= 2 - x * inv;
+	}
+	return inv;
+}
+
+/* Full 64 x 64 -> 128-bit multiplication.  Returns the high half and
+   stores the low half to lo. */
+static inline uint64_t mul_wide(uint64_t a, uint64_t b, uint64_t * lo)
+{
+#if defined(__SIZEOF_INT128__)
+	unsigned __int128 t = (unsigned __int128) a * b;
+	*lo = (uint64_t) t;
+	return (uint64_t) (t >> 64);
+#else
+	uint64_t a_lo = a & 0xFFFFFFFFU, a_hi = a >> 32;
+	uint64_t b_lo = b & 0xFFFFFFFFU, b_hi = b >> 32;
+	uint64_t ll = a_lo * b_lo, lh = a_lo * b_hi;
+	uint64_t hl = a_hi * b_lo, hh = a_hi * b_hi;
+	uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFFU) + (hl & 0xFFFFFFFFU);
+	*lo = (mid << 32) | (ll & 0xFFFFFFFFU);
+	return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/* Montgomery multiplication: a * b / 2^64 mod n, for a, b < n.  The
+   subtraction form of the reduction cannot overflow, even when n is
+   close to 2^64. */
+static inline uint64_t mont_mul(uint64_t a, uint64_t b,
+                                const struct mont * m)
+{
+	uint64_t t_lo, t_hi, q_lo, q_hi, q;
+	t_hi = mul_wide(a, b, &t_lo);
+	q    = t_lo * m->inverse;
+	q_hi = mul_wide(q, m->n, &q_lo);
+	return (t_hi < q_hi ? t_hi - q_hi + m->n : t_hi - q_hi);
+}
+
+/* Sets up Montgomery parameters for the odd modulus n > 1 */
+static void mont_init(struct mont * m, uint64_t n)
+{
+	uint64_t r2;
+	int i;
+
+	m->n         = n;
+	m->inverse   = inverse_mod_2_64(n);
+	m->one       = (0 - n) % n;
+	m->minus_one = n - m->one;
+
+	/* 2^128 mod n, by doubling 2^64 mod n another 64 times */
+	r2 = m->one;
+	for(i = 0; i < 64; i++)
+	{
+		r2 = (r2 >= n - r2 ? r2 - (n - r2) : r2 + r2);
+	}
+	m->r2 = r2;
+
+	/* Split n - 1 into d * 2^s */
+	m->d = n - 1;
+	m->s = 0;
+	while((m->d & 1) == 0)
+	{
+		m->d >>= 1;
+		m->s++;
+	}
+}
+
+/*
+ * Runs a strong probable prime test on each of lanes moduli, all in
+ * lock-step, writing nonzero to pass[k] if m[k].n is a strong probable
+ * prime to base[k].  This is inlined with lanes constant, so that the
+ * lane loops unroll.
+ */
+static inline void sprp_lanes(
+		const struct mont * m,
+		const uint64_t * base,
+		unsigned int lanes,
+		uint8_t * pass)
+{
+	uint64_t a[MR_LANES], x[MR_LANES], top_d = 0;
+	uint8_t done[MR_LANES];
+	unsigned int k, r, max_s = 0;
+	int bit;
+
+	/* Convert the bases to Montgomery form.  A base that is a multiple
+	   of n says nothing, so the lane passes outright. */
+	for(k = 0; k < lanes; k++)
+	{
+		uint64_t b = base[k] % m[k].n;
+		a[k]    = mont_mul(b, m[k].r2, &m[k]);
+		x[k]    = m[k].one;
+		done[k] = (b == 0);
+		pass[k] = done[k];
+		top_d  |= m[k].d;
+		max_s   = (m[k].s > max_s ? m[k].s : max_s);
+	}
+
+	/* x = a^d by left-to-right binary exponentiation.  Lanes whose d is
+	   shorter than the longest just square 1 until their bits start. */
+	for(bit = 63; bit >= 0 && (top_d >> bit) == 0; bit--);
+	for(; bit >= 0; bit--)
+	{
+		for(k = 0; k < lanes; k++)
+		{
+			x[k] = mont_mul(x[k], x[k], &m[k]);
+		}
+		for(k = 0; k < lanes; k++)
+		{
+			if((m[k].d >> bit) & 1)
+			{
+				x[k] = mont_mul(x[k], a[k], &m[k]);
+			}
+		}
+	}
+
+	/* n passes if a^d = 1 or a^(d * 2^r) = -1 for some r < s */
+	for(k = 0; k < lanes; k++)
+	{
+		if(!done[k] && (x[k] == m[k].one || x[k] == m[k].minus_one))
+		{
+			done[k] = 1;
+			pass[k] = 1;
+		}
+	}
+	for(r = 1; r < max_s; r++)
+	{
+		for(k = 0; k < lanes; k++)
+		{
+			if(!done[k] && r < m[k].s)
+			{
+				x[k] = mont_mul(x[k], x[k], &m[k]);
+				if(x[k] == m[k].minus_one)
+				{
+					done[k] = 1;
+					pass[k] = 1;
+				}
+				else if(x[k] == m[k].one)
+				{
+					done[k] = 1;
+				}
+			}
+		}
+	}
+}
+
+/* Picks the Miller-Rabin bases needed for n */
+static inline const uint64_t * choose_bases(uint64_t n,
+                                            unsigned int * n_bases)
+{
+	if(n < SMALL_BASES_LIMIT)
+	{
+		*n_bases = 3;
+		return small_bases;
+	}
+	*n_bases = 7;
+	return large_bases;
+}
+
+/* Finishes the Miller-Rabin tests for lanes numbers that already passed
+   base 2 and all use the same bases, writing 1 (prime) or 0 (composite)
+   to each entry of result */
+static inline void mr_finish_lanes(
+		const struct mont * m,
+		const uint64_t * bases,
+		unsigned int n_bases,
+		unsigned int lanes,
+		uint8_t * result)
+{
+	uint64_t base[MR_LANES];
+	uint8_t pass[MR_LANES];
+	unsigned int j, k;
+	int any = 1;
+
+	for(k = 0; k < lanes; k++)
+	{
+		result[k] = 1;
+	}
+
+	/* Almost everything that passes base 2 is prime, so lanes rarely
+	   drop out here */
+	for(j = 1; j < n_bases && any; j++)
+	{
+		for(k = 0; k < lanes; k++)
+		{
+			base[k] = bases[j];
+		}
+		sprp_lanes(m, base, lanes, pass);
+		any = 0;
+		for(k = 0; k < lanes; k++)
+		{
+			result[k] &= pass[k];
+			any |= result[k];
+		}
+	}
+}
+
+/* Trial divides n.  Returns 0 if n is composite, 1 if n is prime, or 2
+   if n needs to be tested further. */
+static inline int trial_divide(uint64_t n)
+{
+	unsigned long i;
+
+	if(n < 2)
+	{
+		return 0;
+	}
+	if((n & 1) == 0)
+	{
+		return n == 2;
+	}
+	for(i = 0; i < trial_count; i++)
+	{
+		if(n * trial_primes[i].inverse <= trial_primes[i].limit)
+		{
+			return n == trial_primes[i].prime;
+		}
+	}
+
+	/* With no factor below TRIAL_END, n is prime if it is under
+	   TRIAL_END squared */
+	return (n < TRIAL_END * TRIAL_END ? 1 : 2);
+}
+
+/* Adds a prime to the trial division table */
+static void trial_add(uint64_t prime)
+{
+	trial_primes[trial_count].prime   = prime;
+	trial_primes[trial_count].inverse = inverse_mod_2_64(prime);
+	trial_primes[trial_count].limit   = UINT64_MAX / prime;
+	trial_count++;
+}
+
+/* Builds the trial division table using the seed sieve.  The wheel
+   tables and pre-sieve must already be initialized. */
+void primality_init(void)
+{
+	uint64_t end_byte = TRIAL_END / 30, i;
+	uint8_t * seed_sieve;
+
+	/* There can't be more primes than bits in the sieve, plus the ones
+	   under 30 */
+	trial_primes = malloc((end_byte * 8 + sizeof(odd_primes_under_30))
+	                      * sizeof(struct trial_prime));
+	if(trial_primes == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	trial_count = 0;
+
+	/* The seed sieve doesn't give reliable bits for the first byte, so
+	   take the primes under 30 from our own table */
+	for(i = 0; i < sizeof(odd_primes_under_30); i++)
+	{
+		trial_add(odd_primes_under_30[i]);
+	}
+	seed_sieve = seed_find(end_byte);
+	for(i = 8; i < end_byte * 8; i++)
+	{
+		if((seed_sieve[i / 8] & ((uint8_t) 1U << (i % 8))) != 0)
+		{
+			trial_add((i / 8) * 30 + wheel30_offs[i % 8]);
+		}
+	}
+	free(seed_sieve);
+}
+
+/* Frees the trial division table */
+void primality_cleanup(void)
+{
+	free(trial_primes);
+}
+
+/* Tests whether n is prime.  primality_init() must have been called. */
+int yase_is_prime_u64(uint64_t n)
+{
+	const uint64_t two = 2;
+	const uint64_t * bases;
+	unsigned int n_bases;
+	struct mont m;
+	uint8_t result;
+	int res;
+
+	res = trial_divide(n);
+	if(res != 2)
+	{
+		return res;
+	}
+	mont_init(&m, n);
+	sprp_lanes(&m, &two, 1, &result);
+	if(result)
+	{
+		bases = choose_bases(n, &n_bases);
+		mr_finish_lanes(&m, bases, n_bases, 1, &result);
+	}
+	return result;
+}
+
+/* A queue of numbers waiting for a batch of lock-step tests */
+struct mr_queue
+{
+	struct mont m[MR_LANES];  /* Montgomery parameters of each number */
+	size_t idx[MR_LANES];     /* Index of each number in the batch    */
+	unsigned int count;       /* Numbers queued                       */
+};
+
+/* Runs the remaining bases on a full (or final) queue of numbers that
+   passed base 2 */
+static inline void mr_queue_finish(
+		struct mr_queue * queue,
+		unsigned int lanes,
+		uint8_t * result)
+{
+	const uint64_t * bases;
+	uint8_t queue_result[MR_LANES];
+	unsigned int n_bases, k;
+
+	bases = choose_bases(queue->m[0].n, &n_bases);
+	mr_finish_lanes(queue->m, bases, n_bases, lanes, queue_result);
+	for(k = 0; k < lanes; k++)
+	{
+		result[queue->idx[k]] = queue_result[k];
+	}
+	queue->count = 0;
+}
+
+/* Runs base 2 on a queue of numbers that survived trial division.  The
+   numbers that pass move on to the queue for their set of remaining
+   bases. */
+static inline void mr_queue_base_2(
+		struct mr_queue * queue,
+		unsigned int lanes,
+		struct mr_queue * next,
+		uint8_t * result)
+{
+	uint64_t two[MR_LANES];
+	uint8_t pass[MR_LANES];
+	unsigned int k;
+
+	for(k = 0; k < lanes; k++)
+	{
+		two[k] = 2;
+	}
+	sprp_lanes(queue->m, two, lanes, pass);
+	for(k = 0; k < lanes; k++)
+	{
+		struct mr_queue * dest;
+		if(!pass[k])
+		{
+			result[queue->idx[k]] = 0;
+			continue;
+		}
+		dest = &next[queue->m[k].n < SMALL_BASES_LIMIT ? 0 : 1];
+		dest->m[dest->count]   = queue->m[k];
+		dest->idx[dest->count] = queue->idx[k];
+		if(++dest->count == MR_LANES)
+		{
+			mr_queue_finish(dest, MR_LANES, result);
+		}
+	}
+	queue->count = 0;
+}
+
+/*
+ * Tests many numbers for primality.  Numbers that survive trial division
+ * are queued up and given base 2 MR_LANES at a time.  Since most
+ * composites fail base 2, the ones that pass (nearly always primes) are
+ * queued up again, separately, for the remaining bases, so that lanes
+ * running in lock-step seldom wait on work they don't need.
+ */
+void yase_is_prime_u64_batch(
+		const uint64_t * n,
+		size_t count,
+		uint8_t * result)
+{
+	struct mr_queue first, next[2];
+	size_t i;
+	unsigned int k;
+
+	first.count   = 0;
+	next[0].count = 0;
+	next[1].count = 0;
+	for(i = 0; i < count; i++)
+	{
+		int res = trial_divide(n[i]);
+		if(res != 2)
+		{
+			result[i] = (uint8_t) res;
+			continue;
+		}
+
+		/* Queue it up, and run the lanes when they are full */
+		mont_init(&first.m[first.count], n[i]);
+		first.idx[first.count] = i;
+		if(++first.count == MR_LANES)
+		{
+			mr_queue_base_2(&first, MR_LANES, next, result);
+		}
+	}
+
+	/* Test whatever is left over one at a time */
+	for(k = 0; k < first.count; k++)
+	{
+		struct mr_queue single;
+		single.m[0]   = first.m[k];
+		single.idx[0] = first.idx[k];
+		single.count  = 1;
+		mr_queue_base_2(&single, 1, next, result);
+	}
+	for(i = 0; i < 2; i++)
+	{
+		for(k = 0; k < next[i].count; k++)
+		{
+			struct mr_queue single;
+			single.m[0]   = next[i].m[k];
+			single.idx[0] = next[i].idx[k];
+			single.count  = 1;
+			mr_queue_finish(&single, 1, result);
+		}
+	}
+}
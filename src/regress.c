@@ -0,0 +1,443 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * regress.c: correctness checks and baseline comparison for yase-bench
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <yase.h>
+
+/*
+ * The correctness check counts pi(10^k) by sieving and compares the
+ * counts with the known values, then counts random windows both with the
+ * sieve and with a plain, unsegmented, byte-per-number sieve of
+ * Eratosthenes that shares no code with it.  The windows are spread
+ * log-uniformly in position (up to CHECK_MAX) and width (up to
+ * CHECK_WIDTH), so both narrow windows and bucketed sieving are tried.
+ */
+#define CHECK_MAX   UINT64_C(1000000000000000)
+#define CHECK_WIDTH UINT64_C(30000000)
+#define CHECK_WINDOWS 40
+
+/* Known values of pi(10^k) */
+static const uint64_t pi_powers[] =
+{
+	0, 4, 25, 168, 1229, 9592, 78498, 664579, 5761455, 50847534,
+	UINT64_C(455052511)
+};
+#define N_POWERS (sizeof(pi_powers) / sizeof(pi_powers[0]))
+
+/* Counts the primes on [min, max] with the sieve, as yase does */
+static uint64_t sieve_count(uint64_t min, uint64_t max)
+{
+	static const unsigned int pi_under_30[30] =
+	{
+		0, 0, 1, 2, 2, 3, 3, 4, 4, 4, 4, 5, 5, 6, 6,
+		6, 6, 7, 7, 8, 8, 8, 8, 9, 9, 9, 9, 9, 9, 10
+	};
+	uint64_t seed_end_byte, count;
+	unsigned int seed_end_bit;
+	uint8_t * seed_sieve;
+
+	if(max < 30)
+	{
+		return pi_under_30[max] - (min != 0 ? pi_under_30[min - 1] : 0);
+	}
+	calculate_seed_interval(max, &seed_end_byte, &seed_end_bit);
+	seed_sieve = seed_find(seed_end_byte);
+	count = skipped_primes(min, max) +
+	        sieve_range(min, max, seed_sieve, NULL, NULL);
+	free(seed_sieve);
+	return count;
+}
+
+/* Allocates zeroed memory, or aborts */
+static void * check_calloc(size_t n)
+{
+	void * p = calloc(n, 1);
+	if(p == NULL)
+	{
+		YASE_PERROR("calloc");
+		abort();
+	}
+	return p;
+}
+
+/* Counts the primes on [min, max] with the reference sieve.  small
+   flags the composites up to small_max, which must be at least the
+   square root of max. */
+static uint64_t reference_count(uint64_t min, uint64_t max,
+                                const uint8_t * small, uint64_t small_max)
+{
+	uint64_t width = max - min + 1, p, m, count = 0;
+	uint8_t * composite = check_calloc(width);
+
+	for(p = 2; p <= small_max && p * p <= max; p++)
+	{
+		if(small[p])
+		{
+			continue;
+		}
+		m = (min + p - 1) / p * p;
+		if(m < p * p)
+		{
+			m = p * p;
+		}
+		for(; m <= max; m += p)
+		{
+			composite[m - min] = 1;
+		}
+	}
+	for(m = 0; m < width; m++)
+	{
+		if(!composite[m] && min + m >= 2)
+		{
+			count++;
+		}
+	}
+	free(composite);
+	return count;
+}
+
+/* A small, seedable generator, so that failures can be reproduced */
+static uint64_t next_random(uint64_t * state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+/* Picks a number log-uniformly on [1, limit] */
+static uint64_t log_uniform(uint64_t * state, uint64_t limit)
+{
+	double u = (double) (next_random(state) >> 11) / 9007199254740992.0;
+	return (uint64_t) exp(u * log((double) limit));
+}
+
+/*
+ * Checks the sieve against known values of pi(10^k) and the reference
+ * sieve on random windows, picked using seed.  Prints each failure and
+ * returns nonzero if there were none.  The wheel, population count and
+ * pre-sieve must be initialized.
+ */
+int bench_check(uint64_t seed)
+{
+	uint64_t state = (seed != 0 ? seed : 1), small_max, p, m;
+	uint8_t * small;
+	unsigned int k, w, failures = 0;
+
+	printf("Checking pi(10^k) for k < %u . . .\n", (unsigned int) N_POWERS);
+	for(k = 1; k < N_POWERS; k++)
+	{
+		uint64_t x = 1, count;
+		unsigned int i;
+
+		for(i = 0; i < k; i++)
+		{
+			x *= 10;
+		}
+		count = sieve_count(0, x);
+		if(count != pi_powers[k])
+		{
+			printf("FAIL: pi(10^%u) = %" PRIu64 ", expected %" PRIu64
+			       "\n", k, count, pi_powers[k]);
+			failures++;
+		}
+	}
+
+	/* Flag the composites up to the square root of the largest window
+	   for the reference sieve */
+	small_max = (uint64_t) sqrt((double) (CHECK_MAX + CHECK_WIDTH)) + 1;
+	small = check_calloc(small_max + 1);
+	for(p = 2; p * p <= small_max; p++)
+	{
+		if(!small[p])
+		{
+			for(m = p * p; m <= small_max; m += p)
+			{
+				small[m] = 1;
+			}
+		}
+	}
+
+	printf("Checking %u random windows (seed %" PRIu64 ") . . .\n",
+	       CHECK_WINDOWS, seed);
+	for(w = 0; w < CHECK_WINDOWS; w++)
+	{
+		uint64_t min = log_uniform(&state, CHECK_MAX) - 1;
+		uint64_t max = min + log_uniform(&state, CHECK_WIDTH) - 1;
+		uint64_t count = sieve_count(min, max);
+		uint64_t expected = reference_count(min, max, small, small_max);
+
+		if(count != expected)
+		{
+			printf("FAIL: [%" PRIu64 ", %" PRIu64 "] has %" PRIu64
+			       " primes, expected %" PRIu64 "\n", min, max, count,
+			       expected);
+			failures++;
+		}
+	}
+	free(small);
+
+	if(failures == 0)
+	{
+		printf("All checks passed.\n");
+	}
+	return failures == 0;
+}
+
+/*
+ * Results are compared workload by workload with a one-sided
+ * Mann-Whitney U test on the measured run times: a workload has
+ * regressed if its median throughput fell by more than the threshold
+ * and the test finds its times larger than the baseline's at the
+ * COMPARE_ALPHA level.  The test makes no assumption about how run
+ * times are distributed, and with the default five runs each it can
+ * reach p = 1/252.
+ */
+#define COMPARE_ALPHA 0.05
+
+/* Largest sample sizes for which U's distribution is found exactly */
+#define EXACT_MAX 64
+
+/* Run times of one workload read from a results file */
+struct timing
+{
+	char name[64];
+	double times[1000];  /* As many as --repeats allows */
+	unsigned int n;
+};
+
+/* Reads the workloads and run times from a results file written by
+   yase-bench --json.  Returns the number read, or -1 on error. */
+static int read_timings(const char * path, struct timing * timings,
+                        int max)
+{
+	char line[16384];
+	FILE * file;
+	int n = 0;
+
+	file = fopen(path, "r");
+	if(file == NULL)
+	{
+		YASE_PERROR(path);
+		return -1;
+	}
+	while(n < max && fgets(line, sizeof(line), file) != NULL)
+	{
+		struct timing * t = &timings[n];
+		char * name = strstr(line, "\"name\": \"");
+		char * times = strstr(line, "\"times_s\": [");
+		char * end;
+
+		if(name == NULL || times == NULL)
+		{
+			continue;
+		}
+		name += strlen("\"name\": \"");
+		end = strchr(name, '"');
+		if(end == NULL || end - name >= (ptrdiff_t) sizeof(t->name))
+		{
+			continue;
+		}
+		memcpy(t->name, name, end - name);
+		t->name[end - name] = '\0';
+
+		times += strlen("\"times_s\": [");
+		t->n = 0;
+		while(t->n < sizeof(t->times) / sizeof(t->times[0]))
+		{
+			double value = strtod(times, &end);
+			if(end == times)
+			{
+				break;
+			}
+			t->times[t->n++] = value;
+			times = end;
+			while(*times == ',' || *times == ' ')
+			{
+				times++;
+			}
+		}
+		if(t->n > 0)
+		{
+			n++;
+		}
+	}
+	fclose(file);
+	return n;
+}
+
+/* Median of a sample */
+static int compare_times(const void * a, const void * b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+static double median(double * x, unsigned int n)
+{
+	qsort(x, n, sizeof(double), compare_times);
+	return (n % 2 != 0 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2]) / 2);
+}
+
+/* One-sided p-value that the times in y tend to be larger than those in
+   x, from the Mann-Whitney U statistic.  Ties count one half. */
+static double mann_whitney(const double * x, unsigned int m,
+                           const double * y, unsigned int n)
+{
+	double u = 0, mean, sd;
+	unsigned int i, j;
+
+	/* U counts the pairs in which y is the larger */
+	for(i = 0; i < m; i++)
+	{
+		for(j = 0; j < n; j++)
+		{
+			u += (y[j] > x[i] ? 1 : (y[j] == x[i] ? 0.5 : 0));
+		}
+	}
+
+	/* For small samples, find U's distribution exactly by counting the
+	   orderings of the two samples that give each U.  With a x's and b
+	   y's, the largest value is either an x, or a y that beats all a
+	   x's, so N(a, b, v) = N(a - 1, b, v) + N(a, b - 1, v - a).  Ties
+	   are counted against finding a regression. */
+	if(m <= EXACT_MAX && n <= EXACT_MAX)
+	{
+		unsigned int umax = m * n, a, b, v;
+		double total = 0, tail = 0, p;
+		double ** row = malloc((n + 1) * sizeof(double *));
+
+		if(row == NULL)
+		{
+			YASE_PERROR("malloc");
+			abort();
+		}
+
+		/* row[b] holds N(a, b, .), starting from a = 0 */
+		for(b = 0; b <= n; b++)
+		{
+			row[b] = check_calloc((umax + 1) * sizeof(double));
+			row[b][0] = 1;
+		}
+		for(a = 1; a <= m; a++)
+		{
+			for(b = 1; b <= n; b++)
+			{
+				for(v = a; v <= umax; v++)
+				{
+					row[b][v] += row[b - 1][v - a];
+				}
+			}
+		}
+		for(v = 0; v <= umax; v++)
+		{
+			total += row[n][v];
+			if(v + 0.5 >= u)
+			{
+				tail += row[n][v];
+			}
+		}
+		p = tail / total;
+		for(b = 0; b <= n; b++)
+		{
+			free(row[b]);
+		}
+		free(row);
+		return p;
+	}
+
+	/* Otherwise, use the normal approximation */
+	mean = m * n / 2.0;
+	sd   = sqrt(m * n * (m + n + 1) / 12.0);
+	return 0.5 * erfc((u - 0.5 - mean) / (sd * sqrt(2.0)));
+}
+
+/*
+ * Compares the results in current against those in baseline, both
+ * written by yase-bench --json, printing each workload's change in
+ * median throughput.  Returns nonzero if no workload regressed by more
+ * than threshold (a fraction, e.g. 0.05).
+ */
+int bench_compare(const char * current, const char * baseline,
+                  double threshold)
+{
+	static struct timing now[64], then[64];
+	int n_now, n_then, i, j, regressions = 0;
+
+	n_now  = read_timings(current, now, 64);
+	n_then = read_timings(baseline, then, 64);
+	if(n_now < 0 || n_then < 0)
+	{
+		return 0;
+	}
+
+	printf("\nComparing with %s (threshold %.1f%%, alpha %.2f):\n",
+	       baseline, threshold * 100, COMPARE_ALPHA);
+	printf("%-16s %12s %12s %9s %8s\n", "Workload", "Baseline (s)",
+	       "Now (s)", "Change", "p");
+	for(i = 0; i < n_now; i++)
+	{
+		double before, after, change, p;
+
+		for(j = 0; j < n_then; j++)
+		{
+			if(strcmp(now[i].name, then[j].name) == 0)
+			{
+				break;
+			}
+		}
+		if(j == n_then)
+		{
+			printf("%-16s (not in baseline)\n", now[i].name);
+			continue;
+		}
+
+		p = mann_whitney(then[j].times, then[j].n, now[i].times,
+		                 now[i].n);
+		before = median(then[j].times, then[j].n);
+		after  = median(now[i].times, now[i].n);
+
+		/* Change in throughput, which is inverse to time */
+		change = before / after - 1;
+		printf("%-16s %12.4f %12.4f %+8.1f%% %8.4f", now[i].name,
+		       before, after, change * 100, p);
+		if(-change > threshold && p < COMPARE_ALPHA)
+		{
+			printf("  REGRESSED");
+			regressions++;
+		}
+		printf("\n");
+	}
+	if(regressions != 0)
+	{
+		printf("%d workload%s regressed.\n", regressions,
+		       (regressions == 1 ? "" : "s"));
+	}
+	return regressions == 0;
+}
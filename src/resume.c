@@ -0,0 +1,250 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * resume.c: saving and resuming long runs
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <yase.h>
+
+/*
+ * A long run can be made resumable by giving it a state file.  Every
+ * RESUME_SAVE_SECONDS, and when it finishes or is interrupted, the run
+ * records the last number it has counted up to and the number of primes
+ * on [min, last].  Nothing else is needed to carry on: the prime set
+ * for the rest of the interval is rebuilt from the seed sieve by
+ * prime_set_init(), whose adjust_up() finds each prime's next multiple
+ * directly.  That is cheap compared to the hours of sieving it saves, so
+ * the prime set itself is never written out.  A finished run leaves its
+ * state behind too, so rerunning with a larger MAX only sieves the new
+ * part.
+ *
+ * The file is a header of RESUME_HEADER_BYTES bytes holding a magic
+ * string, a format version, the header length, min, last, and the count,
+ * in native byte order.  It is replaced atomically on every save.
+ */
+static const char resume_magic[8] = "YASERSM";
+#define RESUME_VERSION (1U)
+#define RESUME_HEADER_BYTES (64U)
+
+/* Offsets of each header field */
+#define HDR_MAGIC   0
+#define HDR_VERSION 8
+#define HDR_LENGTH  12
+#define HDR_MIN     16
+#define HDR_LAST    24
+#define HDR_COUNT   32
+
+/* How often to save the state of a run */
+#define RESUME_SAVE_SECONDS 60
+
+/* Set when the run is asked to stop */
+static volatile sig_atomic_t stop_requested = 0;
+
+/* Signal handler for SIGINT and SIGTERM: the state is saved and the
+   program exits once the current segment is done */
+static void handle_stop(int sig)
+{
+	(void) sig;
+	stop_requested = 1;
+}
+
+/* Atomically writes the state of a run, after counting count primes on
+   [res->min, last].  Returns nonzero on success. */
+static int resume_save(struct resume * res, uint64_t last, uint64_t count)
+{
+	uint8_t header[RESUME_HEADER_BYTES];
+	uint32_t version = RESUME_VERSION, length = RESUME_HEADER_BYTES;
+	char tmp[4096];
+	FILE * file;
+	int ok;
+
+	memset(header, 0, sizeof(header));
+	memcpy(&header[HDR_MAGIC],   resume_magic, sizeof(resume_magic));
+	memcpy(&header[HDR_VERSION], &version, sizeof(version));
+	memcpy(&header[HDR_LENGTH],  &length, sizeof(length));
+	memcpy(&header[HDR_MIN],     &res->min, sizeof(res->min));
+	memcpy(&header[HDR_LAST],    &last, sizeof(last));
+	memcpy(&header[HDR_COUNT],   &count, sizeof(count));
+
+	/* Write under a temporary name, and only rename it into place once it
+	   is safely on disk */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", res->path);
+	file = fopen(tmp, "wb");
+	if(file == NULL)
+	{
+		YASE_PERROR(tmp);
+		return 0;
+	}
+	ok = (fwrite(header, 1, sizeof(header), file) == sizeof(header));
+	ok = (fflush(file) == 0) && (fsync(fileno(file)) == 0) && ok;
+	ok = (fclose(file) == 0) && ok;
+	if(!ok || rename(tmp, res->path) != 0)
+	{
+		YASE_PERROR(tmp);
+		unlink(tmp);
+		return 0;
+	}
+	res->saved = time(NULL);
+	return 1;
+}
+
+/*
+ * Starts a resumable run counting [min, max], with its state in path.
+ * If the file exists, the run carries on from where it left off;
+ * otherwise it starts from min.  Either way, res->from is the first
+ * number left to sieve, and res->count the number of primes before it,
+ * unless res->done is set because there is nothing left.  Returns
+ * nonzero on success.  On failure, an error message is printed.
+ */
+int resume_start(struct resume * res, const char * path, uint64_t min,
+                 uint64_t max)
+{
+	uint8_t header[RESUME_HEADER_BYTES];
+	uint32_t version, length;
+	uint64_t saved_min, last, count;
+	FILE * file;
+	size_t got;
+
+	res->path   = path;
+	res->min    = min;
+	res->max    = max;
+	res->from   = min;
+	res->count  = 0;
+	res->sieved = 0;
+	res->done   = 0;
+	res->saved  = time(NULL);
+	res->prog   = NULL;
+	signal(SIGINT, handle_stop);
+	signal(SIGTERM, handle_stop);
+
+	/* A missing file just means a fresh run */
+	file = fopen(path, "rb");
+	if(file == NULL)
+	{
+		return 1;
+	}
+	got = fread(header, 1, sizeof(header), file);
+	fclose(file);
+
+	/* Validate the header */
+	memcpy(&version,   &header[HDR_VERSION], sizeof(version));
+	memcpy(&length,    &header[HDR_LENGTH],  sizeof(length));
+	memcpy(&saved_min, &header[HDR_MIN],     sizeof(saved_min));
+	memcpy(&last,      &header[HDR_LAST],    sizeof(last));
+	memcpy(&count,     &header[HDR_COUNT],   sizeof(count));
+	if(got != sizeof(header)
+	   || memcmp(&header[HDR_MAGIC], resume_magic,
+	             sizeof(resume_magic)) != 0
+	   || version != RESUME_VERSION
+	   || length != RESUME_HEADER_BYTES
+	   || last < saved_min)
+	{
+		fprintf(stderr, "%s: %s: not a valid state file\n",
+		        yase_program_name, path);
+		return 0;
+	}
+	if(saved_min != min)
+	{
+		fprintf(stderr, "%s: %s: saved run started at %" PRIu64 ", not "
+		        "%" PRIu64 "\n", yase_program_name, path, saved_min, min);
+		return 0;
+	}
+	if(last > max)
+	{
+		fprintf(stderr, "%s: %s: saved run already counted up to "
+		        "%" PRIu64 ", past %" PRIu64 "\n", yase_program_name,
+		        path, last, max);
+		return 0;
+	}
+
+	res->count = count;
+	if(last == max)
+	{
+		res->done = 1;
+	}
+	else
+	{
+		res->from = last + 1;
+	}
+	return 1;
+}
+
+/* Segment callback for resumable runs: updates the progress display (if
+   any) and saves the state every so often, or on the way out if the run
+   has been asked to stop.  data must point to the struct resume. */
+void resume_segment(const struct segment * seg, void * data)
+{
+	struct resume * res = data;
+	uint64_t last;
+
+	res->sieved += seg->count;
+	if(res->prog != NULL)
+	{
+		progress_update(seg, res->prog);
+	}
+
+	/* The last segment is saved by resume_finish(), with the proper end.
+	   Every other segment ends with a whole byte, at 30 * end - 1. */
+	if(seg->end > res->max / 30)
+	{
+		return;
+	}
+	if(!stop_requested && time(NULL) - res->saved < RESUME_SAVE_SECONDS)
+	{
+		return;
+	}
+	last = seg->end * 30 - 1;
+	resume_save(res, last, res->count + res->sieved +
+	            skipped_primes(res->from, last));
+	if(stop_requested)
+	{
+		/* A quiet run prints only a result, and this is not one */
+		if(res->prog != NULL)
+		{
+			progress_finish();
+			printf("Stopped after %" PRIu64 "; run again with --resume "
+			       "to continue.\n", last);
+		}
+		else
+		{
+			fprintf(stderr, "%s: stopped after %" PRIu64 "; run again "
+			        "with --resume to continue\n", yase_program_name,
+			        last);
+		}
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* Saves the state of a finished run, which found count primes on
+   [min, max] in all.  Returns nonzero on success. */
+int resume_finish(struct resume * res, uint64_t count)
+{
+	return resume_save(res, res->max, count);
+}
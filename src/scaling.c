@@ -0,0 +1,327 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * scaling.c: thread scaling benchmarks, for yase-bench
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <yase.h>
+
+/*
+ * Each problem is counted with count_ranges(), the same chunked,
+ * threaded sieve --batch uses, for 1, 2, 4, ... threads up to the most
+ * asked for.  Under strong scaling the range is fixed, so speedup is
+ * T(1) / T(t) and efficiency is speedup / t.  Under weak scaling each
+ * thread gets a quarter of the strong range (so both agree at four
+ * threads), and efficiency is T(1) / T(t).  The seed sieve is found once
+ * per problem, untimed, since it is not split across threads.
+ *
+ * The two problems stress the memory hierarchy differently: counting
+ * from 0 to 10^10 is dominated by small primes marked within L1, and a
+ * window at 10^15 by large primes passed through buckets in DRAM.
+ *
+ * There is no portable way to read a memory controller's counters, so
+ * bandwidth is estimated from the traffic a single-threaded run sends
+ * through buckets, which are too large to stay in cache: every bucket is
+ * written as it fills and read back when its segment is sieved.  The
+ * traffic is measured with the statistics of --stats, so the estimate
+ * is missing if PHASE_STATS is 0.
+ */
+struct problem
+{
+	const char * name;  /* Name, as reported           */
+	uint64_t min;       /* Start of the range          */
+	uint64_t width;     /* Numbers in the strong range */
+};
+
+static const struct problem problems[] =
+{
+	{ "pi(1e10)",     0,                            UINT64_C(10000000000) },
+	{ "window(1e15)", UINT64_C(1000000000000000),   UINT64_C(2000000000)  }
+};
+#define N_PROBLEMS (sizeof(problems) / sizeof(problems[0]))
+
+/* Weak scaling gives each thread this fraction of the strong range */
+#define WEAK_SHARE 4
+
+/* Median time and estimated bandwidth at one thread count */
+struct scaling_result
+{
+	char name[32];         /* Scaling and problem                */
+	unsigned int threads;  /* Threads used                       */
+	uint64_t numbers;      /* Numbers counted                    */
+	double median;         /* Median wall time                   */
+	double speedup;        /* T(1) / T(t), per number if weak    */
+	double efficiency;     /* Speedup per thread, or T(1) / T(t) */
+	double bandwidth;      /* Estimated bytes per second, or 0   */
+};
+
+/* Reads the monotonic clock in seconds */
+static double scaling_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Sorts doubles */
+static int compare_double(const void * a, const void * b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* Counts [min, max] with the given number of threads */
+static uint64_t scaling_count(uint64_t min, uint64_t max,
+                              const uint8_t * seed_sieve,
+                              unsigned int threads)
+{
+	struct range range;
+	range.min = min;
+	range.max = max;
+	count_ranges(&range, 1, seed_sieve, threads);
+	return range.count;
+}
+
+/* Measures bucket traffic, in bytes, for one thread counting [min, max],
+   or returns 0 if statistics are compiled out */
+static double bucket_traffic(uint64_t min, uint64_t max,
+                             const uint8_t * seed_sieve)
+{
+#if PHASE_STATS
+	double bytes;
+	stats_start();
+	scaling_count(min, max, seed_sieve, 1);
+	bytes = 2.0 * yase_stats.buckets * sizeof(struct bucket);
+	yase_stats.enabled = 0;
+	return bytes;
+#else
+	(void) min;
+	(void) max;
+	(void) seed_sieve;
+	return 0;
+#endif
+}
+
+/* Times warmup + repeats runs of [min, max], returning the median of the
+   last repeats.  Every run must find expected primes, unless expected is
+   UINT64_MAX, in which case it is set by the first run.  Returns a
+   negative time if a count differs. */
+static double time_count(uint64_t min, uint64_t max,
+                         const uint8_t * seed_sieve, unsigned int threads,
+                         unsigned int warmup, unsigned int repeats,
+                         uint64_t * expected)
+{
+	double * times = malloc(repeats * sizeof(double)), median;
+	unsigned int i;
+
+	if(times == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(i = 0; i < warmup + repeats; i++)
+	{
+		double start = scaling_now();
+		uint64_t count = scaling_count(min, max, seed_sieve, threads);
+		if(i >= warmup)
+		{
+			times[i - warmup] = scaling_now() - start;
+		}
+		if(*expected == UINT64_MAX)
+		{
+			*expected = count;
+		}
+		else if(count != *expected)
+		{
+			fprintf(stderr, "%s: [%" PRIu64 ", %" PRIu64 "] with %u "
+			        "threads: counted %" PRIu64 ", expected %" PRIu64
+			        "\n", yase_program_name, min, max, threads, count,
+			        *expected);
+			free(times);
+			return -1;
+		}
+	}
+	qsort(times, repeats, sizeof(double), compare_double);
+	median = (repeats % 2 != 0 ? times[repeats / 2] :
+	          (times[repeats / 2 - 1] + times[repeats / 2]) / 2);
+	free(times);
+	return median;
+}
+
+/* Writes the results as JSON */
+static void scaling_json(FILE * file, const struct scaling_result * results,
+                         unsigned int n, unsigned int repeats)
+{
+	unsigned int i;
+
+	fprintf(file, "{\n  \"yase\": \"%u.%u.%u\",\n  \"repeats\": %u,\n"
+	        "  \"scaling\": [", VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH,
+	        repeats);
+	for(i = 0; i < n; i++)
+	{
+		const struct scaling_result * res = &results[i];
+		fprintf(file, "%s\n    {\"name\": \"%s\", \"threads\": %u, "
+		        "\"numbers\": %" PRIu64 ", \"median_s\": %.6f, "
+		        "\"speedup\": %.4f, \"efficiency\": %.4f, "
+		        "\"bucket_bytes_per_s\": %.6g}", (i == 0 ? "" : ","),
+		        res->name, res->threads, res->numbers, res->median,
+		        res->speedup, res->efficiency, res->bandwidth);
+	}
+	fprintf(file, "\n  ]\n}\n");
+}
+
+/*
+ * Runs the strong and weak scaling benchmarks for up to max_threads
+ * threads, with warmup + repeats runs at each thread count, printing a
+ * table and writing JSON to json if it is not NULL.  Only the problems
+ * for which selected() returns nonzero on "strong/NAME" or "weak/NAME"
+ * are run.  Returns nonzero if every count agreed.  The wheel,
+ * population count and pre-sieve must be initialized.
+ */
+int bench_scaling(unsigned int max_threads, unsigned int warmup,
+                  unsigned int repeats, int (*selected)(const char * name),
+                  FILE * json)
+{
+	struct scaling_result * results;
+	unsigned int p, weak, threads, n = 0, n_counts = 0;
+	int ok = 1;
+
+	/* Thread counts: powers of two, then max_threads itself */
+	for(threads = 1; threads < max_threads; threads *= 2)
+	{
+		n_counts++;
+	}
+	n_counts++;
+	results = malloc(N_PROBLEMS * 2 * n_counts * sizeof(*results));
+	if(results == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+
+	printf("yase-bench %u.%u.%u: thread scaling up to %u threads, %u "
+	       "warmup and %u measured runs each\n", VERSION_MAJOR,
+	       VERSION_MINOR, VERSION_PATCH, max_threads, warmup, repeats);
+	printf("%-24s %7s %12s %8s %10s %12s\n", "Problem", "Threads",
+	       "Median (s)", "Speedup", "Efficiency", "Est. GB/s");
+	for(p = 0; p < N_PROBLEMS && ok; p++)
+	{
+		const struct problem * prob = &problems[p];
+		uint64_t seed_end_byte, max_max;
+		unsigned int seed_end_bit;
+		uint8_t * seed_sieve;
+		double traffic = 0;
+
+		/* One seed sieve covers every range of the problem */
+		max_max = prob->min + prob->width - 1;
+		if(max_threads > WEAK_SHARE)
+		{
+			max_max = prob->min +
+			          prob->width / WEAK_SHARE * max_threads - 1;
+		}
+		calculate_seed_interval(max_max, &seed_end_byte, &seed_end_bit);
+		seed_sieve = NULL;
+
+		for(weak = 0; weak <= 1 && ok; weak++)
+		{
+			double base = 0;
+			uint64_t expected = UINT64_MAX;
+			char name[32];
+
+			sprintf(name, "%s/%s", (weak ? "weak" : "strong"),
+			        prob->name);
+			if(!selected(name))
+			{
+				continue;
+			}
+			if(seed_sieve == NULL)
+			{
+				seed_sieve = seed_find(seed_end_byte);
+
+				/* Bucket traffic per number, from the strong range */
+				traffic = bucket_traffic(prob->min,
+				                         prob->min + prob->width - 1,
+				                         seed_sieve) / prob->width;
+			}
+
+			for(threads = 1; ; threads = (threads * 2 < max_threads ?
+			                              threads * 2 : max_threads))
+			{
+				struct scaling_result * res = &results[n];
+				uint64_t width = (weak ? prob->width / WEAK_SHARE *
+				                  threads : prob->width);
+
+				if(weak)
+				{
+					expected = UINT64_MAX;
+				}
+				res->median = time_count(prob->min, prob->min + width - 1,
+				                         seed_sieve, threads, warmup,
+				                         repeats, &expected);
+				if(res->median < 0)
+				{
+					ok = 0;
+					break;
+				}
+				if(threads == 1)
+				{
+					base = res->median;
+				}
+				sprintf(res->name, "%s", name);
+				res->threads    = threads;
+				res->numbers    = width;
+				res->speedup    = base / res->median *
+				                  (weak ? threads : 1);
+				res->efficiency = (weak ? base / res->median :
+				                   res->speedup / threads);
+				res->bandwidth  = traffic * width / res->median;
+				printf("%-24s %7u %12.4f %8.2f %9.1f%%", res->name,
+				       threads, res->median, res->speedup,
+				       res->efficiency * 100);
+				if(PHASE_STATS)
+				{
+					printf(" %12.3f", res->bandwidth / 1e9);
+				}
+				printf("\n");
+				fflush(stdout);
+				n++;
+
+				if(threads == max_threads)
+				{
+					break;
+				}
+			}
+		}
+		free(seed_sieve);
+	}
+
+	if(json != NULL)
+	{
+		scaling_json(json, results, n, repeats);
+	}
+	free(results);
+	return ok;
+}
@@ -27,34 +27,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 #include <yase.h>
 
 /*
- * Sieves for the sieving primes.  end_byte is the first byte not
- * to check; end_bit is the first bit for which we don't need sieving
- * primes.  The long integer pointed to by count is increased with every
- * prime found.  Sieving primes found are added to the prime set given.
+ * Runs the seed sieve on the bytes [0, end_byte), returning the
+ * resulting bit array (allocated with malloc()).  Beginning with bit
+ * PRESIEVE_PRIMES + 2 (the first prime not pre-sieved), the bits set in
+ * the array are exactly the primes.
  */
-void sieve_seed(
-		uint64_t end_byte,
-		unsigned int end_bit,
-		struct prime_set * set)
+uint8_t * seed_find(uint64_t end_byte)
 {
-	uint64_t i, end_bit_absolute;
+	uint64_t i;
 	uint8_t * seed_sieve;
 
-	/* Calculate the absolute end bit */
-	if(end_bit != 0)
-	{
-		end_bit_absolute = (end_byte - 1) * 8 + end_bit;
-	}
-	else
-	{
-		end_bit_absolute = end_byte * 8;
-	}
-
 	/* We don't bother to segment for this process.  We allocate the
 	   sieve segment manually. */
+	YASE_PROBE1(seed_start, end_byte);
 	seed_sieve = malloc(end_byte);
 	if(seed_sieve == NULL)
 	{
@@ -70,40 +59,470 @@ void sieve_seed(
 	{
 		if((seed_sieve[i / 8] & ((uint8_t) 1U << (i % 8))) != 0)
 		{
-			uint64_t prime, mult, byte;
-			uint32_t prime_adj, wheel_idx;
+			uint64_t prime, byte;
+			uint32_t prime_adj, wheel_idx, byte32;
+
+			/* Find the first multiple to mark */
+			prime = (i / 8) * 30 + wheel30_offs[i % 8];
+			byte  = (prime * prime) / 30;
+			if(byte >= end_byte)
+			{
+				/* No more multiples to mark for this or any later
+				   prime */
+				break;
+			}
 
-			/* Mark multiples */
-			prime     = (i / 8) * 30 + wheel30_offs[i % 8];
-			mult      = prime * prime;
+			/* Sieve multiples for the purpose of finding more sieving
+			   primes.  The marking routine works on 32-bit byte indices,
+			   which is fine because end_byte always fits in 32 bits for
+			   the seed sieve. */
 			prime_adj = (uint32_t) (prime / 30);
-			byte      = mult / 30;
 			wheel_idx = (i % 8) * 48 + wheel210_last_idx[prime % 210];
+			byte32    = (uint32_t) byte;
+			while(byte32 < end_byte)
+			{
+				mark_multiple_210(seed_sieve, prime_adj, &byte32,
+				                  &wheel_idx);
+			}
+		}
+	}
 
-			/* If this prime is in the range that we need sieving primes,
-			   record it. */
-			if(i < end_bit_absolute)
+	YASE_PROBE1(seed_sieved, end_byte);
+	return seed_sieve;
+}
+
+/* Index of the lowest set bit of each (nonzero) byte */
+static const uint8_t lowest_bit[256] =
+{
+	0, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	7, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	6, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	5, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0,
+	4, 0, 1, 0, 2, 0, 1, 0, 3, 0, 1, 0, 2, 0, 1, 0
+};
+
+/* Routine to which seed_walk() hands each sieving prime */
+typedef void (*seed_add_fn)(
+		void * data,
+		uint64_t prime,
+		uint64_t next_byte,
+		uint32_t wheel_idx);
+
+/*
+ * Hands each prime found by seed_find() to add, in order, with its first
+ * multiple to mark.  The bits are taken a byte at a time, lowest set bit
+ * first, so that clear bits cost nothing.  This is inlined into each
+ * caller with add known, so the call through the pointer goes away.
+ */
+static inline void seed_walk(
+		const uint8_t * seed_sieve,
+		uint64_t end_byte,
+		unsigned int end_bit,
+		seed_add_fn add,
+		void * data)
+{
+	uint64_t byte, end_bit_absolute;
+
+	/* Calculate the absolute end bit */
+	if(end_bit != 0)
+	{
+		end_bit_absolute = (end_byte - 1) * 8 + end_bit;
+	}
+	else
+	{
+		end_bit_absolute = end_byte * 8;
+	}
+
+	for(byte = (PRESIEVE_PRIMES + 2) / 8; byte * 8 < end_bit_absolute;
+	    byte++)
+	{
+		unsigned int bits = seed_sieve[byte];
+
+		/* Drop the bits before the first prime and past the end */
+		if(byte == (PRESIEVE_PRIMES + 2) / 8)
+		{
+			bits &= 0xFFU << ((PRESIEVE_PRIMES + 2) % 8);
+		}
+		if(end_bit_absolute - byte * 8 < 8)
+		{
+			bits &= (1U << (end_bit_absolute - byte * 8)) - 1;
+		}
+
+		while(bits != 0)
+		{
+			unsigned int bit = lowest_bit[bits];
+			uint64_t prime, next_byte;
+
+			bits &= bits - 1;
+			prime = byte * 30 + wheel30_offs[bit];
+			next_byte = (prime * prime) / 30;
+			if(prime < SMALL_THRESHOLD)
+			{
+				add(data, prime, next_byte, bit * 9);
+			}
+			else
 			{
-				if(prime < SMALL_THRESHOLD)
-				{
-					prime_set_add(set, prime, byte, (i % 8) * 9);
-				}
-				else
-				{
-					prime_set_add(set, prime, byte, wheel_idx);
-				}
+				add(data, prime, next_byte,
+				    bit * 48 + wheel210_last_idx[prime % 210]);
 			}
+		}
+	}
+}
 
-			/* Sieve multiples for the purpose of finding more sieving
-			   primes */
-			while(byte < end_byte)
+/* seed_walk() routine for prime sets (windows have their own walk,
+   below) */
+static void add_to_set(void * data, uint64_t prime, uint64_t next_byte,
+                       uint32_t wheel_idx)
+{
+	prime_set_add(data, prime, next_byte, wheel_idx);
+}
+
+/*
+ * Adds the primes found by seed_find() to a prime set.  end_byte and
+ * end_bit give the end of the range of primes to add (as in
+ * sieve_seed()), and must not go past the end of the seed sieve.
+ */
+void seed_fill(
+		const uint8_t * seed_sieve,
+		uint64_t end_byte,
+		unsigned int end_bit,
+		struct prime_set * set)
+{
+	seed_walk(seed_sieve, end_byte, end_bit, add_to_set, set);
+	YASE_PROBE2(seed_filled, end_byte, end_bit);
+}
+
+/*
+ * High up, nearly all of a narrow window's sieving primes have no
+ * multiple in it: near 2^64, some 200 million primes are walked, and
+ * well under one percent of them hit a 10^6-wide window.  So the
+ * window's walk takes the seed sieve a batch of primes at a time, with
+ * no branch on the bits themselves, and passes on to window_add() only
+ * the primes that get past one remainder test.  Large seed sieves are
+ * also walked in shares, on several threads, each share into a window
+ * of its own.
+ */
+#define WINDOW_BATCH 1024U
+
+/* Seed sieves smaller than this many bytes are walked on one thread */
+#define WINDOW_SHARE_MIN ((uint64_t) 1U << 20)
+
+/* How many shares to aim for per thread, for load balancing */
+#define WINDOW_SHARES_PER_THREAD 4
+
+/* The offsets (from wheel30_offs) of the set bits of each nibble of a
+   seed sieve byte, low nibble first */
+static const uint8_t nibble_offs[2][16][4] =
+{
+	{
+		{ 0,  0,  0,  0}, { 1,  0,  0,  0}, { 7,  0,  0,  0},
+		{ 1,  7,  0,  0}, {11,  0,  0,  0}, { 1, 11,  0,  0},
+		{ 7, 11,  0,  0}, { 1,  7, 11,  0}, {13,  0,  0,  0},
+		{ 1, 13,  0,  0}, { 7, 13,  0,  0}, { 1,  7, 13,  0},
+		{11, 13,  0,  0}, { 1, 11, 13,  0}, { 7, 11, 13,  0},
+		{ 1,  7, 11, 13}
+	},
+	{
+		{ 0,  0,  0,  0}, {17,  0,  0,  0}, {19,  0,  0,  0},
+		{17, 19,  0,  0}, {23,  0,  0,  0}, {17, 23,  0,  0},
+		{19, 23,  0,  0}, {17, 19, 23,  0}, {29,  0,  0,  0},
+		{17, 29,  0,  0}, {19, 29,  0,  0}, {17, 19, 29,  0},
+		{23, 29,  0,  0}, {17, 23, 29,  0}, {19, 23, 29,  0},
+		{17, 19, 23, 29}
+	}
+};
+
+/* Number of set bits in each nibble */
+static const uint8_t nibble_bits[16] =
+{
+	0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+};
+
+/*
+ * Returns n % d.  Past 2^20, d is large enough that a double precision
+ * quotient is within one of n / d, and finding it that way pipelines
+ * across primes far better than a 64-bit divide does.
+ */
+static uint64_t window_rem(uint64_t n, uint64_t d)
+{
+	uint64_t quot, rem;
+
+	if(d < ((uint64_t) 1U << 20))
+	{
+		rem = n % d;
+	}
+	else
+	{
+		quot = (uint64_t) ((double) n / (double) d);
+		rem  = n - quot * d;
+		if((int64_t) rem < 0)
+		{
+			rem += d;
+		}
+		else if(rem >= d)
+		{
+			rem -= d;
+		}
+	}
+	return rem;
+}
+
+/* Hands the primes of a batch which have a multiple in the window to
+   window_add() */
+static void window_batch(struct window * win, const uint64_t * primes,
+                         unsigned int n)
+{
+	uint64_t start = win->start * 30;
+	uint64_t width = (win->end - win->start) * 30;
+	unsigned int i;
+
+	for(i = 0; i < n; i++)
+	{
+		uint64_t prime = primes[i], rem;
+		unsigned int bit;
+
+		/* Below the window, the prime's first multiple past its start
+		   must be within the window's width of it */
+		if(prime * prime < start)
+		{
+			rem = window_rem(start, prime);
+			if(rem != 0 && prime - rem >= width)
 			{
-				mark_multiple_210(seed_sieve, prime_adj,
-				                  (uint32_t *) &byte, &wheel_idx);
+				continue;
 			}
 		}
+
+		bit = wheel30_find_idx[prime % 30];
+		if(prime < SMALL_THRESHOLD)
+		{
+			window_add(win, prime, (prime * prime) / 30, bit * 9);
+		}
+		else
+		{
+			window_add(win, prime, (prime * prime) / 30,
+			           bit * 48 + wheel210_last_idx[prime % 210]);
+		}
 	}
+}
 
-	/* Clean up */
+/* Walks the seed sieve's bytes [from, to) into a window, leaving out
+   the bits from end_bit_absolute on, as seed_walk() does */
+static void window_walk(
+		const uint8_t * seed_sieve,
+		uint64_t from,
+		uint64_t to,
+		uint64_t end_bit_absolute,
+		struct window * win)
+{
+	uint64_t primes[WINDOW_BATCH + 8], byte;
+	unsigned int n = 0, i;
+
+	for(byte = from; byte < to; byte++)
+	{
+		unsigned int bits = seed_sieve[byte];
+
+		/* Drop the bits before the first prime and past the end */
+		if(byte == (PRESIEVE_PRIMES + 2) / 8)
+		{
+			bits &= 0xFFU << ((PRESIEVE_PRIMES + 2) % 8);
+		}
+		if(end_bit_absolute - byte * 8 < 8)
+		{
+			bits &= (1U << (end_bit_absolute - byte * 8)) - 1;
+		}
+
+		/* Write out four candidates for each nibble, keeping the
+		   primes */
+		for(i = 0; i < 4; i++)
+		{
+			primes[n + i] = byte * 30 + nibble_offs[0][bits & 0xFU][i];
+		}
+		n += nibble_bits[bits & 0xFU];
+		for(i = 0; i < 4; i++)
+		{
+			primes[n + i] = byte * 30 + nibble_offs[1][bits >> 4][i];
+		}
+		n += nibble_bits[bits >> 4];
+
+		if(n >= WINDOW_BATCH)
+		{
+			window_batch(win, primes, n);
+			n = 0;
+		}
+	}
+	window_batch(win, primes, n);
+}
+
+/* State shared by the threads walking a seed sieve into a window */
+struct window_shares
+{
+	const uint8_t * seed_sieve;  /* Seed sieve being walked          */
+	uint64_t first;              /* First byte to walk               */
+	uint64_t end_bit_absolute;   /* First bit not to walk            */
+	uint64_t share_bytes;        /* Bytes in each share              */
+	struct window * parts;       /* Window for each share            */
+	unsigned int n_shares;       /* Number of shares                 */
+	unsigned int next_share;     /* Index of the next to walk        */
+	pthread_mutex_t lock;        /* Protects next_share              */
+};
+
+/* Thread routine: walks shares until there are none left */
+static void * window_share_main(void * data)
+{
+	struct window_shares * shares = data;
+
+	for(;;)
+	{
+		unsigned int idx;
+		uint64_t from, to;
+
+		pthread_mutex_lock(&shares->lock);
+		idx = shares->next_share++;
+		pthread_mutex_unlock(&shares->lock);
+		if(idx >= shares->n_shares)
+		{
+			break;
+		}
+
+		from = shares->first + idx * shares->share_bytes;
+		to   = from + shares->share_bytes;
+		if(to * 8 > shares->end_bit_absolute)
+		{
+			to = (shares->end_bit_absolute + 7) / 8;
+		}
+		window_walk(shares->seed_sieve, from, to,
+		            shares->end_bit_absolute, &shares->parts[idx]);
+	}
+	return NULL;
+}
+
+/*
+ * Adds the primes found by seed_find() to a window, like seed_fill(),
+ * on up to the given number of threads, and returns how many it used.
+ * The primes come out in the same order however many threads there
+ * are.
+ */
+unsigned int seed_fill_window(
+		const uint8_t * seed_sieve,
+		uint64_t end_byte,
+		unsigned int end_bit,
+		struct window * win,
+		unsigned int threads)
+{
+	uint64_t end_bit_absolute, first, bytes;
+	struct window_shares shares;
+	pthread_t * tids;
+	unsigned int i, t;
+
+	/* Calculate the absolute end bit */
+	if(end_bit != 0)
+	{
+		end_bit_absolute = (end_byte - 1) * 8 + end_bit;
+	}
+	else
+	{
+		end_bit_absolute = end_byte * 8;
+	}
+	first = (PRESIEVE_PRIMES + 2) / 8;
+	bytes = (end_bit_absolute + 7) / 8 - first;
+
+	if(threads <= 1 || bytes < WINDOW_SHARE_MIN)
+	{
+		window_walk(seed_sieve, first, first + bytes, end_bit_absolute,
+		            win);
+		YASE_PROBE2(seed_filled, end_byte, end_bit);
+		return 1;
+	}
+
+	/* Split the seed sieve into shares, each with its own window */
+	shares.seed_sieve       = seed_sieve;
+	shares.first            = first;
+	shares.end_bit_absolute = end_bit_absolute;
+	shares.n_shares         = threads * WINDOW_SHARES_PER_THREAD;
+	shares.share_bytes      =
+		(bytes + shares.n_shares - 1) / shares.n_shares;
+	shares.n_shares         = (unsigned int)
+		((bytes + shares.share_bytes - 1) / shares.share_bytes);
+	shares.next_share       = 0;
+	shares.parts = malloc(shares.n_shares * sizeof(struct window));
+	tids = malloc((threads - 1) * sizeof(pthread_t));
+	if(shares.parts == NULL || tids == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(i = 0; i < shares.n_shares; i++)
+	{
+		window_init_like(&shares.parts[i], win);
+	}
+	pthread_mutex_init(&shares.lock, NULL);
+
+	/* Walk the shares, with the calling thread doing its share */
+	for(t = 0; t + 1 < threads; t++)
+	{
+		if(pthread_create(&tids[t], NULL, window_share_main, &shares)
+		   != 0)
+		{
+			/* Make do with the threads we have */
+			break;
+		}
+	}
+	window_share_main(&shares);
+	threads = t + 1;
+	while(t > 0)
+	{
+		pthread_join(tids[--t], NULL);
+	}
+	free(tids);
+	pthread_mutex_destroy(&shares.lock);
+
+	/* Put the shares' primes together, in order */
+	for(i = 0; i < shares.n_shares; i++)
+	{
+		window_merge(win, &shares.parts[i]);
+	}
+	free(shares.parts);
+	YASE_PROBE2(seed_filled, end_byte, end_bit);
+	return threads;
+}
+
+/*
+ * Sieves for the sieving primes.  end_byte is the first byte not
+ * to check; end_bit is the first bit for which we don't need sieving
+ * primes.  Sieving primes found are added to the prime set given.
+ */
+void sieve_seed(
+		uint64_t end_byte,
+		unsigned int end_bit,
+		struct prime_set * set)
+{
+	uint8_t * seed_sieve = seed_find(end_byte);
+	seed_fill(seed_sieve, end_byte, end_bit, set);
+	free(seed_sieve);
+}
+
+/* Finds the sieving primes for a window, like sieve_seed(), returning
+   the threads used as seed_fill_window() does */
+unsigned int sieve_seed_window(
+		uint64_t end_byte,
+		unsigned int end_bit,
+		struct window * win,
+		unsigned int threads)
+{
+	uint8_t * seed_sieve = seed_find(end_byte);
+	threads = seed_fill_window(seed_sieve, end_byte, end_bit, win,
+	                           threads);
 	free(seed_sieve);
+	return threads;
 }
@@ -0,0 +1,505 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * server.c: resident query server on a Unix domain socket
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <yase.h>
+
+/*
+ * For small queries, most of yase's run time is spent starting up: the
+ * wheel tables, the pre-sieve buffer and the seed sieve.  The server
+ * does all of that once and then answers queries over a Unix domain
+ * socket, so the time for a query is just the time to sieve it.
+ *
+ * The protocol is line-based.  Each request is one line, and each
+ * response ends with a line starting with "ok" or "error":
+ *
+ *   count [MIN] MAX   ->  ok COUNT
+ *   nth N             ->  ok PRIME           (the Nth prime, from 1)
+ *   list [MIN] MAX    ->  one line per prime, then ok COUNT
+ *   quit              ->  (closes the connection)
+ *
+ * Numbers may be expressions, as on the command line.  A connection may
+ * make any number of requests.  Each thread in the pool accepts a
+ * connection and serves it until it closes, so the number of threads is
+ * the number of connections served concurrently.
+ *
+ * The seed sieve is shared by all threads.  It starts out covering
+ * SERVER_SEED_MAX (or whatever the seed cache holds, if larger) and is
+ * grown (under a write lock) when a query needs more sieving primes
+ * than it has.
+ */
+
+/* Largest number covered by the seed sieve at startup */
+#define SERVER_SEED_MAX UINT64_C(1000000000000)
+
+/* Shared seed sieve, and whether to use the seed cache for it */
+static struct seed seed;
+static const uint8_t * seed_sieve;
+static uint64_t seed_bytes;
+static pthread_rwlock_t seed_lock;
+static int seed_use_cache;
+
+/* Socket path, removed on exit */
+static const char * socket_path;
+
+/* The primes under 30, for the primes sieving skips */
+static const uint8_t primes_under_30[10] =
+	{ 2, 3, 5, 7, 11, 13, 17, 19, 23, 29 };
+
+/* Takes a read lock on the seed sieve, first growing it if it does not
+   cover the sieving primes for max */
+static void seed_acquire(uint64_t max)
+{
+	uint64_t end_byte, max_bytes;
+	unsigned int end_bit;
+
+	calculate_seed_interval(max, &end_byte, &end_bit);
+	calculate_seed_interval(UINT64_MAX, &max_bytes, &end_bit);
+	pthread_rwlock_rdlock(&seed_lock);
+	while(end_byte > seed_bytes)
+	{
+		/* Swap to a write lock and grow the sieve, at least doubling it
+		   so that growing is rare (unless someone beat us to it) */
+		pthread_rwlock_unlock(&seed_lock);
+		pthread_rwlock_wrlock(&seed_lock);
+		if(end_byte > seed_bytes)
+		{
+			uint64_t new_bytes = seed_bytes * 2;
+			if(new_bytes < end_byte)
+			{
+				new_bytes = end_byte;
+			}
+			if(new_bytes > max_bytes)
+			{
+				new_bytes = max_bytes;
+			}
+			seed_put(&seed);
+			seed_get(&seed, new_bytes, seed_use_cache);
+			seed_sieve = seed.bits;
+			seed_bytes = seed.bytes;
+		}
+		pthread_rwlock_unlock(&seed_lock);
+		pthread_rwlock_rdlock(&seed_lock);
+	}
+}
+
+/* Releases the lock on the seed sieve */
+static void seed_release(void)
+{
+	pthread_rwlock_unlock(&seed_lock);
+}
+
+/* Returns byte i of a sieved segment, with the bits outside of the
+   segment's interval cleared */
+static uint8_t segment_byte(const struct segment * seg, uint64_t i)
+{
+	uint8_t bits = seg->sieve[i];
+	if(i == 0)
+	{
+		bits &= (uint8_t) (0xFFU << seg->start_bit);
+	}
+	if(i == seg->end - seg->start - 1 && seg->end_bit != 0)
+	{
+		bits &= (uint8_t) ~(0xFFU << seg->end_bit);
+	}
+	return bits;
+}
+
+/* Search state for nth_segment() */
+struct nth_search
+{
+	uint64_t remaining; /* Primes left to pass, counting the one sought */
+	uint64_t found;     /* The prime, once found (0 until then)       */
+};
+
+/* Segment callback: finds the prime that brings the remaining count to
+   zero */
+static void nth_segment(const struct segment * seg, void * data)
+{
+	struct nth_search * search = data;
+	uint64_t i;
+
+	if(search->found != 0)
+	{
+		return;
+	}
+	if(seg->count < search->remaining)
+	{
+		search->remaining -= seg->count;
+		return;
+	}
+
+	/* It's on this segment, so go bit by bit */
+	for(i = 0; i < seg->end - seg->start; i++)
+	{
+		uint8_t bits = segment_byte(seg, i);
+		unsigned int bit;
+		for(bit = 0; bits != 0; bit++, bits >>= 1)
+		{
+			if((bits & 1) != 0 && --search->remaining == 0)
+			{
+				search->found = (seg->start + i) * 30 + wheel30_offs[bit];
+				return;
+			}
+		}
+	}
+}
+
+/* Segment callback: writes out each prime on the segment */
+static void list_segment(const struct segment * seg, void * data)
+{
+	FILE * out = data;
+	uint64_t i;
+
+	for(i = 0; i < seg->end - seg->start; i++)
+	{
+		uint8_t bits = segment_byte(seg, i);
+		unsigned int bit;
+		for(bit = 0; bits != 0; bit++, bits >>= 1)
+		{
+			if((bits & 1) != 0)
+			{
+				fprintf(out, "%" PRIu64 "\n",
+				        (seg->start + i) * 30 + wheel30_offs[bit]);
+			}
+		}
+	}
+}
+
+/* Counts the primes on [min, max] */
+static uint64_t query_count(uint64_t min, uint64_t max)
+{
+	struct range range;
+	range.min = min;
+	range.max = max;
+	seed_acquire(max);
+	count_ranges(&range, 1, seed_sieve, 1);
+	seed_release();
+	return range.count;
+}
+
+/* Finds the nth prime, or returns 0 if it is at least 2^64 */
+static uint64_t query_nth(uint64_t n)
+{
+	struct nth_search search;
+	uint64_t lower, upper, before;
+	double ln_n, ln_ln_n, bound;
+
+	if(n <= 10)
+	{
+		return primes_under_30[n - 1];
+	}
+
+	/*
+	 * Dusart's bounds, n (ln n + ln ln n - 1) <= p_n <= n (ln n + ln ln
+	 * n), hold for n >= 6.  The primes below the lower bound are
+	 * counted, then the rest of the way is searched bit by bit.  The
+	 * bounds are nudged outwards to cover floating-point error.
+	 */
+	ln_n    = log((double) n);
+	ln_ln_n = log(ln_n);
+	lower   = (uint64_t) ((double) n * (ln_n + ln_ln_n - 1) * 0.999);
+	bound   = (double) n * (ln_n + ln_ln_n) * 1.001 + 30;
+	upper   = (bound >= 18446744073709551615.0 ? UINT64_MAX :
+	           (uint64_t) bound);
+	before  = query_count(0, lower - 1);
+
+	/* The primes sieving skips are all under 30, and so come before the
+	   one we want */
+	search.remaining = n - before - skipped_primes(lower, upper);
+	search.found     = 0;
+
+	seed_acquire(upper);
+	sieve_range(lower, upper, seed_sieve, nth_segment, &search);
+	seed_release();
+	return search.found;
+}
+
+/* Lists the primes on [min, max], returning how many there are */
+static uint64_t query_list(uint64_t min, uint64_t max, FILE * out)
+{
+	uint64_t count = 0;
+	unsigned int i;
+
+	/* The primes sieving skips come first */
+	for(i = 0; i < 10 && primes_under_30[i] <= max; i++)
+	{
+		if(primes_under_30[i] >= min &&
+		   i < WHEEL_PRIMES_SKIPPED + PRESIEVE_PRIMES)
+		{
+			fprintf(out, "%u\n", primes_under_30[i]);
+			count++;
+		}
+	}
+
+	seed_acquire(max);
+	count += sieve_range(min, max, seed_sieve, list_segment, out);
+	seed_release();
+	return count;
+}
+
+/* Parses the arguments to a request: one or two numbers, or exactly one
+   if only_one is set.  Returns the number parsed, or 0 on error. */
+static int parse_numbers(char * rest, int only_one,
+                         uint64_t * first, uint64_t * second)
+{
+	char * a = strtok(rest, " \t");
+	char * b = strtok(NULL, " \t");
+	if(a == NULL || strtok(NULL, " \t") != NULL ||
+	   (only_one && b != NULL) || !evaluate(a, first))
+	{
+		return 0;
+	}
+	if(b == NULL)
+	{
+		return 1;
+	}
+	return (evaluate(b, second) ? 2 : 0);
+}
+
+/* Handles one request line.  Returns zero if the connection should be
+   closed. */
+static int handle_request(char * line, FILE * out)
+{
+	char * command = strtok(line, " \t");
+	char * rest = strtok(NULL, "");
+	uint64_t min = 0, max = 0;
+	int n;
+
+	if(command == NULL)
+	{
+		return 1;
+	}
+	if(strcmp(command, "quit") == 0)
+	{
+		return 0;
+	}
+	if(rest == NULL)
+	{
+		rest = "";
+	}
+
+	if(strcmp(command, "count") == 0 || strcmp(command, "list") == 0)
+	{
+		n = parse_numbers(rest, 0, &min, &max);
+		if(n == 1)
+		{
+			max = min;
+			min = 0;
+		}
+		if(n == 0 || min > max)
+		{
+			fputs("error invalid range\n", out);
+		}
+		else if(command[0] == 'c')
+		{
+			fprintf(out, "ok %" PRIu64 "\n", query_count(min, max));
+		}
+		else
+		{
+			fprintf(out, "ok %" PRIu64 "\n", query_list(min, max, out));
+		}
+	}
+	else if(strcmp(command, "nth") == 0)
+	{
+		uint64_t prime;
+		if(parse_numbers(rest, 1, &min, &max) != 1 || min == 0)
+		{
+			fputs("error invalid index\n", out);
+		}
+		else if((prime = query_nth(min)) == 0)
+		{
+			fputs("error prime is too large\n", out);
+		}
+		else
+		{
+			fprintf(out, "ok %" PRIu64 "\n", prime);
+		}
+	}
+	else
+	{
+		fputs("error unknown command\n", out);
+	}
+	return 1;
+}
+
+/* Serves a connection until the client closes it or quits */
+static void serve_connection(int fd)
+{
+	FILE * in, * out;
+	char line[512];
+	int out_fd;
+
+	/* Use separate streams for reading and writing */
+	in = fdopen(fd, "r");
+	if(in == NULL)
+	{
+		YASE_PERROR("fdopen");
+		close(fd);
+		return;
+	}
+	out_fd = dup(fd);
+	out = (out_fd >= 0 ? fdopen(out_fd, "w") : NULL);
+	if(out == NULL)
+	{
+		YASE_PERROR("fdopen");
+		if(out_fd >= 0)
+		{
+			close(out_fd);
+		}
+		fclose(in);
+		return;
+	}
+
+	while(fgets(line, sizeof(line), in) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if(!handle_request(line, out))
+		{
+			break;
+		}
+		if(fflush(out) != 0)
+		{
+			break;
+		}
+	}
+	fclose(in);
+	fclose(out);
+}
+
+/* Pool thread: accepts and serves connections forever */
+static void * server_thread(void * data)
+{
+	int listen_fd = *(int *) data;
+	for(;;)
+	{
+		int fd = accept(listen_fd, NULL, NULL);
+		if(fd >= 0)
+		{
+			serve_connection(fd);
+		}
+	}
+	return NULL;
+}
+
+/* Removes the socket and exits when asked to stop */
+static void handle_stop(int sig)
+{
+	(void) sig;
+	unlink(socket_path);
+	_exit(EXIT_SUCCESS);
+}
+
+/* Runs the server on the socket at path, with a pool of threads (0 for
+   one per online CPU), optionally using the seed cache.  Only returns if
+   setting up fails. */
+int server_run(const char * path, unsigned int threads, int use_cache)
+{
+	struct sockaddr_un addr;
+	uint64_t end_byte;
+	unsigned int end_bit, t;
+	int listen_fd;
+
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "%s: %s: socket path is too long\n",
+		        yase_program_name, path);
+		return EXIT_FAILURE;
+	}
+	if(threads == 0)
+	{
+		threads = default_threads();
+	}
+
+	/* Warm everything up */
+	wheel_init();
+	popcnt_init();
+	presieve_init();
+	calculate_seed_interval(SERVER_SEED_MAX, &end_byte, &end_bit);
+	seed_use_cache = use_cache;
+	seed_get(&seed, end_byte, use_cache);
+	seed_sieve = seed.bits;
+	seed_bytes = seed.bytes;
+	pthread_rwlock_init(&seed_lock, NULL);
+
+	/* Set up the socket, replacing any stale one */
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listen_fd < 0)
+	{
+		YASE_PERROR("socket");
+		return EXIT_FAILURE;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if(bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+	{
+		YASE_PERROR(path);
+		close(listen_fd);
+		return EXIT_FAILURE;
+	}
+	if(listen(listen_fd, 64) != 0)
+	{
+		YASE_PERROR("listen");
+		close(listen_fd);
+		unlink(path);
+		return EXIT_FAILURE;
+	}
+
+	/* Clients going away shouldn't kill us, but being told to stop
+	   should clean up the socket */
+	socket_path = path;
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGINT, handle_stop);
+	signal(SIGTERM, handle_stop);
+
+	/* Start the pool, with this thread as its last member */
+	printf("yase %u.%u.%u serving on %s with %u threads\n",
+	       VERSION_MAJOR, VERSION_MINOR, VERSION_PATCH, path, threads);
+	fflush(stdout);
+	for(t = 0; t + 1 < threads; t++)
+	{
+		pthread_t tid;
+		if(pthread_create(&tid, NULL, server_thread, &listen_fd) != 0)
+		{
+			YASE_PERROR("pthread_create");
+			break;
+		}
+		pthread_detach(tid);
+	}
+	server_thread(&listen_fd);
+	return EXIT_SUCCESS;
+}
@@ -28,6 +28,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include <yase.h>
 
 /*
@@ -55,8 +56,264 @@
  * It is also important to note that when a prime is submitted to the
  * set, it is assumed that the next_byte of the prime is in absolute
  * terms, i.e. if one massive, unsegmented sieving bit array were used.
+ *
+ * Empty buckets are recycled in two tiers.  Each set keeps a pool of
+ * its own, which it takes from and returns to with no synchronization
+ * at all.  Once the pool reaches 2 * BUCKET_MAGAZINE buckets, a
+ * "magazine" of BUCKET_MAGAZINE of them goes to a depot shared by every
+ * thread on the same NUMA node, and when the pool runs dry the set
+ * takes a magazine back, trying once before it resorts to malloc() for
+ * the rest of the time the pool stays empty.  A set being cleaned up
+ * hands all of its buckets over, so a thread starting a chunk reuses
+ * the buckets of one that finished instead of allocating while they
+ * sit idle.  The depot holds at most BUCKET_DEPOT_MAGAZINES magazines
+ * per node; buckets past that are freed, which bounds the idle memory.
+ *
+ * The depot is reached from the marking loop (through
+ * prime_set_bucket_init() and prime_set_bucket_return()), though at
+ * most once per magazine, so it takes no locks.  Each node's depot is a
+ * pair of Treiber stacks over a fixed array of slots: one of slots
+ * holding a magazine and one of free slots.  A stack's head packs the
+ * top slot (plus one, so that 0 is empty) in its low 32 bits and a
+ * version in the high 32 bits, bumped by every push and pop, so a
+ * compare-and-swap cannot succeed on a head that was popped and pushed
+ * back in the meantime.  Slots are never freed, so reading the link of
+ * one another thread has just popped is harmless: the compare-and-swap
+ * then fails.  Without atomic builtins, each node's depot has a mutex
+ * instead.
  */
 
+/* One node's depot */
+struct depot
+{
+	uint64_t full;   /* Stack of slots holding magazines  */
+	uint64_t spare;  /* Stack of free slots               */
+	uint32_t used;   /* Slots ever used, from the start   */
+	uint32_t link[BUCKET_DEPOT_MAGAZINES];  /* Next slot down, plus one */
+	struct bucket * magazine[BUCKET_DEPOT_MAGAZINES]; /* Each a list of
+	                                            BUCKET_MAGAZINE buckets */
+#ifndef HAVE_ATOMIC_BUILTINS
+	pthread_mutex_t lock;  /* Protects everything above   */
+#endif
+};
+
+/* Depot for each NUMA node (threads not pinned to one share the
+   first) */
+static struct depot depots[MAX_NUMA_NODES];
+
+/* Finds the calling thread's depot */
+static struct depot * depot_find(void)
+{
+	int node = numa_node();
+	return &depots[node < 0 ? 0 : node];
+}
+
+#ifdef HAVE_ATOMIC_BUILTINS
+
+/* Pops a slot (plus one) from a stack, or returns 0 if it is empty */
+static uint32_t depot_pop(struct depot * d, uint64_t * head)
+{
+	uint64_t old = __atomic_load_n(head, __ATOMIC_ACQUIRE), new;
+	uint32_t top;
+
+	do
+	{
+		top = (uint32_t) old;
+		if(top == 0)
+		{
+			return 0;
+		}
+		new = (((old >> 32) + 1) << 32) |
+		      __atomic_load_n(&d->link[top - 1], __ATOMIC_RELAXED);
+	} while(!__atomic_compare_exchange_n(head, &old, new, 1,
+	                                     __ATOMIC_ACQUIRE,
+	                                     __ATOMIC_ACQUIRE));
+	return top;
+}
+
+/* Pushes a slot (plus one) onto a stack */
+static void depot_push(struct depot * d, uint64_t * head, uint32_t slot)
+{
+	uint64_t old = __atomic_load_n(head, __ATOMIC_RELAXED), new;
+
+	do
+	{
+		__atomic_store_n(&d->link[slot - 1], (uint32_t) old,
+		                 __ATOMIC_RELAXED);
+		new = (((old >> 32) + 1) << 32) | slot;
+	} while(!__atomic_compare_exchange_n(head, &old, new, 1,
+	                                     __ATOMIC_RELEASE,
+	                                     __ATOMIC_RELAXED));
+}
+
+/* Claims a slot (plus one) never used before, or returns 0 if all have
+   been */
+static uint32_t depot_claim(struct depot * d)
+{
+	uint32_t used = __atomic_load_n(&d->used, __ATOMIC_RELAXED);
+
+	do
+	{
+		if(used == BUCKET_DEPOT_MAGAZINES)
+		{
+			return 0;
+		}
+	} while(!__atomic_compare_exchange_n(&d->used, &used, used + 1, 1,
+	                                     __ATOMIC_RELAXED,
+	                                     __ATOMIC_RELAXED));
+	return used + 1;
+}
+
+#else /* !HAVE_ATOMIC_BUILTINS */
+
+static pthread_once_t depot_once = PTHREAD_ONCE_INIT;
+
+/* Sets up each depot's mutex */
+static void depot_init(void)
+{
+	unsigned int node;
+	for(node = 0; node < MAX_NUMA_NODES; node++)
+	{
+		pthread_mutex_init(&depots[node].lock, NULL);
+	}
+}
+
+/* The same, under the depot's mutex */
+static uint32_t depot_pop(struct depot * d, uint64_t * head)
+{
+	uint32_t top;
+
+	pthread_once(&depot_once, depot_init);
+	pthread_mutex_lock(&d->lock);
+	top = (uint32_t) *head;
+	if(top != 0)
+	{
+		*head = d->link[top - 1];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return top;
+}
+static void depot_push(struct depot * d, uint64_t * head, uint32_t slot)
+{
+	pthread_once(&depot_once, depot_init);
+	pthread_mutex_lock(&d->lock);
+	d->link[slot - 1] = (uint32_t) *head;
+	*head = slot;
+	pthread_mutex_unlock(&d->lock);
+}
+static uint32_t depot_claim(struct depot * d)
+{
+	uint32_t slot = 0;
+
+	pthread_once(&depot_once, depot_init);
+	pthread_mutex_lock(&d->lock);
+	if(d->used < BUCKET_DEPOT_MAGAZINES)
+	{
+		slot = ++d->used;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return slot;
+}
+
+#endif /* HAVE_ATOMIC_BUILTINS */
+
+/* Hands a magazine to the depot, or frees it if the depot is full */
+static void depot_give(struct bucket * magazine)
+{
+	struct depot * d = depot_find();
+	uint32_t slot = depot_pop(d, &d->spare);
+
+	if(slot == 0)
+	{
+		slot = depot_claim(d);
+	}
+	if(slot != 0)
+	{
+		d->magazine[slot - 1] = magazine;
+		depot_push(d, &d->full, slot);
+		return;
+	}
+	while(magazine != NULL)
+	{
+		struct bucket * to_free = magazine;
+		magazine = magazine->next;
+		free(to_free);
+	}
+}
+
+/* Takes a magazine from a depot, or returns NULL if it is empty */
+static struct bucket * depot_take_from(struct depot * d)
+{
+	uint32_t slot = depot_pop(d, &d->full);
+	struct bucket * magazine;
+
+	if(slot == 0)
+	{
+		return NULL;
+	}
+	magazine = d->magazine[slot - 1];
+	depot_push(d, &d->spare, slot);
+	return magazine;
+}
+
+/* Takes a magazine from the calling thread's depot */
+static struct bucket * depot_take(void)
+{
+	return depot_take_from(depot_find());
+}
+
+/* Refills an empty pool with a magazine from the depot, if it has one */
+void prime_set_pool_refill(struct prime_set * set)
+{
+	set->pool = depot_take();
+	set->pool_tried = (set->pool == NULL);
+	if(set->pool != NULL)
+	{
+		set->pool_size = BUCKET_MAGAZINE;
+		STATS_PEAK(live, live_peak, BUCKET_MAGAZINE);
+		STATS_PEAK(pool, pool_peak, BUCKET_MAGAZINE);
+	}
+}
+
+/* Passes a magazine from the pool on to the depot */
+void prime_set_pool_spill(struct prime_set * set)
+{
+	struct bucket * magazine = set->pool, * last = set->pool;
+	unsigned int i;
+
+	for(i = 1; i < BUCKET_MAGAZINE; i++)
+	{
+		last = last->next;
+	}
+	set->pool = last->next;
+	set->pool_size -= BUCKET_MAGAZINE;
+	last->next = NULL;
+	STATS_COUNT(live, -(uint64_t) BUCKET_MAGAZINE);
+	STATS_COUNT(pool, -(uint64_t) BUCKET_MAGAZINE);
+	depot_give(magazine);
+}
+
+/* Frees every magazine in the depot.  No other thread may be using
+   it. */
+void prime_set_depot_cleanup(void)
+{
+	unsigned int node;
+
+	for(node = 0; node < MAX_NUMA_NODES; node++)
+	{
+		struct bucket * bucket;
+		while((bucket = depot_take_from(&depots[node])) != NULL)
+		{
+			while(bucket != NULL)
+			{
+				struct bucket * to_free = bucket;
+				bucket = bucket->next;
+				free(to_free);
+			}
+		}
+	}
+}
+
 /* Determines how many list head pointers to allocate, based on the
    maximum number of active lists that should be needed at any given
    point */
@@ -69,7 +326,7 @@ static unsigned long find_lists_needed(uint64_t end)
 	   take for the interval being sieved, and multiply that by 10
 	   (as the greatest gap between multiples needing to be marked on a
 	   mod 210 wheel is 10 * prime) */
-	max_multiple_delta = sqrt((double) (end * 30)) * 10;
+	max_multiple_delta = sqrt((double) end * 30) * 10;
 
 	/* Now we determine how many segments that delta is, and add one to
 	   ensure that we round up */
@@ -84,8 +341,12 @@ static unsigned long find_lists_needed(uint64_t end)
 	return lists_needed;
 }
 
-/* Adjusts a prime's information so that the next multiple to be sieved
-   is above a given byte */
+/*
+ * Adjusts a prime's information so that the next multiple to be sieved
+ * is above a given byte.  start * 30 is at most the interval's minimum,
+ * so it cannot overflow, but the multiple itself can lie past 2^64 for
+ * intervals near the top.
+ */
 static void adjust_up(uint64_t prime, uint64_t start,
                       uint64_t * next_byte, uint32_t * wheel_idx)
 {
@@ -118,8 +379,10 @@ static void adjust_up(uint64_t prime, uint64_t start,
 		*wheel_idx = wheel30_last_idx[prime % 30] * 48 + new_wheel_idx;
 	}
 
-	/* Calculate next byte */
-	*next_byte = (prime * divisor) / 30;
+	/* Calculate next byte.  prime * divisor may wrap past 2^64, but its
+	   distance from start * 30 is always small, so it comes out right
+	   even when it does. */
+	*next_byte = start + (prime * divisor - start * 30) / 30;
 }
 
 /* Allocates and initializes an empty set of sieving primes, for use
@@ -146,6 +409,7 @@ void prime_set_init(
 		abort();
 	}
 	set->lists_alloc = lists_alloc;
+	STATS_PEAK(lists, lists_peak, lists_alloc);
 
 	/* Set up set metadata */
 	set->start       = inter->start_byte;
@@ -164,7 +428,9 @@ void prime_set_init(
 	set->unused       = NULL;
 
 	/* Start with no buckets allocated */
-	set->pool = NULL;
+	set->pool       = NULL;
+	set->pool_size  = 0;
+	set->pool_tried = 0;
 }
 
 /* Adds a prime to a set.  This is designed to be used ONLY from
@@ -218,6 +484,7 @@ void prime_set_add(struct prime_set * set,
 		{
 			struct bucket * node = prime_set_bucket_init(set, NULL);
 			bucket_append(node, prime_adj, next_byte, wheel_idx);
+			STATS_PEAK(inactive, inactive_peak, 1);
 			if(set->inactive_end != NULL)
 			{
 				set->inactive_end->next = node;
@@ -235,6 +502,8 @@ void prime_set_add(struct prime_set * set,
 /* Advances to the list for the next segment */
 void prime_set_advance(struct prime_set * set)
 {
+	uint64_t n_activated = 0;
+
 	/* Shift list pointers, update current segment */
 	memmove(set->lists, set->lists + 1,
 	        (set->lists_alloc - 1) * sizeof(struct bucket *));
@@ -276,6 +545,7 @@ void prime_set_advance(struct prime_set * set)
 			                      prime->next_byte % LARGE_SEGMENT_BYTES,
 			                      prime->wheel_idx);
 			prime++;
+			n_activated++;
 		}
 
 		/* Shift bucket contents or, if the bucket is empty, return it
@@ -294,68 +564,232 @@ void prime_set_advance(struct prime_set * set)
 			struct bucket * to_return = set->inactive;
 			set->inactive = set->inactive->next;
 			prime_set_bucket_return(set, to_return);
+			STATS_COUNT(inactive, -1);
 		}
 	}
+	STATS_COUNT(activated, n_activated);
+	STATS_ADVANCE();
+	YASE_PROBE3(activate, set, set->current, n_activated);
+}
+
+/* Adds a bucket of a set being cleaned up to a magazine of n buckets,
+   handing the magazine to the depot once it is full */
+static void release_bucket(struct bucket ** magazine, unsigned int * n,
+                           struct bucket * bucket)
+{
+	bucket->next = *magazine;
+	*magazine = bucket;
+	STATS_COUNT(live, -1);
+	if(++*n == BUCKET_MAGAZINE)
+	{
+		depot_give(*magazine);
+		*magazine = NULL;
+		*n = 0;
+	}
 }
 
 /* Frees all of the primes stored in a set, as well as the list head
-   pointer table itself */
+   pointers, handing the buckets to the depot */
 void prime_set_cleanup(struct prime_set * set)
 {
 	unsigned long i;
-	struct bucket * bucket, * to_free;
+	unsigned int n = 0;
+	struct bucket * bucket, * to_release, * magazine = NULL;
 
-	/* Clean up small primes list */
+	/* Release the small primes lists */
 	for(i = 0; i < 64; i++)
 	{
 		bucket = set->small[i];
 		while(bucket != NULL)
 		{
-			to_free = bucket;
+			to_release = bucket;
 			bucket = bucket->next;
-			free(to_free);
+			release_bucket(&magazine, &n, to_release);
 		}
 	}
 
-	/* Clean up the inactive list */
+	/* Release the inactive list */
 	bucket = set->inactive;
 	while(bucket != NULL)
 	{
-		to_free = bucket;
+		to_release = bucket;
 		bucket = bucket->next;
-		free(to_free);
+		release_bucket(&magazine, &n, to_release);
+		STATS_COUNT(inactive, -1);
 	}
 
-	/* Clean up the unused list */
+	/* Release the unused list */
 	bucket = set->unused;
 	while(bucket != NULL)
 	{
-		to_free = bucket;
+		to_release = bucket;
 		bucket = bucket->next;
-		free(to_free);
+		release_bucket(&magazine, &n, to_release);
 	}
 
-	/* Clean up each regular list */
+	/* Release each regular list */
 	for(i = 0; i < set->lists_alloc; i++)
 	{
 		bucket = set->lists[i];
 		while(bucket != NULL)
 		{
-			to_free = bucket;
+			to_release = bucket;
 			bucket = bucket->next;
-			free(to_free);
+			release_bucket(&magazine, &n, to_release);
 		}
 	}
 
-	/* Clean up any pooled empty buckets */
+	/* Release any pooled empty buckets */
 	bucket = set->pool;
 	while(bucket != NULL)
 	{
-		to_free = bucket;
+		to_release = bucket;
 		bucket = bucket->next;
-		free(to_free);
+		release_bucket(&magazine, &n, to_release);
+		STATS_COUNT(pool, -1);
+	}
+
+	/* Free the last, partial magazine */
+	while(magazine != NULL)
+	{
+		to_release = magazine;
+		magazine = magazine->next;
+		free(to_release);
 	}
 
 	/* Free the array of list head pointers */
 	free(set->lists);
+	STATS_COUNT(lists, -(uint64_t) set->lists_alloc);
+}
+
+/*
+ * A narrow window, only a few segments long, is sieved without a prime
+ * set at all.  Far from 0, nearly every sieving prime has no multiple in
+ * such a window, and a prime set would still file each one away in a
+ * bucket (and allocate list heads for the whole square root range).  A
+ * window instead drops those primes as soon as they are added, and keeps
+ * the rest in two flat arrays: small primes, with next_byte relative to
+ * the start of the window in the form process_small_prime() uses, and
+ * large primes, with next_byte relative to the start of the window.
+ */
+
+/* Initializes an empty window for an interval */
+void window_init(struct window * win, const struct interval * inter)
+{
+	win->start       = inter->start_byte;
+	win->end         = inter->end_byte;
+	win->small       = NULL;
+	win->n_small     = 0;
+	win->small_alloc = 0;
+	win->large       = NULL;
+	win->n_large     = 0;
+	win->large_alloc = 0;
+}
+
+/* Appends a prime to one of a window's arrays */
+static void window_append(struct prime ** primes, size_t * n,
+                          size_t * alloc, uint32_t prime_adj,
+                          uint64_t next_byte, uint32_t wheel_idx)
+{
+	if(*n == *alloc)
+	{
+		*alloc = (*alloc == 0 ? 1024 : *alloc * 2);
+		*primes = realloc(*primes, *alloc * sizeof(struct prime));
+		if(*primes == NULL)
+		{
+			YASE_PERROR("realloc");
+			abort();
+		}
+	}
+	(*primes)[*n].prime_adj = prime_adj;
+	(*primes)[*n].next_byte = next_byte;
+	(*primes)[*n].wheel_idx = wheel_idx;
+	(*n)++;
+}
+
+/* Adds a sieving prime to a window, as prime_set_add() does for a prime
+   set.  The primes need not be added in order. */
+void window_add(struct window * win,
+		uint64_t prime,
+		uint64_t next_byte,
+		uint32_t wheel_idx)
+{
+	uint32_t prime_adj = (uint32_t) (prime / 30);
+
+	/* Put the prime into the window, and drop it if it has no multiples
+	   there */
+	if(next_byte < win->start)
+	{
+		adjust_up(prime, win->start, &next_byte, &wheel_idx);
+	}
+	if(next_byte >= win->end)
+	{
+		return;
+	}
+
+	if(prime < SMALL_THRESHOLD)
+	{
+		window_append(&win->small, &win->n_small, &win->small_alloc,
+		              prime_adj, next_byte - win->start, wheel_idx);
+	}
+	else
+	{
+		window_append(&win->large, &win->n_large, &win->large_alloc,
+		              prime_adj, next_byte - win->start, wheel_idx);
+	}
+}
+
+/* Initializes an empty window over the same bytes as another */
+void window_init_like(struct window * win, const struct window * like)
+{
+	win->start       = like->start;
+	win->end         = like->end;
+	win->small       = NULL;
+	win->n_small     = 0;
+	win->small_alloc = 0;
+	win->large       = NULL;
+	win->n_large     = 0;
+	win->large_alloc = 0;
+}
+
+/* Appends n primes to one of a window's arrays */
+static void window_extend(struct prime ** primes, size_t * n,
+                          size_t * alloc, const struct prime * from,
+                          size_t n_from)
+{
+	if(n_from == 0)
+	{
+		return;
+	}
+	if(*n + n_from > *alloc)
+	{
+		*alloc = *n + n_from;
+		*primes = realloc(*primes, *alloc * sizeof(struct prime));
+		if(*primes == NULL)
+		{
+			YASE_PERROR("realloc");
+			abort();
+		}
+	}
+	memcpy(*primes + *n, from, n_from * sizeof(struct prime));
+	*n += n_from;
+}
+
+/* Moves the primes of a window (over the same bytes) onto the end of
+   another's, leaving the first empty and freed */
+void window_merge(struct window * win, struct window * from)
+{
+	window_extend(&win->small, &win->n_small, &win->small_alloc,
+	              from->small, from->n_small);
+	window_extend(&win->large, &win->n_large, &win->large_alloc,
+	              from->large, from->n_large);
+	window_cleanup(from);
+	window_init_like(from, win);
+}
+
+/* Frees the primes stored in a window */
+void window_cleanup(struct window * win)
+{
+	free(win->small);
+	free(win->large);
 }
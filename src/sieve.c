@@ -24,12 +24,10 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <yase.h>
 
-/* Sieve bit array */
-static uint8_t sieve[LARGE_SEGMENT_BYTES];
-
 /*
  * process_small_prime() marks the multiples of a single small sieving
  * prime using a highly-optimized set of mod 30 marking loops.
@@ -119,9 +117,19 @@ static const uint8_t offs_to_mask[30] =
 	case n + 7: BUILD_CHECK_AND_MARK(n + 7, 2, i, 29)     \
 	}
 
+/* The bucketed sieve needs process_small_prime() inlined into its
+   loops, and GCC stops doing so once it has a second caller (the
+   window's, in mark_small_primes()), so ask for it outright */
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
 /* process_small_prime() itself - but all of the real code is in the
    macros */
-static inline void process_small_prime(
+static ALWAYS_INLINE void process_small_prime(
+		uint8_t * sieve,
 		unsigned int subsegment,
 		struct prime * prime)
 {
@@ -147,6 +155,7 @@ static inline void process_small_prime(
 
 /* Processes a single bucket of small primes */
 static inline void process_small_prime_bucket(
+		uint8_t * sieve,
 		unsigned int subsegment,
 		struct bucket * bucket,
 		struct prime_set * set)
@@ -155,7 +164,7 @@ static inline void process_small_prime_bucket(
 	struct prime * p_end = &bucket->primes[bucket->count];
 	while(prime < p_end)
 	{
-		process_small_prime(subsegment, prime);
+		process_small_prime(sieve, subsegment, prime);
 		prime_set_list_append(set,
 		                      &set->small[prime->wheel_idx],
 		                      prime->prime_adj,
@@ -167,6 +176,7 @@ static inline void process_small_prime_bucket(
 
 /* Processes small sieving primes using the very fast mod 30 loop */
 static inline void process_small_primes(
+		uint8_t * sieve,
 		struct prime_set * set)
 {
 	unsigned int subsegment, wheel_idx;
@@ -184,7 +194,8 @@ static inline void process_small_primes(
 			while(bucket != NULL)
 			{
 				struct bucket * to_return;
-				process_small_prime_bucket(subsegment, bucket, set);
+				process_small_prime_bucket(sieve, subsegment, bucket,
+				                           set);
 				to_return = bucket;
 				bucket = bucket->next;
 				prime_set_bucket_return(set, to_return);
@@ -195,6 +206,7 @@ static inline void process_small_primes(
 
 /* Processes one bucket of large sieving primes */
 static inline void process_large_prime_bucket(
+		uint8_t * sieve,
 		struct prime_set * set,
 		struct bucket * bucket)
 {
@@ -256,6 +268,7 @@ static inline void process_large_prime_bucket(
 /* Processes large sieving primes, marking multiples of two at a time
    if possible to leverage instruction-level parallelism */
 static inline void process_large_primes(
+		uint8_t * sieve,
 		struct prime_set * set)
 {
 	struct bucket * bucket, * to_return;
@@ -270,19 +283,56 @@ static inline void process_large_primes(
 	{
 		set->lists[0] = NULL;
 		do {
-			process_large_prime_bucket(set, bucket);
+			STATS_COUNT(segment_buckets, 1);
+			process_large_prime_bucket(sieve, set, bucket);
 			to_return = bucket;
 			bucket    = bucket->next;
 			prime_set_bucket_return(set, to_return);
 		} while(bucket != NULL);
 		bucket = set->lists[0];
+		if(bucket != NULL)
+		{
+			STATS_COUNT(repasses, 1);
+		}
 	}
 }
 
-/* Sieves a segment.  start and end are in bytes, and end_bit is the
-   the bit after the final bit of the last byte checked that is needed.
-   If end_bit == 0, the entire final byte checked is needed. */
+/* Marks the multiples of an array of small sieving primes on a whole
+   segment, one subsegment at a time, leaving each prime ready for the
+   next segment */
+void mark_small_primes(uint8_t * sieve, struct prime * primes, size_t n)
+{
+	unsigned int subsegment;
+	size_t i;
+
+	for(subsegment = 0;
+	    subsegment < SMALL_SEGMENTS_PER_LARGE_SEGMENT;
+	    subsegment++)
+	{
+		for(i = 0; i < n; i++)
+		{
+			process_small_prime(sieve, subsegment, &primes[i]);
+		}
+	}
+}
+
+/* Marks one multiple of each prime in a bucket of large sieving primes,
+   saving them to their next lists, as sieve_segment() does.  This is
+   for the kernel benchmarks; the sieve itself inlines the loop. */
+void mark_large_bucket(
+		uint8_t * sieve,
+		struct prime_set * set,
+		struct bucket * bucket)
+{
+	process_large_prime_bucket(sieve, set, bucket);
+}
+
+/* Sieves a segment into the buffer sieve.  start and end are in bytes,
+   and end_bit is the the bit after the final bit of the last byte
+   checked that is needed.  If end_bit == 0, the entire final byte
+   checked is needed. */
 void sieve_segment(
+		uint8_t * sieve,
 		uint64_t start,
 		unsigned int start_bit,
 		uint64_t end,
@@ -290,14 +340,137 @@ void sieve_segment(
 		struct prime_set * set,
 		uint64_t * count)
 {
+	STATS_STAMP(stamp);
+
 	/* Copy in pre-sieve data */
+	STATS_BEGIN(stamp);
 	presieve_copy(sieve, start, end);
+	STATS_END(PHASE_PRESIEVE_COPY, stamp);
 
 	/* Mark multiples of each sieving prime */
-	process_small_primes(set);
-	process_large_primes(set);
+	process_small_primes(sieve, set);
+	STATS_END(PHASE_SMALL_PRIMES, stamp);
+	process_large_primes(sieve, set);
+	STATS_END(PHASE_LARGE_PRIMES, stamp);
 
 	/* Count primes */
 	(*count) += popcnt(sieve, start_bit, (unsigned long) (end - start),
 	                   end_bit);
+	STATS_END(PHASE_POPCNT, stamp);
+	STATS_SEGMENT();
+}
+
+/* Checks whether an interval is better sieved as a narrow window: it
+   must be only a few segments long, and shorter than the range of
+   sieving primes, so that most of them have no multiple in it */
+int window_preferred(const struct interval * inter, uint64_t seed_end_byte)
+{
+	uint64_t len = inter->end_byte - inter->start_byte;
+	return len <= WINDOW_SEGMENTS * (uint64_t) LARGE_SEGMENT_BYTES &&
+	       len < seed_end_byte;
+}
+
+/*
+ * Sieves an interval using the sieving primes in a window (see set.c),
+ * segment by segment as sieve_interval() does, so that the callback
+ * sees the same segments either way.  Small primes are marked with
+ * process_small_prime(), one subsegment at a time.  Large primes are
+ * marked straight from the flat array; each has only a handful of
+ * multiples in the whole window.
+ */
+void sieve_window(
+		const struct interval * inter,
+		struct window * win,
+		uint64_t * count,
+		segment_callback callback,
+		void * data)
+{
+	uint64_t next_byte = inter->start_byte;
+	uint8_t * sieve;
+
+	/* Allocate the sieve bit array */
+	sieve = malloc(LARGE_SEGMENT_BYTES);
+	if(sieve == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	STATS_COUNT(windows, 1);
+
+	while(next_byte < inter->end_byte)
+	{
+		uint64_t seg_end_byte = next_byte + LARGE_SEGMENT_BYTES;
+		uint64_t offset = next_byte - inter->start_byte;
+		unsigned int seg_start_bit = 0, seg_end_bit = 0;
+		uint32_t seg_len;
+		uint64_t seg_count;
+		size_t i;
+		STATS_STAMP(stamp);
+
+		/* Load the right start and end bits, as sieve_interval()
+		   does */
+		if(next_byte == inter->start_byte)
+		{
+			seg_start_bit = inter->start_bit;
+		}
+		if(seg_end_byte >= inter->end_byte)
+		{
+			seg_end_byte = inter->end_byte;
+			seg_end_bit  = inter->end_bit;
+		}
+		seg_len = (uint32_t) (seg_end_byte - next_byte);
+
+		/* Copy in pre-sieve data, and mark multiples of each sieving
+		   prime */
+		YASE_PROBE2(segment_start, next_byte, seg_end_byte);
+		STATS_BEGIN(stamp);
+		presieve_copy(sieve, next_byte, seg_end_byte);
+		STATS_END(PHASE_PRESIEVE_COPY, stamp);
+		mark_small_primes(sieve, win->small, win->n_small);
+		STATS_END(PHASE_SMALL_PRIMES, stamp);
+		for(i = 0; i < win->n_large; i++)
+		{
+			struct prime * prime = &win->large[i];
+			uint32_t byte, wheel_idx;
+
+			if(prime->next_byte >= offset + seg_len)
+			{
+				continue;
+			}
+			byte      = (uint32_t) (prime->next_byte - offset);
+			wheel_idx = prime->wheel_idx;
+			while(byte < seg_len)
+			{
+				mark_multiple_210(sieve, prime->prime_adj, &byte,
+				                  &wheel_idx);
+			}
+			prime->next_byte = offset + byte;
+			prime->wheel_idx = wheel_idx;
+		}
+		STATS_END(PHASE_LARGE_PRIMES, stamp);
+
+		/* Count primes */
+		seg_count = popcnt(sieve, seg_start_bit, seg_len, seg_end_bit);
+		*count += seg_count;
+		STATS_END(PHASE_POPCNT, stamp);
+		STATS_SEGMENT();
+		YASE_PROBE3(segment_end, next_byte, seg_end_byte, seg_count);
+
+		/* Hand the segment to the callback */
+		if(callback != NULL)
+		{
+			struct segment seg;
+			seg.sieve     = sieve;
+			seg.start     = next_byte;
+			seg.end       = seg_end_byte;
+			seg.start_bit = seg_start_bit;
+			seg.end_bit   = seg_end_bit;
+			seg.count     = seg_count;
+			callback(&seg, data);
+		}
+
+		next_byte = seg_end_byte;
+	}
+
+	free(sieve);
 }
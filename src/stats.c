@@ -0,0 +1,472 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * stats.c: per-phase timing and counters for --stats
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* syscall() is not part of POSIX, but perf_event_open() has no other
+   way in */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <yase.h>
+
+#ifdef HAVE_PERF_EVENTS
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* Statistics for the current run */
+struct stats yase_stats;
+
+/* Names of each phase in the report */
+static const char * const phase_names[PHASE_COUNT] =
+{
+	"wheel init",
+	"pre-sieve init",
+	"seed sieve",
+	"pre-sieve copy",
+	"small primes",
+	"large primes",
+	"set advance",
+	"popcnt"
+};
+
+/* Names of each hardware event in the report */
+static const char * const counter_names[COUNTER_COUNT] =
+{
+	"cycles",
+	"instructions",
+	"L1d misses",
+	"LLC misses",
+	"dTLB misses",
+	"branch misses"
+};
+
+#ifdef HAVE_PERF_EVENTS
+
+/*
+ * The hardware events are opened as a single group, led by the cycle
+ * counter, so that one read() returns all of them.  The kernel schedules
+ * a group onto the PMU all at once; if it had to share the PMU with
+ * other groups, the counts are scaled up by the fraction of the time it
+ * ran.  Events the CPU does not have are left out of the group.
+ */
+static int perf_group = -1;
+static int perf_index[COUNTER_COUNT]; /* Place in the group, or -1 */
+static unsigned int perf_members;
+
+/* Event type and configuration of each counter */
+#define HW_CACHE_MISS(cache) \
+	(PERF_COUNT_HW_CACHE_##cache | \
+	 (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+	 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+static const struct
+{
+	uint32_t type;
+	uint64_t config;
+}
+perf_events[COUNTER_COUNT] =
+{
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, HW_CACHE_MISS(L1D) },
+	{ PERF_TYPE_HW_CACHE, HW_CACHE_MISS(LL) },
+	{ PERF_TYPE_HW_CACHE, HW_CACHE_MISS(DTLB) },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+/* Opens the counters for this thread, as a group.  Returns nonzero on
+   success; on failure, prints an error message. */
+int stats_perf_open(void)
+{
+	struct perf_event_attr attr;
+	unsigned int i;
+
+	perf_members = 0;
+	for(i = 0; i < COUNTER_COUNT; i++)
+	{
+		int fd;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.size   = sizeof(attr);
+		attr.type   = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.read_format = PERF_FORMAT_GROUP |
+		                   PERF_FORMAT_TOTAL_TIME_ENABLED |
+		                   PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv     = 1;
+		fd = (int) syscall(SYS_perf_event_open, &attr, 0, -1, perf_group,
+		                   0);
+		perf_index[i] = -1;
+		if(fd < 0)
+		{
+			/* Without cycles, there is no group to join */
+			if(i == COUNTER_CYCLES)
+			{
+				YASE_PERROR("perf_event_open");
+				return 0;
+			}
+			continue;
+		}
+		if(i == COUNTER_CYCLES)
+		{
+			perf_group = fd;
+		}
+		perf_index[i] = (int) perf_members++;
+	}
+	yase_stats.perf = 1;
+	return 1;
+}
+
+/* Reads the counters into a stamp */
+static void perf_read(struct stats_stamp * stamp)
+{
+	uint64_t values[3 + COUNTER_COUNT];
+	unsigned int i;
+
+	memset(stamp->counters, 0, sizeof(stamp->counters));
+	if(read(perf_group, values, sizeof(values)) <
+	   (ssize_t) ((3 + perf_members) * sizeof(uint64_t)) || values[2] == 0)
+	{
+		return;
+	}
+	for(i = 0; i < COUNTER_COUNT; i++)
+	{
+		if(perf_index[i] >= 0)
+		{
+			uint64_t value = values[3 + perf_index[i]];
+			if(values[2] < values[1])
+			{
+				value = (uint64_t) ((double) value * values[1] /
+				                    values[2]);
+			}
+			stamp->counters[i] = value;
+		}
+	}
+}
+
+#else
+
+/* Without perf_event_open(), there are no counters to read */
+int stats_perf_open(void)
+{
+	fprintf(stderr, "%s: hardware counters are not available on this "
+	        "system\n", yase_program_name);
+	return 0;
+}
+
+#endif /* HAVE_PERF_EVENTS */
+
+/* Reads a clock in nanoseconds */
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (uint64_t) ts.tv_sec * UINT64_C(1000000000) +
+	       (uint64_t) ts.tv_nsec;
+}
+
+/* Clears the statistics and begins gathering them */
+void stats_start(void)
+{
+	memset(&yase_stats, 0, sizeof(yase_stats));
+	yase_stats.enabled = 1;
+	stats_now(&yase_stats.start);
+}
+
+/* Stamps the current wall clock and CPU times */
+void stats_now(struct stats_stamp * stamp)
+{
+	stamp->wall = clock_ns(CLOCK_MONOTONIC);
+	stamp->cpu  = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+#ifdef HAVE_PERF_EVENTS
+	if(yase_stats.perf)
+	{
+		perf_read(stamp);
+	}
+#endif
+}
+
+/* Adds the time since stamp to a phase, and restamps it */
+void stats_phase_end(enum stats_phase phase, struct stats_stamp * stamp)
+{
+	struct stats_stamp now;
+
+	stats_now(&now);
+	yase_stats.wall[phase] += now.wall - stamp->wall;
+	yase_stats.cpu[phase]  += now.cpu - stamp->cpu;
+	if(yase_stats.perf)
+	{
+		unsigned int i;
+		for(i = 0; i < COUNTER_COUNT; i++)
+		{
+			yase_stats.counters[phase][i] +=
+				now.counters[i] - stamp->counters[i];
+		}
+	}
+	*stamp = now;
+}
+
+/* Ends a segment, filing it in the histogram by the number of buckets
+   of large primes it went through */
+void stats_segment(void)
+{
+	uint64_t n = yase_stats.segment_buckets;
+	unsigned int bin = 0;
+
+	while(n != 0 && bin < STATS_HISTOGRAM_BINS - 1)
+	{
+		n >>= 1;
+		bin++;
+	}
+	yase_stats.histogram[bin]++;
+	yase_stats.buckets += yase_stats.segment_buckets;
+	yase_stats.segment_buckets = 0;
+	yase_stats.segments++;
+}
+
+/* Ends an advance of a prime set, sampling the primes it activated and
+   the length of the inactive list */
+void stats_advance(void)
+{
+	uint64_t activated = yase_stats.activated - yase_stats.activated_last;
+
+	if(activated > yase_stats.activated_peak)
+	{
+		yase_stats.activated_peak = activated;
+	}
+	yase_stats.activated_last = yase_stats.activated;
+	yase_stats.inactive_sum  += yase_stats.inactive;
+	yase_stats.advances++;
+}
+
+/* Prints the memory used by prime sets and the traffic through their
+   buckets */
+static void set_report(FILE * file)
+{
+	double advances = (yase_stats.advances != 0 ?
+	                   (double) yase_stats.advances : 1.0);
+	unsigned int bin;
+
+	fprintf(file, "\nPrime set:\n");
+	fprintf(file, " list heads       %12" PRIu64 " (%.1f KiB)\n",
+	        yase_stats.lists_peak,
+	        yase_stats.lists_peak * sizeof(struct bucket *) / 1024.0);
+	fprintf(file, " peak buckets     %12" PRIu64 " (%.1f MiB of %u primes "
+	        "each)\n",
+	        yase_stats.live_peak,
+	        yase_stats.live_peak * sizeof(struct bucket) / 1048576.0,
+	        (unsigned int) BUCKET_PRIMES);
+	fprintf(file, " peak pool        %12" PRIu64 " buckets\n",
+	        yase_stats.pool_peak);
+	fprintf(file, " inactive list    %12" PRIu64 " buckets at most, %.1f on "
+	        "average\n", yase_stats.inactive_peak,
+	        yase_stats.inactive_sum / advances);
+	fprintf(file, " activated        %12" PRIu64 " primes, %.1f per advance, "
+	        "%" PRIu64 " at most\n", yase_stats.activated,
+	        yase_stats.activated / advances, yase_stats.activated_peak);
+	fprintf(file, " large re-passes  %12" PRIu64 "\n", yase_stats.repasses);
+
+	fprintf(file, "\n%-16s %12s\n", "Large buckets", "Segments");
+	for(bin = 0; bin < STATS_HISTOGRAM_BINS; bin++)
+	{
+		char label[32];
+
+		if(yase_stats.histogram[bin] == 0)
+		{
+			continue;
+		}
+		if(bin == 0)
+		{
+			sprintf(label, "0");
+		}
+		else if(bin == 1)
+		{
+			sprintf(label, "1");
+		}
+		else if(bin == STATS_HISTOGRAM_BINS - 1)
+		{
+			sprintf(label, "%lu+", 1UL << (bin - 1));
+		}
+		else
+		{
+			sprintf(label, "%lu-%lu", 1UL << (bin - 1),
+			        (1UL << bin) - 1);
+		}
+		fprintf(file, "%-16s %12" PRIu64 "\n", label,
+		        yase_stats.histogram[bin]);
+	}
+}
+
+/* Prints the instructions per cycle and misses per segment of each
+   phase of sieving a segment */
+static void perf_report(FILE * file)
+{
+	unsigned int i, c;
+
+	fprintf(file, "\n%-16s %8s", "Phase", "IPC");
+	for(c = COUNTER_L1D_MISSES; c < COUNTER_COUNT; c++)
+	{
+		fprintf(file, " %14s", counter_names[c]);
+	}
+	fprintf(file, "\n");
+	for(i = PHASE_PRESIEVE_COPY; i <= PHASE_POPCNT; i++)
+	{
+		const uint64_t * counters = yase_stats.counters[i];
+
+		fprintf(file, "%-16s", phase_names[i]);
+		if(counters[COUNTER_CYCLES] != 0)
+		{
+			fprintf(file, " %8.2f", (double) counters[COUNTER_INSTRUCTIONS] /
+			        counters[COUNTER_CYCLES]);
+		}
+		else
+		{
+			fprintf(file, " %8s", "-");
+		}
+		for(c = COUNTER_L1D_MISSES; c < COUNTER_COUNT; c++)
+		{
+#ifdef HAVE_PERF_EVENTS
+			if(perf_index[c] >= 0 && yase_stats.segments != 0)
+			{
+				fprintf(file, " %14.1f", (double) counters[c] /
+				        yase_stats.segments);
+				continue;
+			}
+#endif
+			fprintf(file, " %14s", "-");
+		}
+		fprintf(file, "\n");
+	}
+	fprintf(file, "(Misses are per segment.)\n");
+}
+
+/* Prints the statistics gathered so far to file, for a run over the
+   given amount of numbers, and stops gathering them */
+void stats_report(FILE * file, uint64_t numbers)
+{
+	struct stats_stamp now;
+	struct rusage usage;
+	uint64_t wall = 0, cpu = 0;
+	unsigned int i;
+
+	stats_now(&now);
+	yase_stats.enabled = 0;
+
+	fprintf(file, "%-16s %12s %12s\n", "Phase", "Wall (s)", "CPU (s)");
+	for(i = 0; i < PHASE_COUNT; i++)
+	{
+		fprintf(file, "%-16s %12.6f %12.6f\n", phase_names[i],
+		        yase_stats.wall[i] / 1e9, yase_stats.cpu[i] / 1e9);
+		wall += yase_stats.wall[i];
+		cpu  += yase_stats.cpu[i];
+	}
+	fprintf(file, "%-16s %12.6f %12.6f\n", "other",
+	        (now.wall - yase_stats.start.wall - wall) / 1e9,
+	        (now.cpu - yase_stats.start.cpu - cpu) / 1e9);
+	wall = now.wall - yase_stats.start.wall;
+	cpu  = now.cpu - yase_stats.start.cpu;
+	fprintf(file, "%-16s %12.6f %12.6f\n", "total", wall / 1e9, cpu / 1e9);
+	fprintf(file, "Segments sieved: %" PRIu64 "\n", yase_stats.segments);
+	if(yase_stats.windows == 0)
+	{
+		fprintf(file, "Large prime buckets: %" PRIu64 "\n",
+		        yase_stats.buckets);
+	}
+	if(wall != 0)
+	{
+		fprintf(file, "Numbers per second: %.4g\n", numbers / (wall / 1e9));
+	}
+	if(getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		fprintf(file, "Peak RSS: %ld KiB\n", (long) usage.ru_maxrss);
+	}
+	if(yase_stats.live_peak != 0)
+	{
+		set_report(file);
+	}
+	if(yase_stats.perf)
+	{
+		perf_report(file);
+	}
+}
+
+/* Writes the statistics gathered so far as a JSON object, with the wall
+   clock and CPU time of each phase in seconds, and stops gathering
+   them */
+void stats_json(FILE * file)
+{
+	struct stats_stamp now;
+	struct rusage usage;
+	unsigned int i;
+	int first = 1;
+
+	stats_now(&now);
+	yase_stats.enabled = 0;
+
+	fprintf(file, "{\"phases\": {");
+	for(i = 0; i < PHASE_COUNT; i++)
+	{
+		const char * c;
+
+		/* Leave out phases that never ran (such as the sieve's, when
+		   counting combinatorially), rather than report them as
+		   taking no time */
+		if(yase_stats.wall[i] == 0 && yase_stats.cpu[i] == 0)
+		{
+			continue;
+		}
+
+		/* Keys are the report's names, with _ for spaces and dashes */
+		fprintf(file, "%s\"", (first ? "" : ", "));
+		first = 0;
+		for(c = phase_names[i]; *c != '\0'; c++)
+		{
+			fputc((*c == ' ' || *c == '-' ? '_' : *c), file);
+		}
+		fprintf(file, "\": {\"wall_s\": %.6f, \"cpu_s\": %.6f}",
+		        yase_stats.wall[i] / 1e9, yase_stats.cpu[i] / 1e9);
+	}
+	fprintf(file, "}, \"total_wall_s\": %.6f, \"total_cpu_s\": %.6f, "
+	        "\"segments\": %" PRIu64,
+	        (now.wall - yase_stats.start.wall) / 1e9,
+	        (now.cpu - yase_stats.start.cpu) / 1e9, yase_stats.segments);
+
+	/* A narrow window has no buckets, so it has no count of them */
+	if(yase_stats.windows == 0)
+	{
+		fprintf(file, ", \"buckets\": %" PRIu64, yase_stats.buckets);
+	}
+	if(getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		fprintf(file, ", \"peak_rss_kib\": %ld", (long) usage.ru_maxrss);
+	}
+	fprintf(file, "}");
+}
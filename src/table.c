@@ -0,0 +1,346 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * table.c: checkpoint tables of pi(x)
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <yase.h>
+
+/*
+ * A pi table holds pi(k * step) for k = 0, 1, ..., n - 1.  With one at
+ * hand, pi(x) only needs the primes between x and the nearest
+ * checkpoint, which are sieved (upwards or downwards) and added to or
+ * subtracted from the checkpoint's count.  A range [min, max] is then
+ * pi(max) - pi(min - 1), unless sieving it directly is less work.
+ *
+ * The file is a header of PI_TABLE_HEADER_BYTES bytes holding a magic
+ * string, a format version, the header length, step and n, followed by
+ * the n counts as 64-bit integers.  As with bitmap files, everything is
+ * in native byte order.
+ */
+static const char pi_table_magic[8] = "YASEPIT";
+#define PI_TABLE_VERSION (1U)
+#define PI_TABLE_HEADER_BYTES (64U)
+
+/* Offsets of each header field */
+#define HDR_MAGIC   0
+#define HDR_VERSION 8
+#define HDR_LENGTH  12
+#define HDR_STEP    16
+#define HDR_N       24
+
+/*
+ * Builds a pi table with checkpoints every step up to max and writes it
+ * to path.  Every checkpoint is a range [0, k * step] for
+ * count_ranges(), which merges them into a single run, so the whole of
+ * [0, max] is sieved just once, split across the threads (0 for one per
+ * online CPU).  Returns the exit status.
+ */
+int pi_table_make(const char * path, uint64_t step, uint64_t max,
+                  unsigned int threads, int use_cache)
+{
+	uint8_t header[PI_TABLE_HEADER_BYTES];
+	uint32_t version = PI_TABLE_VERSION, length = PI_TABLE_HEADER_BYTES;
+	uint64_t n = max / step + 1, k, seed_end_byte;
+	unsigned int seed_end_bit;
+	struct range * ranges;
+	uint64_t * counts;
+	struct seed seed;
+	FILE * file;
+	int ok;
+
+	/* Count up to every checkpoint */
+	ranges = malloc((size_t) n * sizeof(struct range));
+	counts = malloc((size_t) n * sizeof(uint64_t));
+	if(ranges == NULL || counts == NULL)
+	{
+		YASE_PERROR("malloc");
+		abort();
+	}
+	for(k = 0; k < n; k++)
+	{
+		ranges[k].min = 0;
+		ranges[k].max = k * step;
+	}
+	wheel_init();
+	popcnt_init();
+	presieve_init();
+	calculate_seed_interval(ranges[n - 1].max, &seed_end_byte,
+	                        &seed_end_bit);
+	seed_get(&seed, seed_end_byte, use_cache);
+	count_ranges(ranges, (size_t) n, seed.bits,
+	             (threads == 0 ? default_threads() : threads));
+	seed_put(&seed);
+	presieve_cleanup();
+	prime_set_depot_cleanup();
+	for(k = 0; k < n; k++)
+	{
+		counts[k] = ranges[k].count;
+	}
+	free(ranges);
+
+	/* Build the header and write out the table */
+	memset(header, 0, sizeof(header));
+	memcpy(&header[HDR_MAGIC],   pi_table_magic, sizeof(pi_table_magic));
+	memcpy(&header[HDR_VERSION], &version, sizeof(version));
+	memcpy(&header[HDR_LENGTH],  &length, sizeof(length));
+	memcpy(&header[HDR_STEP],    &step, sizeof(step));
+	memcpy(&header[HDR_N],       &n, sizeof(n));
+	file = fopen(path, "wb");
+	if(file == NULL)
+	{
+		YASE_PERROR(path);
+		free(counts);
+		return EXIT_FAILURE;
+	}
+	ok = (fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+	      fwrite(counts, sizeof(uint64_t), (size_t) n, file) == n);
+	ok = (fclose(file) == 0) && ok;
+	free(counts);
+	if(!ok)
+	{
+		fprintf(stderr, "%s: %s: error writing pi table\n",
+		        yase_program_name, path);
+		return EXIT_FAILURE;
+	}
+	printf("Wrote pi(x) for x = 0 to %" PRIu64 " in steps of %" PRIu64
+	       ".\n", (n - 1) * step, step);
+	return EXIT_SUCCESS;
+}
+
+/* Memory-maps a pi table.  Returns nonzero on success.  On failure, an
+   error message is printed. */
+int pi_table_open(struct pi_table * table, const char * path)
+{
+	struct stat st;
+	const uint8_t * header;
+	uint32_t version, length;
+	uint64_t step, n;
+	int fd;
+
+	/* Open and map the entire file */
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+	{
+		YASE_PERROR(path);
+		return 0;
+	}
+	if(fstat(fd, &st) != 0)
+	{
+		YASE_PERROR(path);
+		close(fd);
+		return 0;
+	}
+	if((uint64_t) st.st_size < PI_TABLE_HEADER_BYTES)
+	{
+		fprintf(stderr, "%s: %s: not a pi table file\n",
+		        yase_program_name, path);
+		close(fd);
+		return 0;
+	}
+	table->map_len = (size_t) st.st_size;
+	table->map = mmap(NULL, table->map_len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(table->map == MAP_FAILED)
+	{
+		YASE_PERROR("mmap");
+		return 0;
+	}
+
+	/* Validate the header.  There must be at least the checkpoint at 0,
+	   and the last checkpoint must not overflow. */
+	header = table->map;
+	memcpy(&version, &header[HDR_VERSION], sizeof(version));
+	memcpy(&length,  &header[HDR_LENGTH],  sizeof(length));
+	memcpy(&step,    &header[HDR_STEP],    sizeof(step));
+	memcpy(&n,       &header[HDR_N],       sizeof(n));
+	if(memcmp(&header[HDR_MAGIC], pi_table_magic,
+	          sizeof(pi_table_magic)) != 0
+	   || version != PI_TABLE_VERSION
+	   || length != PI_TABLE_HEADER_BYTES
+	   || step == 0
+	   || n == 0
+	   || n - 1 > UINT64_MAX / step
+	   || (table->map_len - PI_TABLE_HEADER_BYTES) / sizeof(uint64_t) < n)
+	{
+		fprintf(stderr, "%s: %s: not a valid pi table file\n",
+		        yase_program_name, path);
+		munmap(table->map, table->map_len);
+		return 0;
+	}
+	table->counts = (const uint64_t *) (header + PI_TABLE_HEADER_BYTES);
+	table->step   = step;
+	table->n      = n;
+	return 1;
+}
+
+/* Unmaps a pi table */
+void pi_table_close(struct pi_table * table)
+{
+	munmap(table->map, table->map_len);
+}
+
+/* Finds the checkpoint nearest to x */
+static uint64_t nearest_checkpoint(const struct pi_table * table,
+                                   uint64_t x)
+{
+	uint64_t k = x / table->step;
+	if(k >= table->n)
+	{
+		return table->n - 1;
+	}
+	if(k + 1 < table->n && x - k * table->step > (k + 1) * table->step - x)
+	{
+		k++;
+	}
+	return k;
+}
+
+/* Finds how many numbers must be sieved to get pi(x) from the table */
+static uint64_t residual_length(const struct pi_table * table, uint64_t x)
+{
+	uint64_t c = nearest_checkpoint(table, x) * table->step;
+	return (c <= x ? x - c : c - x);
+}
+
+/* Sets up the range to sieve to get pi(x) from its nearest checkpoint,
+   returning the checkpoint's index.  The range is empty (min > max) if
+   x is a checkpoint. */
+static uint64_t residual_range(const struct pi_table * table, uint64_t x,
+                               struct range * range)
+{
+	uint64_t k = nearest_checkpoint(table, x), c = k * table->step;
+	if(c <= x)
+	{
+		range->min = c + 1;
+		range->max = x;
+	}
+	else
+	{
+		range->min = x + 1;
+		range->max = c;
+	}
+	return k;
+}
+
+/* Combines a checkpoint count with the count on its residual range */
+static uint64_t residual_pi(const struct pi_table * table, uint64_t x,
+                            uint64_t k, const struct range * range)
+{
+	if(range->min > range->max)
+	{
+		return table->counts[k];
+	}
+	return (k * table->step <= x ? table->counts[k] + range->count
+	                             : table->counts[k] - range->count);
+}
+
+/*
+ * Counts the primes on [min, max] using a pi table, sieving only the
+ * residual ranges between min - 1 and max and their nearest checkpoints
+ * (or [min, max] itself, if that is shorter).  The residual ranges are
+ * counted together with count_ranges(), on the given number of threads
+ * (0 for one per online CPU).  The wheel tables, population count and
+ * pre-sieve must be initialized.
+ */
+uint64_t pi_table_count(const struct pi_table * table, uint64_t min,
+                        uint64_t max, unsigned int threads, int use_cache)
+{
+	struct range ranges[2], todo[2];
+	uint64_t k[2] = { 0, 0 }, top, seed_end_byte, residual, count;
+	unsigned int seed_end_bit;
+	struct seed seed;
+	size_t n = 0, n_todo = 0, slot[2] = { 0, 0 }, i;
+
+	/* Decide what to sieve */
+	residual = residual_length(table, max);
+	if(min != 0)
+	{
+		residual += residual_length(table, min - 1);
+	}
+	if(max - min <= residual)
+	{
+		ranges[0].min = min;
+		ranges[0].max = max;
+		n = 1;
+	}
+	else
+	{
+		k[0] = residual_range(table, max, &ranges[0]);
+		n = 1;
+		if(min != 0)
+		{
+			k[1] = residual_range(table, min - 1, &ranges[1]);
+			n = 2;
+		}
+	}
+
+	/* Sieve everything that needs it.  (A residual range is empty if
+	   its end is a checkpoint itself.) */
+	top = 0;
+	for(i = 0; i < n; i++)
+	{
+		ranges[i].count = 0;
+		if(ranges[i].min <= ranges[i].max)
+		{
+			slot[i] = n_todo;
+			todo[n_todo++] = ranges[i];
+			if(ranges[i].max > top)
+			{
+				top = ranges[i].max;
+			}
+		}
+	}
+	calculate_seed_interval(top, &seed_end_byte, &seed_end_bit);
+	seed_get(&seed, seed_end_byte, use_cache);
+	count_ranges(todo, n_todo, seed.bits,
+	             (threads == 0 ? default_threads() : threads));
+	seed_put(&seed);
+	for(i = 0; i < n; i++)
+	{
+		if(ranges[i].min <= ranges[i].max)
+		{
+			ranges[i].count = todo[slot[i]].count;
+		}
+	}
+
+	/* Put the answer together */
+	if(max - min <= residual)
+	{
+		return ranges[0].count;
+	}
+	count = residual_pi(table, max, k[0], &ranges[0]);
+	if(min != 0)
+	{
+		count -= residual_pi(table, min - 1, k[1], &ranges[1]);
+	}
+	return count;
+}
@@ -0,0 +1,297 @@
+/*
+ * yase - Yet Another Sieve of Eratosthenes
+ * telemetry.c: periodic and on-demand snapshots of a running sieve
+ *
+ * Copyright (c) 2015 Matthew Ingwersen
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* setitimer() is not in POSIX.1-2008 proper */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <yase.h>
+
+/*
+ * Telemetry wraps a run's segment callback.  Every so often (with an
+ * interval timer) and whenever the process gets SIGUSR1, a signal
+ * handler sets a flag; the next segment callback sees it and writes a
+ * snapshot of the run: how far it has got, the rate, the estimated time
+ * left, the primes found so far and the resident set size.  All the
+ * sieve pays per segment is an extra call and a test of the flag.
+ *
+ * The rate behind the estimate is a moving average: each snapshot
+ * blends the rate since the last one into it, weighted by
+ * TELEMETRY_WEIGHT, so it follows changes in speed (the sieve slows as
+ * the large primes thicken) without jumping about.
+ *
+ * Snapshots go to standard error as a line of text, or to a file as
+ * one JSON object per line.
+ */
+#define TELEMETRY_WEIGHT 0.3
+
+/* Set by the timer or SIGUSR1 when a snapshot is due */
+static volatile sig_atomic_t snapshot_due = 0;
+
+/* Dispositions of SIGUSR1 and SIGALRM before telemetry took them over,
+   and whether it has */
+static void (* previous_usr1)(int);
+static void (* previous_alrm)(int);
+static int usr1_taken = 0, alrm_taken = 0;
+
+/* Signal handler for SIGALRM and SIGUSR1 */
+static void handle_snapshot(int sig)
+{
+	(void) sig;
+	snapshot_due = 1;
+}
+
+/*
+ * Makes SIGUSR1 ask for a snapshot instead of killing the process.  This
+ * should be called as soon as a run starts, since the seed sieve or a
+ * combinatorial count can take a long time before the sieve (and so
+ * telemetry_start()) gets going.  A snapshot asked for before then is
+ * written once the first segment is sieved.
+ */
+void telemetry_init(void)
+{
+	if(!usr1_taken)
+	{
+		previous_usr1 = signal(SIGUSR1, handle_snapshot);
+		if(previous_usr1 == SIG_ERR)
+		{
+			previous_usr1 = SIG_DFL;
+		}
+		usr1_taken = 1;
+	}
+}
+
+/* Reads the monotonic clock in seconds */
+static double telemetry_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Finds the resident set size in KiB, from /proc if it is there, or
+   else the peak from getrusage() */
+static long resident_kib(void)
+{
+	struct rusage usage;
+	long pages, resident;
+	FILE * file = fopen("/proc/self/statm", "r");
+
+	if(file != NULL)
+	{
+		int got = fscanf(file, "%ld %ld", &pages, &resident);
+		fclose(file);
+		if(got == 2)
+		{
+			return resident * (sysconf(_SC_PAGESIZE) / 1024);
+		}
+	}
+	if(getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		return (long) usage.ru_maxrss;
+	}
+	return 0;
+}
+
+/* Formats a number of seconds as e.g. "1h02m13s" */
+static void format_duration(double seconds, char * buf, size_t size)
+{
+	unsigned long s = (unsigned long) (seconds + 0.5);
+	if(s >= 3600)
+	{
+		snprintf(buf, size, "%luh%02lum%02lus", s / 3600, s / 60 % 60,
+		         s % 60);
+	}
+	else if(s >= 60)
+	{
+		snprintf(buf, size, "%lum%02lus", s / 60, s % 60);
+	}
+	else
+	{
+		snprintf(buf, size, "%lus", s);
+	}
+}
+
+/*
+ * Starts telemetry for a run sieving the interval inter.  Snapshots are
+ * written every seconds seconds (or only on SIGUSR1 if seconds is 0) to
+ * path, or to standard error if path is NULL.  Returns nonzero on
+ * success.  On failure, an error message is printed.
+ */
+int telemetry_start(struct telemetry * tel, const struct interval * inter,
+                    unsigned int seconds, const char * path)
+{
+	struct itimerval timer;
+
+	tel->inner      = NULL;
+	tel->inner_data = NULL;
+	tel->count      = NULL;
+	tel->start      = inter->start_byte;
+	tel->end        = inter->end_byte;
+	tel->started    = telemetry_now();
+	tel->last_time  = tel->started;
+	tel->last_byte  = inter->start_byte;
+	tel->rate       = 0;
+	tel->file       = stderr;
+	if(path != NULL)
+	{
+		tel->file = fopen(path, "a");
+		if(tel->file == NULL)
+		{
+			YASE_PERROR(path);
+			return 0;
+		}
+	}
+
+	telemetry_init();
+	if(seconds != 0)
+	{
+		previous_alrm = signal(SIGALRM, handle_snapshot);
+		if(previous_alrm == SIG_ERR)
+		{
+			previous_alrm = SIG_DFL;
+		}
+		alrm_taken = 1;
+		timer.it_interval.tv_sec  = seconds;
+		timer.it_interval.tv_usec = 0;
+		timer.it_value = timer.it_interval;
+		if(setitimer(ITIMER_REAL, &timer, NULL) != 0)
+		{
+			YASE_PERROR("setitimer");
+		}
+	}
+	return 1;
+}
+
+/* Writes a snapshot of the run, as of the end of segment seg */
+static void telemetry_snapshot(struct telemetry * tel,
+                               const struct segment * seg)
+{
+	double now = telemetry_now(), elapsed = now - tel->started;
+	double done, rate, eta = -1;
+	uint64_t position = (seg->end > UINT64_MAX / 30 ? UINT64_MAX
+	                                               : seg->end * 30);
+	uint64_t primes = (tel->count != NULL ? *tel->count : 0);
+	long rss = resident_kib();
+	char eta_text[32], elapsed_text[32];
+
+	/* Blend the rate since the last snapshot into the average */
+	if(now > tel->last_time)
+	{
+		rate = (seg->end - tel->last_byte) * 30.0 / (now - tel->last_time);
+		tel->rate = (tel->rate == 0 ? rate :
+		             TELEMETRY_WEIGHT * rate +
+		             (1 - TELEMETRY_WEIGHT) * tel->rate);
+		tel->last_time = now;
+		tel->last_byte = seg->end;
+	}
+	if(tel->rate > 0)
+	{
+		eta = (tel->end - seg->end) * 30.0 / tel->rate;
+	}
+	done = (double) (seg->end - tel->start) / (tel->end - tel->start);
+
+	if(tel->file != stderr)
+	{
+		fprintf(tel->file, "{\"elapsed_s\": %.3f, \"position\": %" PRIu64
+		        ", \"done\": %.6f, \"numbers_per_s\": %.6g, "
+		        "\"eta_s\": %.1f, \"primes\": %" PRIu64 ", "
+		        "\"rss_kib\": %ld}\n", elapsed, position, done, tel->rate,
+		        eta, primes, rss);
+	}
+	else
+	{
+		format_duration(elapsed, elapsed_text, sizeof(elapsed_text));
+		if(eta >= 0)
+		{
+			format_duration(eta, eta_text, sizeof(eta_text));
+		}
+		else
+		{
+			strcpy(eta_text, "unknown");
+		}
+		/* Start a fresh line if the progress display shares the
+		   terminal */
+		if(isatty(STDOUT_FILENO) && isatty(STDERR_FILENO))
+		{
+			fflush(stdout);
+			fputc('\n', stderr);
+		}
+		fprintf(stderr, "%s: %s in, at %" PRIu64 " (%.1f%%), %.4g "
+		        "numbers/s, %s left, %" PRIu64 " primes so far, RSS %ld "
+		        "KiB\n", yase_program_name, elapsed_text, position,
+		        done * 100, tel->rate, eta_text, primes, rss);
+	}
+	fflush(tel->file);
+}
+
+/* Segment callback: runs the wrapped callback, then writes a snapshot if
+   one is due.  data must point to the struct telemetry. */
+void telemetry_segment(const struct segment * seg, void * data)
+{
+	struct telemetry * tel = data;
+
+	if(tel->inner != NULL)
+	{
+		tel->inner(seg, tel->inner_data);
+	}
+	if(snapshot_due)
+	{
+		snapshot_due = 0;
+		telemetry_snapshot(tel, seg);
+	}
+}
+
+/* Stops the timer, gives SIGALRM and SIGUSR1 back their previous
+   dispositions and closes the telemetry file */
+void telemetry_finish(struct telemetry * tel)
+{
+	struct itimerval timer;
+
+	if(alrm_taken)
+	{
+		memset(&timer, 0, sizeof(timer));
+		setitimer(ITIMER_REAL, &timer, NULL);
+		signal(SIGALRM, previous_alrm);
+		alrm_taken = 0;
+	}
+	if(usr1_taken)
+	{
+		signal(SIGUSR1, previous_usr1);
+		usr1_taken = 0;
+	}
+	if(tel->file != stderr && fclose(tel->file) != 0)
+	{
+		YASE_PERROR("fclose");
+	}
+}
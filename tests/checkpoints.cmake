@@ -0,0 +1,39 @@
+########################################################################
+# yase - tests/checkpoints.cmake                                       #
+# Checks that --checkpoints and --at leave only counts on stdout.      #
+########################################################################
+
+# Run through ctest, which passes YASE, the path of the yase binary.
+# Each run is given --stats as well, since that prints the most text
+# for people; all of it has to go to standard error, so that standard
+# output is exactly the expected "X COUNT" lines.
+
+cmake_minimum_required(VERSION 3.2)
+
+# Runs yase with the given arguments and fails unless it succeeds with
+# exactly expected on standard output
+function(check_counts expected)
+	string(REPLACE ";" " " command "${ARGN}")
+	execute_process(COMMAND ${YASE} ${ARGN}
+		OUTPUT_VARIABLE out
+		ERROR_VARIABLE err
+		RESULT_VARIABLE status)
+	if(NOT status EQUAL 0)
+		message(FATAL_ERROR "yase ${command} failed (${status}):\n${err}")
+	endif()
+	if(NOT out STREQUAL expected)
+		message(FATAL_ERROR "yase ${command} printed:\n${out}"
+		        "but only these counts were expected:\n${expected}")
+	endif()
+endfunction()
+
+set(quarters "0 0\n250000 22044\n500000 41538\n750000 60238\n")
+check_counts("${quarters}1000000 78498\n"
+	0 1000000 --checkpoints 250000 --stats)
+check_counts("1000000 78494\n"
+	10 1000000 --checkpoints 1000000)
+
+file(WRITE checkpoints-at.txt "5000\n100\n")
+check_counts("100 21\n5000 665\n"
+	10 1000000 --at checkpoints-at.txt --stats)
+file(REMOVE checkpoints-at.txt)
@@ -0,0 +1,214 @@
+########################################################################
+# yase - tune.cmake                                                    #
+# Searches for the fastest build parameters on this host.              #
+########################################################################
+
+# Run through "make tune" in a configured build directory, which passes
+# SOURCE_DIR, BINARY_DIR, the C compiler and the current values of each
+# parameter below.
+#
+# The segment sizes, small threshold, bucket size and pre-sieve depth
+# are compile-time constants (they size arrays, and the sieve relies on
+# dividing by powers of two cheaply), so each candidate is a separate
+# build of yase-bench, in BINARY_DIR/tune.  Every build must pass
+# yase-bench --check, and is then timed on a range dominated by small
+# primes and one dominated by large primes.  Its score is its mean time
+# relative to the starting parameters.
+#
+# The search is a coordinate descent: each parameter in turn is tried
+# at every candidate value, with the others held at the best found so
+# far.  The winner is written to BINARY_DIR/tuned.cmake, which
+# CMakeLists.txt includes after config.cmake, so the next build uses it.
+# Delete tuned.cmake to go back to config.cmake alone.
+
+cmake_minimum_required(VERSION 3.2)
+
+# Candidate values.  PRESIEVE_PRIMES stops at 5: 6 needs ~206 MB, and
+# yase-bench does not time the pre-sieve's setup, which would then
+# dominate short runs.
+set(PARAMS LARGE_SEGMENT_BYTES SMALL_SEGMENT_BYTES SMALL_THRESHOLD_FACTOR
+	BUCKET_PRIMES PRESIEVE_PRIMES)
+set(CANDIDATES_LARGE_SEGMENT_BYTES 65536 131072 262144 524288 1048576)
+set(CANDIDATES_SMALL_SEGMENT_BYTES 16384 32768 65536)
+set(CANDIDATES_SMALL_THRESHOLD_FACTOR 1 2 4)
+set(CANDIDATES_BUCKET_PRIMES 256 512 1024 2048 4096)
+set(CANDIDATES_PRESIEVE_PRIMES 4 5)
+
+# Workloads timed, and measured runs of each
+set(TUNE_WORKLOADS --only "pi(1e10)" --only "window(1e15)")
+if(NOT DEFINED TUNE_REPEATS)
+	set(TUNE_REPEATS 3)
+endif()
+
+# A candidate must beat the best so far by this much, in tenths of a
+# percent, to replace it, so that noise does not pick the parameters
+set(TUNE_MARGIN 10)
+
+set(TUNE_DIR "${BINARY_DIR}/tune")
+set(TUNE_LOG "${TUNE_DIR}/tune.log")
+file(MAKE_DIRECTORY "${TUNE_DIR}")
+file(WRITE "${TUNE_LOG}" "")
+
+# Converts a time printed with six decimals to microseconds
+function(to_microseconds time out)
+	string(REPLACE "." "" digits "${time}")
+	string(REGEX REPLACE "^0+" "" digits "${digits}")
+	if(digits STREQUAL "")
+		set(digits 0)
+	endif()
+	set(${out} ${digits} PARENT_SCOPE)
+endfunction()
+
+# Builds and times yase-bench with the parameters in the variables
+# TRY_<param>, setting TIMES to the median of each workload in
+# microseconds, or to an empty list if the build failed or its counts
+# were wrong
+macro(measure_variant)
+	set(key "")
+	set(overrides "")
+	foreach(param ${PARAMS})
+		set(key "${key}-${TRY_${param}}")
+		set(overrides "${overrides}set(${param} ${TRY_${param}})\n")
+	endforeach()
+	string(SUBSTRING "${key}" 1 -1 key)
+	set(dir "${TUNE_DIR}/${key}")
+	set(TIMES "")
+
+	file(REMOVE_RECURSE "${dir}")
+	file(MAKE_DIRECTORY "${dir}")
+	configure_file("${BINARY_DIR}/config.cmake" "${dir}/config.cmake"
+		COPYONLY)
+	file(WRITE "${dir}/tuned.cmake" "${overrides}")
+
+	execute_process(COMMAND ${CMAKE_COMMAND}
+		-DCMAKE_C_COMPILER=${CMAKE_C_COMPILER} "${SOURCE_DIR}"
+		WORKING_DIRECTORY "${dir}" RESULT_VARIABLE failed
+		OUTPUT_VARIABLE output ERROR_VARIABLE output)
+	if(NOT failed)
+		execute_process(COMMAND ${CMAKE_COMMAND} --build .
+			--target yase-bench
+			WORKING_DIRECTORY "${dir}" RESULT_VARIABLE failed
+			OUTPUT_VARIABLE output ERROR_VARIABLE output)
+	endif()
+	if(NOT failed)
+		execute_process(COMMAND "${dir}/yase-bench" --check
+			--repeats ${TUNE_REPEATS} ${TUNE_WORKLOADS}
+			--json "${dir}/results.json"
+			WORKING_DIRECTORY "${dir}" RESULT_VARIABLE failed
+			OUTPUT_VARIABLE output ERROR_VARIABLE output)
+	endif()
+	file(APPEND "${TUNE_LOG}" "==> ${key}\n${output}\n")
+
+	if(NOT failed)
+		file(READ "${dir}/results.json" json)
+		string(REGEX MATCHALL "\"median_s\": [0-9]+\\.[0-9]+" medians
+			"${json}")
+		foreach(median ${medians})
+			string(REGEX REPLACE ".* " "" median "${median}")
+			to_microseconds(${median} us)
+			list(APPEND TIMES ${us})
+		endforeach()
+	else()
+		message("   ${key}: failed (see ${TUNE_LOG})")
+	endif()
+	file(REMOVE_RECURSE "${dir}")
+endmacro()
+
+# Scores TIMES against the starting times, as the mean ratio in tenths
+# of a percent, or leaves SCORE empty if the variant failed
+macro(score_variant)
+	set(SCORE "")
+	list(LENGTH TIMES n_times)
+	list(LENGTH BASE_TIMES n_base)
+	if(n_times EQUAL n_base AND n_times GREATER 0)
+		set(SCORE 0)
+		math(EXPR last "${n_times} - 1")
+		foreach(i RANGE ${last})
+			list(GET TIMES ${i} t)
+			list(GET BASE_TIMES ${i} base)
+			math(EXPR SCORE "${SCORE} + ${t} * 1000 / ${base}")
+		endforeach()
+		math(EXPR SCORE "${SCORE} / ${n_times}")
+	endif()
+endmacro()
+
+# Formats a score as a percentage
+function(format_score score out)
+	math(EXPR whole "${score} / 10")
+	math(EXPR tenth "${score} % 10")
+	set(${out} "${whole}.${tenth}%" PARENT_SCOPE)
+endfunction()
+
+# Start from the current parameters
+message("-- Tuning yase; each candidate is built, checked and timed.")
+message("-- Times are relative to the current parameters.")
+foreach(param ${PARAMS})
+	set(BEST_${param} ${${param}})
+	set(TRY_${param} ${${param}})
+endforeach()
+measure_variant()
+if(TIMES STREQUAL "")
+	message(FATAL_ERROR "The current parameters failed; see ${TUNE_LOG}")
+endif()
+set(BASE_TIMES ${TIMES})
+set(BEST_SCORE 1000)
+set(SCORE_${key} 1000)
+message("   ${key}: 100.0%")
+
+foreach(param ${PARAMS})
+	foreach(value ${CANDIDATES_${param}})
+		foreach(other ${PARAMS})
+			set(TRY_${other} ${BEST_${other}})
+		endforeach()
+		set(TRY_${param} ${value})
+
+		# The large segment must be a multiple of the small segment
+		math(EXPR remainder
+			"${TRY_LARGE_SEGMENT_BYTES} % ${TRY_SMALL_SEGMENT_BYTES}")
+		if(NOT remainder EQUAL 0)
+			continue()
+		endif()
+
+		# Skip variants already measured
+		set(key "")
+		foreach(other ${PARAMS})
+			set(key "${key}-${TRY_${other}}")
+		endforeach()
+		string(SUBSTRING "${key}" 1 -1 key)
+		if(DEFINED SCORE_${key})
+			continue()
+		endif()
+
+		measure_variant()
+		score_variant()
+		set(SCORE_${key} "${SCORE}")
+		if(NOT SCORE STREQUAL "")
+			format_score(${SCORE} pretty)
+			message("   ${key}: ${pretty}")
+			math(EXPR needed "${BEST_SCORE} - ${TUNE_MARGIN}")
+			if(SCORE LESS needed)
+				set(BEST_SCORE ${SCORE})
+				foreach(other ${PARAMS})
+					set(BEST_${other} ${TRY_${other}})
+				endforeach()
+			endif()
+		endif()
+	endforeach()
+endforeach()
+
+# Write the profile, and make the next build reconfigure to pick it up
+format_score(${BEST_SCORE} pretty)
+string(TIMESTAMP now "%Y-%m-%d %H:%M")
+set(profile "# Written by \"make tune\" on ${now}.  These settings took\n")
+set(profile "${profile}# ${pretty} of the time of the ones before them on")
+set(profile "${profile} this host.\n# They override config.cmake; ")
+set(profile "${profile}delete this file to go back.\n")
+foreach(param ${PARAMS})
+	set(profile "${profile}set(${param} ${BEST_${param}})\n")
+	message("-- ${param} ${BEST_${param}}")
+endforeach()
+file(WRITE "${BINARY_DIR}/tuned.cmake" "${profile}")
+execute_process(COMMAND ${CMAKE_COMMAND} -E touch
+	"${BINARY_DIR}/config.cmake")
+message("-- Wrote ${BINARY_DIR}/tuned.cmake (${pretty} of the starting "
+	"time); the next build will use it.")